@@ -10,6 +10,8 @@ AStar::AStar() {
     
     int count = m_size.width * m_size.height;
     m_maxIter = m_size.width * 4;
+    m_reduction = nullptr;
+    m_weight = WeightScale;
     m_map = memoryManager().allocOnStack<bool>(count);
     m_queue.init(m_maxIter, memoryManager().allocOnStack<PriorityQueue<Coord, U32>::Item>(m_maxIter));
     m_cameFrom.init(count, memoryManager().allocOnStack<Coord>(count));
@@ -22,7 +24,81 @@ AStar::AStar() {
             m_map[pathFinder().index(x, y)] = map()->getCell(x, y)->walkable;
 }
 
+AnytimeResult AStar::findAnytime(Coord start, Coord end, Array<vec2>& path, AnytimeParams params) {
+    if (!m_open.ready()) {
+        int count = m_size.width * m_size.height;
+        m_open.init(count);
+        m_scratch.init(count, memoryManager().allocOnStack<vec2>(count));
+    }
+    
+    std::memset(m_cost.buf(), 0xff, m_cost.count() * sizeof(int));
+    int startIdx = pathFinder().index(start.x, start.y);
+    int endIdx = pathFinder().index(end.x, end.y);
+    m_cameFrom[startIdx] = start;
+    m_cost[startIdx] = 0;
+    m_open.start();
+    m_open.push(start, startIdx, 0);
+    
+    AnytimeResult r = runAnytime(params, m_scratch, path, [&](float w, Array<vec2>& p, U32& lowerBound) {
+        m_weight = (U32)(w * WeightScale);
+        improvePath(end);
+        lowerBound = m_open.lowerBound([&](Coord c, int i) { return m_cost[i] + pathFinder().heuristic(c, end); });
+        if (m_cost[endIdx] == AnytimeResult::NotFound)
+            return AnytimeResult::NotFound;
+        
+        for (Coord c = end; c != start; c = m_cameFrom[pathFinder().index(c.x, c.y)])
+            p.push(map()->getPos(c.point()));
+        p.push(map()->getPos(start.point()));
+        return m_cost[endIdx];
+    });
+    m_weight = WeightScale;
+    return r;
+}
+
+void AStar::improvePath(Coord end) {
+    Point2 neighbours[] = {
+        { -1, 0 },
+        { 0, -1 },
+        { 1, 0 },
+        { 0, 1 }
+    };
+    
+    m_open.nextPass([&](Coord c, int i) { return priority(m_cost[i], pathFinder().heuristic(c, end)); });
+    int endIdx = pathFinder().index(end.x, end.y);
+    
+    Coord cur;
+    int curIdx;
+    U32 p;
+    // end is expanded last, so its cost is at most weight times the smallest cost + heuristic left
+    while (m_open.pop(cur, curIdx, p) && m_cost[endIdx] > p) {
+        m_open.close(curIdx);
+        auto relax = [&](Coord next, U32 d) {
+            int nextIdx = pathFinder().index(next.x, next.y);
+            U32 cost = m_cost[curIdx] + d;
+            if (cost >= m_cost[nextIdx])
+                return;
+            m_cost[nextIdx] = cost;
+            m_cameFrom[nextIdx] = cur;
+            m_open.push(next, nextIdx, priority(cost, pathFinder().heuristic(next, end)));
+        };
+        
+        if (m_reduction)
+            m_reduction->forSuccessors(cur, end, relax);
+        else
+            for (Point2 n : neighbours) {
+                Coord next(cur.x + n.x, cur.y + n.y);
+                if (m_map[pathFinder().index(next.x, next.y)])
+                    relax(next, 1);
+            }
+    }
+}
+
 void AStar::find(Coord start, Coord end, Array<vec2>& path) {
+    if (m_reduction) {
+        findReduced(start, end, path);
+        return;
+    }
+    
     Point2 neighbours[] = {
         { -1, 0 },
         { 0, -1 },
@@ -65,8 +141,7 @@ void AStar::find(Coord start, Coord end, Array<vec2>& path) {
                     nearest = dist;
                     bestCoord = next;
                 }
-                U32 priority = cost + dist;
-                m_queue.insert(next, priority);
+                m_queue.insert(next, priority(cost, dist));
                 m_cameFrom[nextIdx] = cur;
             }
         }
@@ -79,3 +154,53 @@ void AStar::find(Coord start, Coord end, Array<vec2>& path) {
     }
     path.push(map()->getPos(start.point()));
 }
+
+void AStar::findReduced(Coord start, Coord end, Array<vec2>& path) {
+    m_queue.clear();
+    std::memset(m_cost.buf(), 0, m_cost.count() * sizeof(int));
+    
+    m_queue.insert(start, 0);
+    int startIdx = pathFinder().index(start.x, start.y);
+    m_cameFrom[startIdx] = start;
+    m_cost[startIdx] = 0;
+    
+    Coord bestCoord = start;
+    U32 nearest = pathFinder().heuristic(start, end);
+    int iter = 0;
+    
+    // macro edges are longer than 1, so costs are relaxed instead of fixed at first visit
+    while (m_queue.count()) {
+        Coord cur = m_queue.pop();
+        int curIdx = pathFinder().index(cur.x, cur.y);
+        iter++;
+        
+        if (cur == end) {
+            bestCoord = end;
+            break;
+        }
+        if (iter == m_maxIter)
+            break;
+        
+        m_reduction->forSuccessors(cur, end, [&](Coord next, U32 d) {
+            int nextIdx = pathFinder().index(next.x, next.y);
+            U32 cost = m_cost[curIdx] + d;
+            if (next == start || (m_cost[nextIdx] && m_cost[nextIdx] <= cost) || m_queue.count() == m_maxIter)
+                return;
+            m_cost[nextIdx] = cost;
+            U32 dist = pathFinder().heuristic(next, end);
+            if (dist < nearest) {
+                nearest = dist;
+                bestCoord = next;
+            }
+            m_queue.insert(next, priority(cost, dist));
+            m_cameFrom[nextIdx] = cur;
+        });
+    }
+    
+    // Create Path, every edge stays inside an empty rectangle, so joints see each other
+    while (bestCoord != start) {
+        path.push(map()->getPos(bestCoord.point()));
+        bestCoord = m_cameFrom[pathFinder().index(bestCoord.x, bestCoord.y)];
+    }
+    path.push(map()->getPos(start.point()));
+}
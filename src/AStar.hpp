@@ -1,15 +1,27 @@
 
 #pragma once
 
+#include "Anytime.hpp"
 #include "Coord.hpp"
+#include "SymmetryReduction.hpp"
 
 class AStar {
 public:
     AStar();
     
     void find(Coord start, Coord end, nook::Array<nook::vec2>& path);
+    // Weighted search, improved while params.microseconds remain
+    AnytimeResult findAnytime(Coord start, Coord end, nook::Array<nook::vec2>& path, AnytimeParams params);
+    
+    bool* walkable() { return m_map; }
+    // Searches only sides of empty rectangles, nullptr returns to the full grid
+    void setReduction(const SymmetryReduction* reduction) { m_reduction = reduction; }
     
 private:
+    static constexpr nook::U32 WeightScale = 256; // weight of heuristic is fixed point
+    
+    nook::U32 priority(nook::U32 cost, nook::U32 h) const { return cost + (h * m_weight) / WeightScale; }
+    
     enum Direction {
         NONE = 0,
         NORTH = 1,
@@ -22,8 +34,16 @@ private:
         SOUTHWEST = 128
     };
     
+    void findReduced(Coord start, Coord end, nook::Array<nook::vec2>& path);
+    // One ARA* pass under m_weight, continues from the open cells of the previous one
+    void improvePath(Coord end);
+    
     nook::Size m_size;
     bool* m_map;
+    const SymmetryReduction* m_reduction;
+    nook::U32 m_weight;
+    AnytimeOpen m_open;
+    nook::Array<nook::vec2> m_scratch;
     nook::U32 m_maxIter;
     nook::PriorityQueue<Coord, nook::U32> m_queue;
     nook::Array<Coord> m_cameFrom;
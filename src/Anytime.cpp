@@ -0,0 +1,78 @@
+
+#include "Anytime.hpp"
+#include "PathFinder.hpp"
+
+using namespace nook;
+
+void AnytimeOpen::init(int cellCount) {
+    m_cellCount = cellCount;
+    m_query = 0;
+    m_pass = 0;
+    m_listed = memoryManager().allocOnStack<U32>(cellCount);
+    m_slot = memoryManager().allocOnStack<U32>(cellCount);
+    m_closed = memoryManager().allocOnStack<U32>(cellCount);
+    m_priority = memoryManager().allocOnStack<U32>(cellCount);
+    std::memset(m_listed, 0, cellCount * sizeof(U32));
+    std::memset(m_closed, 0, cellCount * sizeof(U32));
+    m_cells.init(cellCount, memoryManager().allocOnStack<Coord>(cellCount));
+    m_queue.init(cellCount, memoryManager().allocOnStack<PriorityQueue<Coord, U32>::Item>(cellCount));
+}
+
+void AnytimeOpen::start() {
+    m_query++;
+    m_pass++;
+    m_cells.setCount(0);
+    m_queue.clear();
+}
+
+void AnytimeOpen::push(Coord c, int i, U32 priority) {
+    m_priority[i] = priority;
+    if (m_listed[i] != m_query) {
+        m_listed[i] = m_query;
+        m_slot[i] = m_cells.count();
+        m_cells.push(c);
+    }
+    if (m_closed[i] == m_pass)
+        return;
+    
+    // cell may be queued several times, every open cell fits once
+    if (m_queue.count() == (U32)m_cellCount)
+        rebuild();
+    else
+        m_queue.insert(c, priority);
+}
+
+bool AnytimeOpen::pop(Coord& c, int& i, U32& priority) {
+    while (m_queue.count()) {
+        c = m_queue.pop();
+        i = index(c);
+        if (m_listed[i] == m_query && m_closed[i] != m_pass) {
+            priority = m_priority[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+void AnytimeOpen::close(int i) {
+    m_closed[i] = m_pass;
+    m_listed[i] = 0;
+    
+    Coord last = m_cells[m_cells.count() - 1];
+    m_cells[m_slot[i]] = last;
+    m_slot[index(last)] = m_slot[i];
+    m_cells.setCount(m_cells.count() - 1);
+}
+
+int AnytimeOpen::index(Coord c) const {
+    return pathFinder().index(c.x, c.y);
+}
+
+void AnytimeOpen::rebuild() {
+    m_queue.clear();
+    for (Coord c : m_cells) {
+        int i = index(c);
+        if (m_closed[i] != m_pass)
+            m_queue.insert(c, m_priority[i]);
+    }
+}
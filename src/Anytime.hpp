@@ -0,0 +1,127 @@
+
+#pragma once
+
+#include "Coord.hpp"
+
+#include <chrono>
+
+// ARA*. The first pass uses weight, then the weight is lowered while the budget remains. A pass
+// continues the previous one: cells whose cost dropped after they were expanded are kept as
+// inconsistent and opened again by the next pass, so cost <= weight * shortest path after each pass.
+struct AnytimeParams {
+    float weight = 1.5f;       // of heuristic in the first search
+    float microseconds = 0.0f; // 0 returns the first solution
+};
+
+struct AnytimeResult {
+    static constexpr nook::U32 NotFound = 0xffffffff;
+    
+    nook::U32 cost; // of end, returned path may be shorter, NotFound if end wasn't reached
+    float ratio;    // cost divided by lowerBound, path is at most that many times the shortest
+    float firstMs;  // time to the first solution
+    float totalMs;
+    int searches;
+};
+
+// Open and inconsistent cells of ARA*, kept between passes of one query
+class AnytimeOpen {
+public:
+    AnytimeOpen() : m_listed(nullptr) {}
+    
+    bool ready() const { return m_listed != nullptr; }
+    void init(int cellCount);
+    // New query, all cells are unreached
+    void start();
+    
+    // Cost of cell i dropped, it is opened or left inconsistent if it was expanded in this pass
+    void push(Coord c, int i, nook::U32 priority);
+    // Cell of the smallest priority that isn't expanded in this pass
+    bool pop(Coord& c, int& i, nook::U32& priority);
+    void close(int i);
+    
+    // priority(c, i) gives priority under the new weight
+    template<typename F>
+    void nextPass(F priority) {
+        m_pass++;
+        m_queue.clear();
+        for (Coord c : m_cells) {
+            int i = index(c);
+            m_priority[i] = priority(c, i);
+            m_queue.insert(c, m_priority[i]);
+        }
+    }
+    
+    // Smallest f(c, i) over open and inconsistent cells, NotFound if none is left
+    template<typename F>
+    nook::U32 lowerBound(F f) const {
+        nook::U32 bound = AnytimeResult::NotFound;
+        for (Coord c : m_cells)
+            bound = nook::min2(bound, f(c, index(c)));
+        return bound;
+    }
+    
+private:
+    int index(Coord c) const;
+    // drops stale entries, only cells open in this pass are inserted
+    void rebuild();
+    
+    int m_cellCount;
+    nook::U32 m_query;
+    nook::U32 m_pass;
+    nook::U32* m_listed; // query stamp, cell is in m_cells
+    nook::U32* m_slot;   // position in m_cells
+    nook::U32* m_closed; // pass stamp
+    nook::U32* m_priority;
+    nook::Array<Coord> m_cells;
+    nook::PriorityQueue<Coord, nook::U32> m_queue;
+};
+
+// search(weight, path, lowerBound) runs one pass, pushes path from end to start and returns its cost
+// or NotFound. lowerBound is set to the smallest cost + heuristic of cells left open or inconsistent.
+// Later paths are written to scratch, which must hold the longest path.
+template<typename F>
+AnytimeResult runAnytime(AnytimeParams params, nook::Array<nook::vec2>& scratch, nook::Array<nook::vec2>& path,
+                         F search) {
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point t0 = Clock::now();
+    auto elapsedMs = [&]() {
+        return std::chrono::duration<float, std::milli>(Clock::now() - t0).count();
+    };
+    
+    AnytimeResult r;
+    float w = nook::max2(params.weight, 1.0f);
+    int first = path.count();
+    nook::U32 bound = 0;
+    nook::U32 lowerBound = 0;
+    r.cost = search(w, path, bound);
+    r.firstMs = elapsedMs();
+    r.searches = 1;
+    
+    while (r.cost != AnytimeResult::NotFound) {
+        // every bound is admissible, the largest is kept
+        lowerBound = nook::min2(nook::max2(lowerBound, bound), r.cost);
+        r.ratio = r.cost ? r.cost / nook::max2((float)lowerBound, 1.0f) : 1.0f;
+        if (r.ratio <= 1.0f || w == 1.0f || elapsedMs() * 1000.0f >= params.microseconds)
+            break;
+        
+        // weight above the proven ratio wouldn't improve the path
+        w = nook::min2(1.0f + (w - 1.0f) * 0.5f, r.ratio);
+        if (w < 1.05f)
+            w = 1.0f;
+        
+        scratch.setCount(0);
+        nook::U32 cost = search(w, scratch, bound);
+        r.searches++;
+        if (cost < r.cost) {
+            r.cost = cost;
+            path.setCount(first);
+            for (int i = 0; i < scratch.count(); i++)
+                path.push(scratch[i]);
+        }
+    }
+    
+    if (r.cost == AnytimeResult::NotFound)
+        r.ratio = 0.0f;
+    r.totalMs = elapsedMs();
+    return r;
+}
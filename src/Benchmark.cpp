@@ -0,0 +1,235 @@
+
+#include "Benchmark.hpp"
+#include "Map.hpp"
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+using namespace nook;
+
+namespace {
+    template<typename F>
+    void run(const std::vector<Coord>& pairs, const char* name, F find, BenchmarkResult& r) {
+        using Clock = std::chrono::steady_clock;
+        const int capacity = 1024;
+        vec2 buf[capacity];
+        Array<vec2> path;
+        
+        r.name = name;
+        r.queries = pairs.size() / 2;
+        r.totalMs = 0.0;
+        r.maxMs = 0.0;
+        r.points = 0;
+        r.unreachable = 0;
+        r.memory = 0;
+        
+        for (U32 i = 0; i + 1 < pairs.size(); i += 2) {
+            path.init(capacity, buf);
+            Clock::time_point t = Clock::now();
+            find(pairs[i], pairs[i + 1], path);
+            double ms = std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+            
+            r.totalMs += ms;
+            r.maxMs = max2(r.maxMs, ms);
+            r.points += path.count();
+            if (!path.count() || !(path[0] == map()->getPos(pairs[i + 1].point())))
+                r.unreachable++;
+        }
+    }
+
+    // random pairs of walkable cells, empty if there are none
+    std::vector<Coord> randomPairs(int queries, U32 seed) {
+        nook::Size size = map()->size();
+        std::vector<Coord> cells;
+        for (int y = 1; y < size.height - 1; y++)
+            for (int x = 1; x < size.width - 1; x++)
+                if (map()->getCell(x, y)->walkable)
+                    cells.push_back(Coord(x, y));
+        if (cells.empty())
+            return cells;
+        
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<U32> pick(0, cells.size() - 1);
+        std::vector<Coord> pairs(queries * 2);
+        for (Coord& c : pairs)
+            c = cells[pick(rng)];
+        return pairs;
+    }
+
+    // Joints of rough engines are straight or diagonal runs, each step costs 1
+    U32 moves(const Array<vec2>& path) {
+        U32 cost = 0;
+        for (int i = 0; i + 1 < path.count(); i++) {
+            Point2 a = map()->getCoord(path[i]);
+            Point2 b = map()->getCoord(path[i + 1]);
+            cost += max2(std::abs(a.x - b.x), std::abs(a.y - b.y));
+        }
+        return cost;
+    }
+
+    float length(const Array<vec2>& path) {
+        float len = 0.0f;
+        for (int i = 0; i + 1 < path.count(); i++)
+            len += (path[i + 1] - path[i]).length();
+        return len;
+    }
+
+    // paths go from end to start
+    bool reached(const Array<vec2>& path, Coord end) {
+        return path.count() && path[0] == map()->getPos(end.point());
+    }
+
+    template<typename Engine>
+    U32 exactCost(Engine& engine, Coord start, Coord end, std::vector<vec2>& buf) {
+        Array<vec2> path;
+        path.init(buf.size(), buf.data());
+        AnytimeParams params;
+        params.weight = 1.0f;
+        return engine.findAnytime(start, end, path, params).cost;
+    }
+
+    void begin(CheckResult& r, const char* name) {
+        r.name = name;
+        r.queries = 0;
+        r.unreached = 0;
+        r.mismatches = 0;
+        r.worstRatio = 0.0;
+    }
+
+    // exact is NotFound when A* doesn't reach end, ok is the bound of the engine
+    void record(CheckResult& r, U32 exact, bool reached, double cost, bool ok) {
+        r.queries++;
+        if (exact == AnytimeResult::NotFound) {
+            if (reached)
+                r.mismatches++;
+            return;
+        }
+        if (!reached) {
+            r.unreached++;
+            return;
+        }
+        if (!ok)
+            r.mismatches++;
+        if (exact)
+            r.worstRatio = max2(r.worstRatio, cost / exact);
+    }
+}
+
+void benchmarkRough(JPSplus& jpsPlus, SubgoalGraph& subgoals, int queries, U32 seed, BenchmarkResult results[2]) {
+    std::vector<Coord> pairs = randomPairs(queries, seed);
+    if (pairs.empty())
+        return;
+    
+    run(pairs, "JPS+", [&](Coord s, Coord e, Array<vec2>& path) {
+        jpsPlus.find(s, e, path);
+    }, results[0]);
+    run(pairs, "Subgoal graph", [&](Coord s, Coord e, Array<vec2>& path) {
+        subgoals.find(s, e, path);
+    }, results[1]);
+}
+
+void benchmarkDatabase(JPSplus& jpsPlus, const PathDatabase& database, int queries, U32 seed,
+                       BenchmarkResult results[2]) {
+    std::vector<Coord> pairs = randomPairs(queries, seed);
+    if (pairs.empty())
+        return;
+    
+    run(pairs, "JPS+", [&](Coord s, Coord e, Array<vec2>& path) {
+        jpsPlus.find(s, e, path);
+    }, results[0]);
+    run(pairs, "Path database", [&](Coord s, Coord e, Array<vec2>& path) {
+        database.find(s, e, path);
+    }, results[1]);
+    results[0].memory = jpsPlus.memoryUsage();
+    results[1].memory = database.memoryUsage();
+}
+
+void checkRough(AStar& astar, JPS& jps, LazyTheta& lazyTheta, DStarLite& dstar, JPSplus& jpsPlus, int queries,
+                U32 seed, CheckResult results[3]) {
+    const int GroupSize = 8;
+    std::vector<Coord> pairs = randomPairs(queries, seed);
+    for (U32 i = 0; i + 1 < pairs.size(); i += 2)
+        pairs[i + 1] = pairs[i / (GroupSize * 2) * (GroupSize * 2) + 1];
+    
+    nook::Size size = map()->size();
+    std::vector<vec2> buf(size.width * size.height);
+    Array<vec2> path;
+    begin(results[0], "LazyTheta");
+    begin(results[1], "D* Lite");
+    begin(results[2], "Anchored JPS+");
+    
+    DStarLite::Request request;
+    for (U32 i = 0; i + 1 < pairs.size(); i += 2) {
+        Coord s = pairs[i];
+        Coord e = pairs[i + 1];
+        U32 exact4 = exactCost(astar, s, e, buf);
+        U32 exact8 = exactCost(jps, s, e, buf);
+        
+        path.init(buf.size(), buf.data());
+        lazyTheta.find(s, e, path);
+        float len = length(path);
+        record(results[0], exact4, reached(path, e), len, len <= exact4 + 1e-3f);
+        
+        path.init(buf.size(), buf.data());
+        if (i % (GroupSize * 2) == 0)
+            dstar.plan(request, s, e, path);
+        else
+            dstar.replan(request, s, path);
+        U32 cost = moves(path);
+        record(results[1], exact8, reached(path, e), cost, cost == exact8);
+        
+        path.init(buf.size(), buf.data());
+        jpsPlus.findAnchored(s, e, path);
+        cost = moves(path);
+        record(results[2], exact8, reached(path, e), cost, cost >= exact8);
+    }
+}
+
+void checkNavMesh(AStar& astar, NavMesh& navMesh, int queries, U32 seed, CheckResult& result) {
+    std::vector<Coord> pairs = randomPairs(queries, seed);
+    nook::Size size = map()->size();
+    std::vector<vec2> buf(size.width * size.height);
+    Array<vec2> path;
+    begin(result, "NavMesh");
+    
+    for (U32 i = 0; i + 1 < pairs.size(); i += 2) {
+        Coord s = pairs[i];
+        Coord e = pairs[i + 1];
+        U32 exact = exactCost(astar, s, e, buf);
+        
+        path.init(buf.size(), buf.data());
+        vec2 start = map()->getPos(s.point());
+        vec2 end = map()->getPos(e.point());
+        bool found = navMesh.find(start, end, 0.0f, path);
+        float len = length(path);
+        record(result, exact, found && reached(path, e), len, len + 1e-3f >= (end - start).length());
+    }
+}
+
+void checkAnytime(AStar& astar, JPS& jps, AnytimeParams params, int queries, U32 seed, CheckResult results[2]) {
+    std::vector<Coord> pairs = randomPairs(queries, seed);
+    nook::Size size = map()->size();
+    std::vector<vec2> buf(size.width * size.height);
+    Array<vec2> path;
+    begin(results[0], "Anytime A*");
+    begin(results[1], "Anytime JPS");
+    
+    auto check = [&](CheckResult& r, U32 exact, const AnytimeResult& a) {
+        bool reached = a.cost != AnytimeResult::NotFound;
+        bool ok = a.cost >= exact && a.cost <= max2(params.weight, 1.0f) * exact + 1e-3f && a.cost <= a.ratio * exact + 1e-3f;
+        record(r, exact, reached, a.cost, ok);
+    };
+    
+    for (U32 i = 0; i + 1 < pairs.size(); i += 2) {
+        Coord s = pairs[i];
+        Coord e = pairs[i + 1];
+        U32 exact = exactCost(astar, s, e, buf);
+        path.init(buf.size(), buf.data());
+        check(results[0], exact, astar.findAnytime(s, e, path, params));
+        
+        exact = exactCost(jps, s, e, buf);
+        path.init(buf.size(), buf.data());
+        check(results[1], exact, jps.findAnytime(s, e, path, params));
+    }
+}
@@ -0,0 +1,51 @@
+
+#pragma once
+
+#include "AStar.hpp"
+#include "DStarLite.hpp"
+#include "JPS.hpp"
+#include "JPSplus.hpp"
+#include "LazyTheta.hpp"
+#include "NavMesh.hpp"
+#include "PathDatabase.hpp"
+#include "SubgoalGraph.hpp"
+
+struct BenchmarkResult {
+    const char* name;
+    int queries;
+    double totalMs;
+    double maxMs;
+    nook::U32 points;      // joints in all paths
+    nook::U32 unreachable; // paths that don't end at the requested cell
+    std::size_t memory;    // bytes of tables, 0 if not known
+};
+
+// Same random pairs of walkable cells for both engines, results[0] is JPS+, results[1] subgoal graph
+void benchmarkRough(JPSplus& jpsPlus, SubgoalGraph& subgoals, int queries, nook::U32 seed,
+                    BenchmarkResult results[2]);
+// Same for JPS+ and loaded path database, results[1] is the database
+void benchmarkDatabase(JPSplus& jpsPlus, const PathDatabase& database, int queries, nook::U32 seed,
+                       BenchmarkResult results[2]);
+
+// Path checks against exact costs of A* (ARA* at weight 1) on the same random pairs. AStar gives
+// the cost over 4 neighbours, JPS over the 8 moves of rough engines, both connect the same cells.
+struct CheckResult {
+    const char* name;
+    int queries;
+    nook::U32 unreached;  // A* reached end but the engine stopped before it (iteration limit)
+    nook::U32 mismatches; // end reached that A* can't reach, or cost out of the engine's bound
+    double worstRatio;    // cost divided by the A* cost
+};
+
+// Pairs are grouped by goal, so D* Lite replans and JPS+ keeps its anchored tree. results[0] is LazyTheta
+// (not longer than the 4 neighbour cost), results[1] D* Lite (equal to the 8 move cost), results[2]
+// anchored JPS+ (not shorter than the 8 move cost)
+void checkRough(AStar& astar, JPS& jps, LazyTheta& lazyTheta, DStarLite& dstar, JPSplus& jpsPlus, int queries,
+                nook::U32 seed, CheckResult results[3]);
+// Radius 0, reaches the same ends as A* and isn't shorter than a straight line. The corridor over
+// rectangles isn't the shortest one, so worstRatio against the 4 neighbour cost shows its quality.
+void checkNavMesh(AStar& astar, NavMesh& navMesh, int queries, nook::U32 seed, CheckResult& result);
+// Anytime searches against their own weight 1 cost, which must be within the weight and the reported
+// ratio. results[0] is A*, results[1] JPS
+void checkAnytime(AStar& astar, JPS& jps, AnytimeParams params, int queries, nook::U32 seed,
+                  CheckResult results[2]);
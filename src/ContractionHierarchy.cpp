@@ -0,0 +1,430 @@
+
+#include "ContractionHierarchy.hpp"
+#include "Map.hpp"
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+using namespace nook;
+
+namespace {
+    const U32 FileMagic = 0x4843484e; // NHCH
+    const U32 FileVersion = 1;
+
+    // witness searches give up after this many subgoals, extra shortcuts are still correct
+    const int WitnessLimit = 256;
+
+    struct FileHeader {
+        U32 magic;
+        U32 version;
+        U32 width;
+        U32 height;
+        U32 count;
+        U32 edgeCount;
+    };
+}
+
+// Scratch of one build thread
+struct ContractionHierarchy::Witness {
+    std::vector<U32> cost;
+    std::vector<U32> stamp;
+    std::vector<QueueItem> queue;
+    std::vector<Shortcut> shortcuts;
+    U32 search = 0;
+};
+
+ContractionHierarchy::ContractionHierarchy() {
+    m_graph = nullptr;
+    m_shortcutCount = 0;
+    m_capacity = 0;
+    m_edgeCapacity = 0;
+    m_queueSize = 0;
+    m_meet = None;
+    allocate(0, 0);
+    m_edgeStart[0] = 0;
+}
+
+void ContractionHierarchy::allocate(U32 count, U32 edgeCount) {
+    if (count + 1 > m_capacity) {
+        m_capacity = count + 1;
+        m_edgeStart = memoryManager().allocOnStack<U32>(m_capacity);
+        for (int s = 0; s < 2; s++) {
+            m_cost[s] = memoryManager().allocOnStack<U32>(m_capacity);
+            m_from[s] = memoryManager().allocOnStack<U32>(m_capacity);
+            m_middle[s] = memoryManager().allocOnStack<U32>(m_capacity);
+            m_stamp[s] = memoryManager().allocOnStack<U32>(m_capacity);
+            m_closed[s] = memoryManager().allocOnStack<U32>(m_capacity);
+        }
+        m_reach.init(m_capacity, memoryManager().allocOnStack<SubgoalGraph::Edge>(m_capacity));
+        m_chain.init(m_capacity, memoryManager().allocOnStack<U32>(m_capacity));
+        m_nodes.init(m_capacity, memoryManager().allocOnStack<U32>(m_capacity));
+    }
+    if (edgeCount + 1 > m_edgeCapacity) {
+        m_edgeCapacity = edgeCount + 1;
+        m_edges = memoryManager().allocOnStack<Edge>(m_edgeCapacity);
+    }
+    // seeds of one side and at most one item per relaxed edge, costs only go down
+    U32 queueSize = count + 1 + edgeCount;
+    if (queueSize > m_queueSize) {
+        m_queueSize = queueSize;
+        for (int s = 0; s < 2; s++)
+            m_queue[s].init(queueSize, memoryManager().allocOnStack<PriorityQueue<U32, U32>::Item>(queueSize));
+    }
+    
+    m_count = count;
+    m_edgeCount = edgeCount;
+    for (int s = 0; s < 2; s++) {
+        std::memset(m_stamp[s], 0, m_capacity * sizeof(U32));
+        std::memset(m_closed[s], 0, m_capacity * sizeof(U32));
+    }
+    m_search = 0;
+}
+
+void ContractionHierarchy::addEdge(std::vector<Edge>& edges, Edge e) {
+    for (Edge& o : edges)
+        if (o.to == e.to) {
+            if (e.cost < o.cost)
+                o = e;
+            return;
+        }
+    edges.push_back(e);
+}
+
+void ContractionHierarchy::findShortcuts(const Adjacency& adj, const std::vector<U8>& flagged, U32 v,
+                                         Witness& w, std::vector<Shortcut>& out) {
+    const std::vector<Edge>& nbrs = adj[v];
+    for (U32 i = 0; i < nbrs.size(); i++) {
+        U32 u = nbrs[i].to;
+        U32 limit = 0;
+        for (U32 j = i + 1; j < nbrs.size(); j++)
+            limit = max2(limit, nbrs[i].cost + nbrs[j].cost);
+        if (!limit)
+            continue;
+        
+        // Dijkstra from u bounded by the longest path over v
+        w.search++;
+        w.queue.clear();
+        w.cost[u] = 0;
+        w.stamp[u] = w.search;
+        w.queue.push_back({ 0, u });
+        int settled = 0;
+        while (w.queue.size() && settled < WitnessLimit) {
+            std::pop_heap(w.queue.begin(), w.queue.end());
+            QueueItem it = w.queue.back();
+            w.queue.pop_back();
+            if (it.cost > w.cost[it.node])
+                continue;
+            if (it.cost > limit)
+                break;
+            settled++;
+            
+            for (const Edge& e : adj[it.node]) {
+                if (e.to == v || flagged[e.to])
+                    continue;
+                U32 c = it.cost + e.cost;
+                if (w.stamp[e.to] == w.search && w.cost[e.to] <= c)
+                    continue;
+                w.stamp[e.to] = w.search;
+                w.cost[e.to] = c;
+                w.queue.push_back({ c, e.to });
+                std::push_heap(w.queue.begin(), w.queue.end());
+            }
+        }
+        
+        for (U32 j = i + 1; j < nbrs.size(); j++) {
+            U32 c = nbrs[i].cost + nbrs[j].cost;
+            U32 t = nbrs[j].to;
+            if (w.stamp[t] != w.search || w.cost[t] > c)
+                out.push_back({ u, { t, c, v } });
+        }
+    }
+}
+
+void ContractionHierarchy::build(const SubgoalGraph& graph, int threadCount) {
+    threadCount = resolveThreadCount(threadCount);
+    m_graph = &graph;
+    m_count = graph.subgoalCount();
+    
+    Adjacency adj(m_count);
+    for (U32 i = 0; i < m_count; i++)
+        for (const SubgoalGraph::Edge* e = graph.edges(i); e != graph.edges(i + 1); e++)
+            addEdge(adj[i], { e->to, e->cost, None });
+    
+    std::vector<Witness> witness(threadCount);
+    for (Witness& w : witness) {
+        w.cost.resize(m_count);
+        w.stamp.assign(m_count, 0);
+    }
+    
+    Adjacency up(m_count);
+    std::vector<U8> flagged(m_count, 0);
+    std::vector<int> deleted(m_count, 0);
+    std::vector<int> priority(m_count);
+    std::vector<std::vector<Shortcut>> shortcuts(m_count);
+    std::vector<U32> remaining(m_count);
+    for (U32 i = 0; i < m_count; i++)
+        remaining[i] = i;
+    
+    while (remaining.size()) {
+        // Edge difference of every remaining subgoal, threads only read the graph
+        parallelFor(remaining.size(), threadCount, [&](int t, int begin, int end) {
+            Witness& w = witness[t];
+            for (int i = begin; i < end; i++) {
+                U32 v = remaining[i];
+                w.shortcuts.clear();
+                findShortcuts(adj, flagged, v, w, w.shortcuts);
+                priority[v] = (int)w.shortcuts.size() - (int)adj[v].size() + deleted[v];
+            }
+        });
+        
+        // Local minima are independent, so they are contracted together
+        std::vector<U32> round;
+        std::vector<U32> rest;
+        for (U32 v : remaining) {
+            bool minimum = true;
+            for (const Edge& e : adj[v])
+                if (priority[e.to] < priority[v] || (priority[e.to] == priority[v] && e.to < v)) {
+                    minimum = false;
+                    break;
+                }
+            (minimum ? round : rest).push_back(v);
+        }
+        
+        // Witnesses must not pass subgoals contracted in the same round
+        for (U32 v : round)
+            flagged[v] = 1;
+        parallelFor(round.size(), threadCount, [&](int t, int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                U32 v = round[i];
+                shortcuts[v].clear();
+                findShortcuts(adj, flagged, v, witness[t], shortcuts[v]);
+            }
+        });
+        
+        // Remaining neighbours are higher in the hierarchy
+        for (U32 v : round) {
+            up[v] = adj[v];
+            for (const Edge& e : adj[v]) {
+                std::vector<Edge>& nbrs = adj[e.to];
+                for (U32 k = 0; k < nbrs.size(); k++)
+                    if (nbrs[k].to == v) {
+                        nbrs[k] = nbrs.back();
+                        nbrs.pop_back();
+                        break;
+                    }
+                deleted[e.to]++;
+            }
+            for (const Shortcut& s : shortcuts[v]) {
+                addEdge(adj[s.from], s.edge);
+                addEdge(adj[s.edge.to], { s.from, s.edge.cost, s.edge.middle });
+            }
+            adj[v].clear();
+            std::vector<Shortcut>().swap(shortcuts[v]);
+        }
+        remaining.swap(rest);
+    }
+    
+    U32 edgeCount = 0;
+    for (U32 v = 0; v < m_count; v++)
+        edgeCount += up[v].size();
+    allocate(m_count, edgeCount);
+    
+    U32 e = 0;
+    m_shortcutCount = 0;
+    for (U32 v = 0; v < m_count; v++) {
+        m_edgeStart[v] = e;
+        for (const Edge& u : up[v]) {
+            m_edges[e++] = u;
+            m_shortcutCount += u.middle != None;
+        }
+    }
+    m_edgeStart[m_count] = e;
+}
+
+bool ContractionHierarchy::save(const char* file) const {
+    FILE* f = std::fopen(file, "wb");
+    if (!f)
+        return false;
+    
+    nook::Size size = map()->size();
+    FileHeader h = { FileMagic, FileVersion, (U32)size.width, (U32)size.height, m_count, m_edgeCount };
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && std::fwrite(m_edgeStart, sizeof(U32), m_count + 1, f) == m_count + 1;
+    ok = ok && std::fwrite(m_edges, sizeof(Edge), m_edgeCount, f) == m_edgeCount;
+    return std::fclose(f) == 0 && ok;
+}
+
+bool ContractionHierarchy::load(const SubgoalGraph& graph, const char* file) {
+    FILE* f = std::fopen(file, "rb");
+    if (!f)
+        return false;
+    
+    nook::Size size = map()->size();
+    FileHeader h;
+    bool ok = std::fread(&h, sizeof(h), 1, f) == 1;
+    ok = ok && h.magic == FileMagic && h.version == FileVersion;
+    ok = ok && h.width == (U32)size.width && h.height == (U32)size.height && h.count == graph.subgoalCount();
+    if (ok) {
+        allocate(h.count, h.edgeCount);
+        ok = std::fread(m_edgeStart, sizeof(U32), h.count + 1, f) == h.count + 1;
+        ok = ok && std::fread(m_edges, sizeof(Edge), h.edgeCount, f) == h.edgeCount;
+        ok = ok && m_edgeStart[h.count] == h.edgeCount;
+    }
+    std::fclose(f);
+    
+    if (!ok) {
+        m_graph = nullptr;
+        m_count = 0;
+        m_edgeCount = 0;
+        m_edgeStart[0] = 0;
+        return false;
+    }
+    
+    m_graph = &graph;
+    m_shortcutCount = 0;
+    for (U32 e = 0; e < m_edgeCount; e++)
+        m_shortcutCount += m_edges[e].middle != None;
+    return true;
+}
+
+const ContractionHierarchy::Edge& ContractionHierarchy::findEdge(U32 lower, U32 higher) const {
+    for (U32 e = m_edgeStart[lower]; e < m_edgeStart[lower + 1]; e++)
+        if (m_edges[e].to == higher)
+            return m_edges[e];
+    ASSERT(false);
+    return m_edges[m_edgeStart[lower]];
+}
+
+void ContractionHierarchy::seed(int side, Coord c) {
+    m_reach.setCount(0);
+    m_graph->reachable(c, m_reach);
+    for (const SubgoalGraph::Edge& r : m_reach)
+        relax(side, None, { r.to, r.cost, None });
+}
+
+void ContractionHierarchy::relax(int side, U32 v, const Edge& e) {
+    U32 cost = e.cost + (v == None ? 0 : m_cost[side][v]);
+    if (m_stamp[side][e.to] == m_search && m_cost[side][e.to] <= cost)
+        return;
+    
+    m_stamp[side][e.to] = m_search;
+    m_cost[side][e.to] = cost;
+    m_from[side][e.to] = v;
+    m_middle[side][e.to] = e.middle;
+    m_queue[side].insert(e.to, cost);
+}
+
+bool ContractionHierarchy::stalled(int side, U32 v) const {
+    // higher subgoal reaches v shorter going down, so v is not on a shortest upward path
+    for (U32 e = m_edgeStart[v]; e < m_edgeStart[v + 1]; e++) {
+        U32 w = m_edges[e].to;
+        if (m_stamp[side][w] == m_search && m_cost[side][w] + m_edges[e].cost < m_cost[side][v])
+            return true;
+    }
+    return false;
+}
+
+U32 ContractionHierarchy::search(Coord start, Coord end) {
+    m_meet = None;
+    if (!m_graph || !m_graph->sameArea(start, end))
+        return None;
+    
+    // diagonal then straight is always the shortest
+    Coord bend;
+    if (m_graph->directBend(start, end, bend))
+        return max2(std::abs((int)start.x - (int)end.x), std::abs((int)start.y - (int)end.y));
+    
+    m_search++;
+    m_queue[0].clear();
+    m_queue[1].clear();
+    seed(0, start);
+    seed(1, end);
+    
+    U32 best = None;
+    bool done[2] = { false, false };
+    int side = 0;
+    while (!done[0] || !done[1]) {
+        if (done[side])
+            side ^= 1;
+        // stale items are skipped, the first one not cheaper than best ends the side
+        PriorityQueue<U32, U32>& q = m_queue[side];
+        U32 v = None;
+        while (q.count() && v == None) {
+            v = q.pop();
+            if (m_closed[side][v] == m_search)
+                v = None;
+        }
+        if (v == None || m_cost[side][v] >= best) {
+            done[side] = true;
+            continue;
+        }
+        m_closed[side][v] = m_search;
+        U32 cost = m_cost[side][v];
+        
+        if (m_stamp[side ^ 1][v] == m_search && cost + m_cost[side ^ 1][v] < best) {
+            best = cost + m_cost[side ^ 1][v];
+            m_meet = v;
+        }
+        if (!stalled(side, v))
+            for (U32 e = m_edgeStart[v]; e < m_edgeStart[v + 1]; e++)
+                relax(side, v, m_edges[e]);
+        side ^= 1;
+    }
+    return best;
+}
+
+void ContractionHierarchy::unpack(U32 from, U32 to, U32 middle) {
+    if (middle == None) {
+        m_nodes.push(to);
+        return;
+    }
+    // middle was contracted before both ends, so both halves are its edges
+    unpack(from, middle, findEdge(middle, from).middle);
+    unpack(middle, to, findEdge(middle, to).middle);
+}
+
+U32 ContractionHierarchy::distance(Coord start, Coord end) {
+    if (start == end)
+        return 0;
+    return search(start, end);
+}
+
+bool ContractionHierarchy::find(Coord start, Coord end, Array<vec2>& path) {
+    if (start == end) {
+        path.push(map()->getPos(start.point()));
+        return true;
+    }
+    if (search(start, end) == None) {
+        path.push(map()->getPos(start.point()));
+        return false;
+    }
+    
+    // subgoals from start to end, empty when end is reached directly
+    m_nodes.setCount(0);
+    if (m_meet != None) {
+        m_chain.setCount(0);
+        for (U32 v = m_meet; v != None; v = m_from[0][v])
+            m_chain.push(v);
+        m_nodes.push(m_chain[m_chain.count() - 1]);
+        for (int i = m_chain.count() - 1; i > 0; i--)
+            unpack(m_chain[i], m_chain[i - 1], m_middle[0][m_chain[i - 1]]);
+        for (U32 v = m_meet; m_from[1][v] != None; v = m_from[1][v])
+            unpack(v, m_from[1][v], m_middle[1][v]);
+    }
+    
+    // Create Path, every edge gets its bend back
+    Coord bend;
+    Coord b = end;
+    path.push(map()->getPos(end.point()));
+    for (int i = m_nodes.count(); i >= 0; i--) {
+        Coord a = i ? m_graph->subgoal(m_nodes[i - 1]) : start;
+        if (a == b)
+            continue;
+        if (m_graph->directBend(a, b, bend) && bend != a && bend != b)
+            path.push(map()->getPos(bend.point()));
+        path.push(map()->getPos(a.point()));
+        b = a;
+    }
+    return true;
+}
@@ -0,0 +1,96 @@
+
+#pragma once
+
+#include "SubgoalGraph.hpp"
+
+#include <vector>
+
+// Contraction hierarchy over subgoals, the cells next to convex corners where JPS+ jumps stop.
+// Built offline for static maps. Query is two small searches going only up the hierarchy,
+// start and end are connected to it by the same straight and diagonal probes as in SubgoalGraph.
+// The result and query state are kept in stack memory, build or load of a bigger hierarchy
+// takes new memory, the old one is not returned.
+class ContractionHierarchy {
+public:
+    static constexpr nook::U32 None = 0xffffffff;
+    
+    ContractionHierarchy();
+    
+    // Contracts subgoals by rounds of independent ones with the lowest edge difference.
+    // threadCount <= 0 uses all hardware threads, result is the same for any count.
+    // Graph must outlive the hierarchy.
+    void build(const SubgoalGraph& graph, int threadCount = 0);
+    // Binary file, load fails if it was saved for other map
+    bool save(const char* file) const;
+    bool load(const SubgoalGraph& graph, const char* file);
+    
+    // Length of the shortest path without unpacking, None if end is unreachable
+    nook::U32 distance(Coord start, Coord end);
+    // Unpacks shortcuts into grid joints. Returns false if end is unreachable, path contains only start then
+    bool find(Coord start, Coord end, nook::Array<nook::vec2>& path);
+    
+    nook::U32 shortcutCount() const { return m_shortcutCount; }
+    
+private:
+    struct Edge {
+        nook::U32 to;
+        nook::U32 cost;
+        nook::U32 middle; // contracted subgoal of shortcut, None for edge of the graph
+    };
+    
+    struct Shortcut {
+        nook::U32 from;
+        Edge edge;
+    };
+    
+    struct QueueItem {
+        nook::U32 cost;
+        nook::U32 node;
+        
+        // std heap is max-heap, lowest cost goes first
+        bool operator<(const QueueItem& i) const { return cost > i.cost; }
+    };
+    
+    // build scratch, offline only
+    struct Witness;
+    
+    using Adjacency = std::vector<std::vector<Edge>>;
+    
+    static void addEdge(std::vector<Edge>& edges, Edge e);
+    // Shortcuts between neighbours of v without other path of the same length that avoids flagged subgoals
+    static void findShortcuts(const Adjacency& adj, const std::vector<nook::U8>& flagged, nook::U32 v,
+                              Witness& w, std::vector<Shortcut>& out);
+    // memory for count subgoals and edgeCount upward edges, query state is reset
+    void allocate(nook::U32 count, nook::U32 edgeCount);
+    
+    const Edge& findEdge(nook::U32 lower, nook::U32 higher) const;
+    void seed(int side, Coord c);
+    void relax(int side, nook::U32 v, const Edge& e);
+    bool stalled(int side, nook::U32 v) const;
+    nook::U32 search(Coord start, Coord end);
+    // appends subgoals after from up to to
+    void unpack(nook::U32 from, nook::U32 to, nook::U32 middle);
+    
+    const SubgoalGraph* m_graph;
+    nook::U32 m_count;
+    nook::U32 m_edgeCount;
+    nook::U32 m_shortcutCount;
+    nook::U32 m_capacity;
+    nook::U32 m_edgeCapacity;
+    nook::U32* m_edgeStart; // edges of v going up are [m_edgeStart[v], m_edgeStart[v + 1])
+    Edge* m_edges;
+    
+    // per query state indexed by subgoal id, side 0 goes from start and 1 from end
+    nook::PriorityQueue<nook::U32, nook::U32> m_queue[2];
+    nook::U32 m_queueSize;
+    nook::U32* m_cost[2];
+    nook::U32* m_from[2];   // previous subgoal or None for the first one
+    nook::U32* m_middle[2]; // middle of the edge from previous
+    nook::U32* m_stamp[2];  // cost is valid when equals m_search
+    nook::U32* m_closed[2]; // expanded when equals m_search
+    nook::U32 m_search;
+    nook::U32 m_meet;
+    nook::Array<SubgoalGraph::Edge> m_reach;
+    nook::Array<nook::U32> m_chain;
+    nook::Array<nook::U32> m_nodes;
+};
@@ -0,0 +1,297 @@
+
+#include "DStarLite.hpp"
+#include "PathFinder.hpp"
+#include "Map.hpp"
+
+using namespace nook;
+
+DStarLite::Request::Request() {
+    m_owner = nullptr;
+    m_search = -1;
+    m_km = 0;
+    m_expanded = 0;
+}
+
+DStarLite::Request::~Request() {
+    if (m_owner)
+        m_owner->stop(*this);
+}
+
+DStarLite::DStarLite(int maxRequests) {
+    m_size = map()->size();
+    
+    int count = m_size.width * m_size.height;
+    m_maxIter = count;
+    m_map = memoryManager().allocOnStack<bool>(count);
+    for (int y = 0; y < m_size.height; y++)
+        for (int x = 0; x < m_size.width; x++)
+            m_map[pathFinder().index(x, y)] = map()->getCell(x, y)->walkable;
+    
+    // arrays of a search are allocated when it is used first
+    m_maxRequests = maxRequests;
+    m_searches = memoryManager().allocOnStack<Search>(maxRequests);
+    for (int i = 0; i < maxRequests; i++) {
+        m_searches[i].request = nullptr;
+        m_searches[i].nodes = nullptr;
+    }
+}
+
+DStarLite::~DStarLite() {
+    for (int i = 0; i < m_maxRequests; i++)
+        if (m_searches[i].request)
+            m_searches[i].request->m_owner = nullptr;
+}
+
+void DStarLite::stop(Request& r) {
+    if (r.m_owner != this)
+        return;
+    m_searches[r.m_search].request = nullptr;
+    r.m_owner = nullptr;
+    r.m_search = -1;
+}
+
+void DStarLite::update(Rect dirty) {
+    int x0 = max2(dirty.x, 1);
+    int y0 = max2(dirty.y, 1);
+    int x1 = min2(dirty.x + dirty.width, m_size.width - 2);
+    int y1 = min2(dirty.y + dirty.height, m_size.height - 2);
+    
+    for (int y = y0; y <= y1; y++)
+        for (int x = x0; x <= x1; x++)
+            setWalkable(x, y, map()->getCell(x, y)->walkable && !pathFinder().occupancy()->occupied(x, y));
+}
+
+void DStarLite::setWalkable(int x, int y, bool walkable) {
+    int i = pathFinder().index(x, y);
+    if (m_map[i] == walkable)
+        return;
+    m_map[i] = walkable;
+    
+    for (int k = 0; k < m_maxRequests; k++) {
+        Search& s = m_searches[k];
+        if (!s.request)
+            continue;
+        Node& n = node(s, i);
+        if (!n.changed) {
+            n.changed = true;
+            s.changed.push(i);
+        }
+    }
+}
+
+bool DStarLite::plan(Request& r, Coord start, Coord goal, Array<vec2>& path) {
+    stop(r);
+    
+    int k = 0;
+    while (k < m_maxRequests && m_searches[k].request)
+        k++;
+    if (k == m_maxRequests) {
+        path.push(map()->getPos(start.point()));
+        return false;
+    }
+    
+    Search& s = m_searches[k];
+    if (!s.nodes) {
+        int count = m_size.width * m_size.height;
+        s.stamp = 0;
+        s.nodes = memoryManager().allocOnStack<Node>(count);
+        for (int i = 0; i < count; i++)
+            s.nodes[i].stamp = 0;
+        s.queue.init(count, memoryManager().allocOnStack<PriorityQueue<Entry, U64>::Item>(count));
+        s.changed.init(count, memoryManager().allocOnStack<U32>(count));
+    }
+    // nodes of the previous request become Inf
+    s.stamp++;
+    s.request = &r;
+    s.queue.clear();
+    s.changed.setCount(0);
+    
+    r.m_owner = this;
+    r.m_search = k;
+    r.m_start = start;
+    r.m_goal = goal;
+    r.m_km = 0;
+    r.m_expanded = 0;
+    
+    U32 gi = index(goal);
+    Node& n = node(s, gi);
+    n.rhs = m_map[gi] ? 0 : Inf;
+    if (n.rhs == 0) {
+        n.key = calcKey(r, gi, n);
+        n.open = true;
+        push(s, gi, n.key);
+    }
+    
+    computePath(r);
+    return pushPath(r, path);
+}
+
+bool DStarLite::replan(Request& r, Coord start, Array<vec2>& path) {
+    ASSERT(r.m_owner == this);
+    Search& s = m_searches[r.m_search];
+    r.m_expanded = 0;
+    
+    // keys already in queue stay valid when every new one grows by the distance walked
+    r.m_km += pathFinder().heuristic(r.m_start, start);
+    r.m_start = start;
+    
+    // costs of moves into, out of and diagonally past changed cells are different now
+    for (U32 i : s.changed) {
+        s.nodes[i].changed = false;
+        Coord c = coord(i);
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++)
+                updateVertex(r, index(Coord(c.x + dx, c.y + dy)));
+    }
+    s.changed.setCount(0);
+    
+    computePath(r);
+    return pushPath(r, path);
+}
+
+DStarLite::Node& DStarLite::node(Search& s, U32 cell) const {
+    Node& n = s.nodes[cell];
+    if (n.stamp != s.stamp) {
+        n.key = InfKey;
+        n.stamp = s.stamp;
+        n.g = Inf;
+        n.rhs = Inf;
+        n.open = false;
+        n.changed = false;
+    }
+    return n;
+}
+
+U64 DStarLite::calcKey(const Request& r, U32 cell, const Node& n) const {
+    U32 m = min2(n.g, n.rhs);
+    if (m == Inf)
+        return InfKey;
+    U64 k1 = m + pathFinder().heuristic(r.m_start, coord(cell)) + r.m_km;
+    return (k1 << 32) | m;
+}
+
+void DStarLite::push(Search& s, U32 cell, U64 key) {
+    // older entries of a cell stay queued, every open node fits once
+    if (s.queue.count() == (U32)(m_size.width * m_size.height)) {
+        s.queue.clear();
+        for (int i = 0; i < m_size.width * m_size.height; i++) {
+            const Node& n = s.nodes[i];
+            if (n.stamp == s.stamp && n.open && (U32)i != cell)
+                s.queue.insert({ (U32)i, n.key }, n.key);
+        }
+    }
+    s.queue.insert({ cell, key }, key);
+}
+
+void DStarLite::updateVertex(Request& r, U32 cell) {
+    Coord c = coord(cell);
+    if (c.x == 0 || c.y == 0 || c.x >= m_size.width - 1 || c.y >= m_size.height - 1)
+        return;
+    
+    Search& s = m_searches[r.m_search];
+    U32 rhs = Inf;
+    if (c == r.m_goal)
+        rhs = m_map[cell] ? 0 : Inf;
+    else if (m_map[cell])
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++)
+                if ((dx || dy) && canMove(c, dx, dy))
+                    rhs = min2(rhs, g(s, index(Coord(c.x + dx, c.y + dy))) + 1);
+    
+    if (rhs == Inf && s.nodes[cell].stamp != s.stamp)
+        return;
+    
+    Node& n = node(s, cell);
+    n.rhs = rhs;
+    n.open = n.g != n.rhs;
+    if (n.open) {
+        n.key = calcKey(r, cell, n);
+        push(s, cell, n.key);
+    }
+}
+
+void DStarLite::computePath(Request& r) {
+    Search& s = m_searches[r.m_search];
+    U32 si = index(r.m_start);
+    U32 iter = 0;
+    while (s.queue.count() && iter < m_maxIter) {
+        Entry top = s.queue.pop();
+        Node& n = s.nodes[top.cell];
+        if (!n.open || top.key != n.key)
+            continue;
+        
+        // start is consistent and no key is below its one, top goes back for the next replan
+        Node& sn = node(s, si);
+        if (top.key >= calcKey(r, si, sn) && sn.rhs == sn.g) {
+            s.queue.insert(top, top.key);
+            break;
+        }
+        iter++;
+        
+        U64 knew = calcKey(r, top.cell, n);
+        if (top.key < knew) {
+            n.key = knew;
+            push(s, top.cell, knew);
+            continue;
+        }
+        
+        Coord c = coord(top.cell);
+        r.m_expanded++;
+        n.open = false;
+        if (n.g > n.rhs)
+            n.g = n.rhs;
+        else {
+            n.g = Inf;
+            updateVertex(r, top.cell);
+        }
+        // moves are symmetric, so predecessors are the neighbours
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++)
+                if ((dx || dy) && canMove(c, dx, dy))
+                    updateVertex(r, index(Coord(c.x + dx, c.y + dy)));
+    }
+}
+
+bool DStarLite::pushPath(Request& r, Array<vec2>& path) const {
+    const Search& s = m_searches[r.m_search];
+    Coord c = r.m_start;
+    if (!m_map[index(c)] || g(s, index(c)) >= Inf) {
+        path.push(map()->getPos(c.point()));
+        return false;
+    }
+    
+    // Joints from start to goal where direction changes, reversed at the end
+    int first = path.count();
+    path.push(map()->getPos(c.point()));
+    int ldx = 0;
+    int ldy = 0;
+    for (U32 steps = 0; c != r.m_goal && steps < m_maxIter; steps++) {
+        U32 best = g(s, index(c));
+        int bdx = 0;
+        int bdy = 0;
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++) {
+                if ((!dx && !dy) || !canMove(c, dx, dy))
+                    continue;
+                U32 ng = g(s, index(Coord(c.x + dx, c.y + dy)));
+                if (ng < best) {
+                    best = ng;
+                    bdx = dx;
+                    bdy = dy;
+                }
+            }
+        if (!bdx && !bdy)
+            break;
+        if ((bdx != ldx || bdy != ldy) && (ldx || ldy))
+            path.push(map()->getPos(c.point()));
+        ldx = bdx;
+        ldy = bdy;
+        c = Coord(c.x + bdx, c.y + bdy);
+    }
+    if (ldx || ldy)
+        path.push(map()->getPos(c.point()));
+    
+    for (int i = first, j = path.count() - 1; i < j; i++, j--)
+        std::swap(path[i], path[j]);
+    return c == r.m_goal;
+}
@@ -0,0 +1,107 @@
+
+#pragma once
+
+#include "Coord.hpp"
+
+// Incremental rough search. Every persistent request keeps its search tree, which grows from
+// the goal, so walls changed by update() repair only costs that went through them and a unit
+// that walked on reuses the tree. Moves are the same as in JPS: 8 directions, walls are not cut.
+// Owned by PathFinder, cells occupied by big obstacles are blocked as well.
+class DStarLite {
+public:
+    class Request;
+    
+    // At most maxRequests are planned at once, each one keeps arrays of the whole map
+    DStarLite(int maxRequests);
+    ~DStarLite();
+    
+    // Starts new search for the request, it is kept up to date until stop().
+    // Returns false if goal is unreachable or maxRequests requests are active.
+    bool plan(Request& r, Coord start, Coord goal, nook::Array<nook::vec2>& path);
+    // Path from the new position of the unit after changes since the last call.
+    // Returns false if goal became unreachable, path contains only start then.
+    bool replan(Request& r, Coord start, nook::Array<nook::vec2>& path);
+    void stop(Request& r);
+    
+    // Walkability of cells inside dirty was changed in the map
+    void update(nook::Rect dirty);
+    // Cell inside the map border changed, called by update() and Occupancy
+    void setWalkable(int x, int y, bool walkable);
+    
+    // Search state of one unit. One request is planned by one engine at a time.
+    class Request {
+    public:
+        Request();
+        ~Request();
+        
+        bool active() const { return m_owner != nullptr; }
+        // number of vertices expanded by the last plan() or replan()
+        nook::U32 expanded() const { return m_expanded; }
+        
+    private:
+        friend class DStarLite;
+        
+        Request(const Request&) = delete;
+        Request& operator=(const Request&) = delete;
+        
+        DStarLite* m_owner;
+        int m_search; // in owner
+        Coord m_start;
+        Coord m_goal;
+        nook::U32 m_km;
+        nook::U32 m_expanded;
+    };
+    
+private:
+    static constexpr nook::U32 Inf = 0x7fffffff;
+    static constexpr nook::U64 InfKey = ((nook::U64)Inf << 32) | Inf;
+    
+    struct Node {
+        nook::U64 key;     // of the last queue entry, older entries are skipped
+        nook::U32 stamp;   // of the search, older nodes have g and rhs Inf
+        nook::U32 g;
+        nook::U32 rhs;
+        bool open;
+        bool changed;      // in Search::changed
+    };
+    
+    struct Entry {
+        nook::U32 cell;
+        nook::U64 key;
+    };
+    
+    // Cell arrays of one request, reused by the next one
+    struct Search {
+        Request* request; // nullptr if free
+        nook::U32 stamp;
+        Node* nodes;
+        nook::PriorityQueue<Entry, nook::U64> queue;
+        nook::Array<nook::U32> changed; // cells changed since the last replan()
+    };
+    
+    int index(Coord c) const { return c.y * m_size.width + c.x; }
+    Coord coord(nook::U32 i) const { return Coord(i % m_size.width, i / m_size.width); }
+    // one step, diagonal doesn't cut walls
+    bool canMove(Coord c, int dx, int dy) const {
+        int i = index(c);
+        return m_map[i] && m_map[i + dy * m_size.width + dx] &&
+               (!dx || !dy || (m_map[i + dx] && m_map[i + dy * m_size.width]));
+    }
+    nook::U32 g(const Search& s, nook::U32 cell) const {
+        const Node& n = s.nodes[cell];
+        return n.stamp == s.stamp ? n.g : Inf;
+    }
+    Node& node(Search& s, nook::U32 cell) const;
+    
+    nook::U64 calcKey(const Request& r, nook::U32 cell, const Node& n) const;
+    void push(Search& s, nook::U32 cell, nook::U64 key);
+    void updateVertex(Request& r, nook::U32 cell);
+    void computePath(Request& r);
+    bool pushPath(Request& r, nook::Array<nook::vec2>& path) const;
+    
+    nook::Size m_size;
+    bool* m_map;
+    nook::U32 m_maxIter;
+    int m_maxRequests;
+    Search* m_searches;
+};
@@ -16,12 +16,61 @@ JPS::JPS() {
     m_cost.init(count, memoryManager().allocOnStack<U32>(count));
     m_cameFrom.setCount(count);
     m_cost.setCount(count);
+    m_weight = WeightScale;
+    m_anytime = false;
     
     for (int y = 0; y < m_size.height; y++)
         for (int x = 0; x < m_size.width; x++)
             m_map[pathFinder().index(x, y)] = map()->getCell(x, y)->walkable;
 }
 
+AnytimeResult JPS::findAnytime(Coord start, Coord end, Array<vec2>& path, AnytimeParams params) {
+    if (!m_open.ready()) {
+        int count = m_size.width * m_size.height;
+        m_open.init(count);
+        m_scratch.init(count, memoryManager().allocOnStack<vec2>(count));
+    }
+    
+    std::memset(m_cost.buf(), 0xff, m_cost.count() * sizeof(int));
+    int startIdx = pathFinder().index(start.x, start.y);
+    int endIdx = pathFinder().index(end.x, end.y);
+    m_cameFrom[startIdx] = start;
+    m_cost[startIdx] = 0;
+    m_open.start();
+    m_open.push(start, startIdx, 0);
+    // nothing is closer than end, so jumps don't track the nearest cell
+    m_best = end;
+    m_bestH = 0;
+    m_bestC = 0;
+    
+    m_anytime = true;
+    AnytimeResult r = runAnytime(params, m_scratch, path, [&](float w, Array<vec2>& p, U32& lowerBound) {
+        m_weight = (U32)(w * WeightScale);
+        m_open.nextPass([&](Coord c, int i) { return priority(m_cost[i], pathFinder().heuristic(c, end)); });
+        
+        Coord cur;
+        int curIdx;
+        U32 pr;
+        // end is expanded last, so its cost is at most weight times the smallest cost + heuristic left
+        while (m_open.pop(cur, curIdx, pr) && m_cost[endIdx] > pr) {
+            m_open.close(curIdx);
+            expand(cur, end);
+        }
+        
+        lowerBound = m_open.lowerBound([&](Coord c, int i) { return m_cost[i] + pathFinder().heuristic(c, end); });
+        if (m_cost[endIdx] == AnytimeResult::NotFound)
+            return AnytimeResult::NotFound;
+        
+        for (Coord c = end; c != start; c = m_cameFrom[pathFinder().index(c.x, c.y)])
+            p.push(map()->getPos(c.point()));
+        p.push(map()->getPos(start.point()));
+        return m_cost[endIdx];
+    });
+    m_anytime = false;
+    m_weight = WeightScale;
+    return r;
+}
+
 void JPS::find(Coord start, Coord end, Array<vec2>& path) {
     m_queue.clear();
     std::memset(m_cost.buf(), 0xff, m_cost.count() * sizeof(int));
@@ -40,14 +89,7 @@ void JPS::find(Coord start, Coord end, Array<vec2>& path) {
     m_bestH = pathFinder().heuristic(start, end);
     int iter = 0;
     
-    jumpN(start, end);
-    jumpS(start, end);
-    jumpW(start, end);
-    jumpE(start, end);
-    jumpNW(start, end);
-    jumpNE(start, end);
-    jumpSW(start, end);
-    jumpSE(start, end);
+    expand(start, end);
     
     while (m_queue.count()) {
         Coord cur = m_queue.pop();
@@ -56,71 +98,8 @@ void JPS::find(Coord start, Coord end, Array<vec2>& path) {
             break;
         }
         
-        int ci = pathFinder().index(cur.x, cur.y);
         iter++;
-        
-        Coord from = m_cameFrom[ci];
-        int bi = ci - m_size.width;
-        int ti = ci + m_size.width;
-        
-        if (cur.y == from.y) {
-            if (cur.x > from.x) {
-                if (m_map[bi] && !m_map[bi - 1]) {
-                    jumpS(cur, end);
-                    jumpSE(cur, end);
-                }
-                if (m_map[ti] && !m_map[ti - 1]) {
-                    jumpN(cur, end);
-                    jumpNE(cur, end);
-                }
-                jumpE(cur, end);
-            }
-            else {
-                if (m_map[bi] && !m_map[bi + 1]) {
-                    jumpS(cur, end);
-                    jumpSW(cur, end);
-                }
-                if (m_map[ti] && !m_map[ti + 1]) {
-                    jumpN(cur, end);
-                    jumpNW(cur, end);
-                }
-                jumpW(cur, end);
-            }
-        }
-        else if (cur.y < from.y) {
-            if (cur.x == from.x) {
-                if (m_map[ci - 1] && !m_map[ti - 1]) {
-                    jumpW(cur, end);
-                    jumpSW(cur, end);
-                }
-                if (m_map[ci + 1] && !m_map[ti + 1]) {
-                    jumpE(cur, end);
-                    jumpSE(cur, end);
-                }
-                jumpS(cur, end);
-            }
-            else if (cur.x > from.x)
-                jumpSE(cur, end);
-            else
-                jumpSW(cur, end);
-        }
-        else { // cur.y > from.y
-            if (cur.x == from.x) {
-                if (m_map[ci - 1] && !m_map[bi - 1]) {
-                    jumpW(cur, end);
-                    jumpNW(cur, end);
-                }
-                if (m_map[ci + 1] && !m_map[bi + 1]) {
-                    jumpE(cur, end);
-                    jumpNE(cur, end);
-                }
-                jumpN(cur, end);
-            }
-            else if (cur.x > from.x)
-                jumpNE(cur, end);
-            else
-                jumpNW(cur, end);
-        }
+        expand(cur, end);
     }
     
     // Create Path
@@ -132,6 +111,91 @@ void JPS::find(Coord start, Coord end, Array<vec2>& path) {
     path.push(map()->getPos(start.point()));
 }
 
+void JPS::expand(Coord cur, Coord goal) {
+    int ci = pathFinder().index(cur.x, cur.y);
+    Coord from = m_cameFrom[ci];
+    if (from == cur) {
+        jumpN(cur, goal);
+        jumpS(cur, goal);
+        jumpW(cur, goal);
+        jumpE(cur, goal);
+        jumpNW(cur, goal);
+        jumpNE(cur, goal);
+        jumpSW(cur, goal);
+        jumpSE(cur, goal);
+        return;
+    }
+    
+    int bi = ci - m_size.width;
+    int ti = ci + m_size.width;
+    
+    if (cur.y == from.y) {
+        if (cur.x > from.x) {
+            if (m_map[bi] && !m_map[bi - 1]) {
+                jumpS(cur, goal);
+                jumpSE(cur, goal);
+            }
+            if (m_map[ti] && !m_map[ti - 1]) {
+                jumpN(cur, goal);
+                jumpNE(cur, goal);
+            }
+            jumpE(cur, goal);
+        }
+        else {
+            if (m_map[bi] && !m_map[bi + 1]) {
+                jumpS(cur, goal);
+                jumpSW(cur, goal);
+            }
+            if (m_map[ti] && !m_map[ti + 1]) {
+                jumpN(cur, goal);
+                jumpNW(cur, goal);
+            }
+            jumpW(cur, goal);
+        }
+    }
+    else if (cur.y < from.y) {
+        if (cur.x == from.x) {
+            if (m_map[ci - 1] && !m_map[ti - 1]) {
+                jumpW(cur, goal);
+                jumpSW(cur, goal);
+            }
+            if (m_map[ci + 1] && !m_map[ti + 1]) {
+                jumpE(cur, goal);
+                jumpSE(cur, goal);
+            }
+            jumpS(cur, goal);
+        }
+        else if (cur.x > from.x)
+            jumpSE(cur, goal);
+        else
+            jumpSW(cur, goal);
+    }
+    else { // cur.y > from.y
+        if (cur.x == from.x) {
+            if (m_map[ci - 1] && !m_map[bi - 1]) {
+                jumpW(cur, goal);
+                jumpNW(cur, goal);
+            }
+            if (m_map[ci + 1] && !m_map[bi + 1]) {
+                jumpE(cur, goal);
+                jumpNE(cur, goal);
+            }
+            jumpN(cur, goal);
+        }
+        else if (cur.x > from.x)
+            jumpNE(cur, goal);
+        else
+            jumpNW(cur, goal);
+    }
+}
+
+void JPS::open(Coord c, int i, U32 priority) {
+    if (m_anytime)
+        m_open.push(c, i, priority);
+    else
+        m_queue.insert(c, priority);
+}
+
 int JPS::jumpN(Coord from, Coord goal) {
     int dist = 0;
     int fromi = pathFinder().index(from.x, from.y);
@@ -148,7 +212,7 @@ int JPS::jumpN(Coord from, Coord goal) {
         
         if (next == goal) {
             if (cost < m_cost[nexti]) {
-                m_queue.insert(next, cost);
+                open(next, nexti, cost);
                 m_cameFrom[nexti] = from;
                 m_cost[nexti] = cost;
             }
@@ -165,7 +229,7 @@ int JPS::jumpN(Coord from, Coord goal) {
         
         if ((m_map[nexti + 1] && !m_map[curi + 1]) || (m_map[nexti - 1] && !m_map[curi - 1])) {
             if (cost < m_cost[nexti]) {
-                m_queue.insert(next, h + cost);
+                open(next, nexti, priority(cost, h));
                 m_cameFrom[nexti] = from;
                 m_cost[nexti] = cost;
             }
@@ -195,7 +259,7 @@ int JPS::jumpE(Coord from, Coord goal) {
         
         if (next == goal) {
             if (cost < m_cost[nexti]) {
-                m_queue.insert(next, cost);
+                open(next, nexti, cost);
                 m_cameFrom[nexti] = from;
                 m_cost[nexti] = cost;
             }
@@ -213,7 +277,7 @@ int JPS::jumpE(Coord from, Coord goal) {
         if ((m_map[nexti + m_size.width] && !m_map[curi + m_size.width]) ||
             (m_map[nexti - m_size.width] && !m_map[curi - m_size.width])) {
             if (cost < m_cost[nexti]) {
-                m_queue.insert(next, h + cost);
+                open(next, nexti, priority(cost, h));
                 m_cameFrom[nexti] = from;
                 m_cost[nexti] = cost;
             }
@@ -243,7 +307,7 @@ int JPS::jumpS(Coord from, Coord goal) {
         
         if (next == goal) {
             if (cost < m_cost[nexti]) {
-                m_queue.insert(next, cost);
+                open(next, nexti, cost);
                 m_cameFrom[nexti] = from;
                 m_cost[nexti] = cost;
             }
@@ -260,7 +324,7 @@ int JPS::jumpS(Coord from, Coord goal) {
         
         if ((m_map[nexti + 1] && !m_map[curi + 1]) || (m_map[nexti - 1] && !m_map[curi - 1])) {
             if (cost < m_cost[nexti]) {
-                m_queue.insert(next, h + cost);
+                open(next, nexti, priority(cost, h));
                 m_cameFrom[nexti] = from;
                 m_cost[nexti] = cost;
             }
@@ -290,7 +354,7 @@ int JPS::jumpW(Coord from, Coord goal) {
         
         if (next == goal) {
             if (cost < m_cost[nexti]) {
-                m_queue.insert(next, cost);
+                open(next, nexti, cost);
                 m_cameFrom[nexti] = from;
                 m_cost[nexti] = cost;
             }
@@ -308,7 +372,7 @@ int JPS::jumpW(Coord from, Coord goal) {
         if ((m_map[nexti + m_size.width] && !m_map[curi + m_size.width]) ||
             (m_map[nexti - m_size.width] && !m_map[curi - m_size.width])) {
             if (cost < m_cost[nexti]) {
-                m_queue.insert(next, h + cost);
+                open(next, nexti, priority(cost, h));
                 m_cameFrom[nexti] = from;
                 m_cost[nexti] = cost;
             }
@@ -350,7 +414,7 @@ void JPS::jumpNE(Coord from, Coord goal) {
         
         if (next == goal) {
             if (cost == m_cost[nexti])
-                m_queue.insert(next, cost);
+                open(next, nexti, cost);
             break;
         }
         
@@ -394,7 +458,7 @@ void JPS::jumpSE(Coord from, Coord goal) {
         
         if (next == goal) {
             if (cost == m_cost[nexti])
-                m_queue.insert(next, cost);
+                open(next, nexti, cost);
             break;
         }
         
@@ -438,7 +502,7 @@ void JPS::jumpSW(Coord from, Coord goal) {
         
         if (next == goal) {
             if (cost == m_cost[nexti])
-                m_queue.insert(next, cost);
+                open(next, nexti, cost);
             break;
         }
         
@@ -482,7 +546,7 @@ void JPS::jumpNW(Coord from, Coord goal) {
         
         if (next == goal) {
             if (cost == m_cost[nexti])
-                m_queue.insert(next, cost);
+                open(next, nexti, cost);
             break;
         }
         
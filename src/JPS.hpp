@@ -1,14 +1,27 @@
 
 #pragma once
 
+#include "Anytime.hpp"
 #include "Coord.hpp"
 
 class JPS {
 public:
     JPS();
     void find(Coord start, Coord end, nook::Array<nook::vec2>& path);
+    // Weighted search, improved while params.microseconds remain
+    AnytimeResult findAnytime(Coord start, Coord end, nook::Array<nook::vec2>& path, AnytimeParams params);
+    
+    bool* walkable() { return m_map; }
     
 private:
+    static constexpr nook::U32 WeightScale = 256; // weight of heuristic is fixed point
+    
+    nook::U32 priority(nook::U32 cost, nook::U32 h) const { return cost + (h * m_weight) / WeightScale; }
+    
+    // Pushes jump points that follow cur
+    void expand(Coord cur, Coord goal);
+    // Queues c, or opens it for the anytime search
+    void open(Coord c, int i, nook::U32 priority);
     int jumpN(Coord from, Coord goal);
     int jumpS(Coord from, Coord goal);
     int jumpW(Coord from, Coord goal);
@@ -23,6 +36,10 @@ private:
     nook::PriorityQueue<Coord, nook::U32> m_queue;
     nook::Array<Coord> m_cameFrom;
     nook::Array<nook::U32> m_cost;
+    nook::U32 m_weight;
+    bool m_anytime;
+    AnytimeOpen m_open;
+    nook::Array<nook::vec2> m_scratch;
     
     Coord m_best;
     nook::U32 m_bestC;
@@ -3,25 +3,41 @@
 #include "PathFinder.hpp"
 #include "Map.hpp"
 
+#include <utility>
+#include <vector>
+
 using namespace nook;
 
 JPSplus::JPSplus() {
     m_size = map()->size();
     
     int count = m_size.width * m_size.height;
-    int queueSize = m_size.width;
+    m_queueSize = m_size.width;
     m_map = memoryManager().allocOnStack<bool>(count);
     m_jps = memoryManager().allocOnStack<JP>(count);
-    m_queue.init(queueSize, memoryManager().allocOnStack<PriorityQueue<Coord, U32>::Item>(queueSize));
-    m_cameFrom.init(count, memoryManager().allocOnStack<Coord>(count));
-    m_cost.init(count, memoryManager().allocOnStack<U32>(count));
-    m_cameFrom.setCount(count);
-    m_cost.setCount(count);
+    m_area = memoryManager().allocOnStack<U32>(count);
+    allocate(m_find);
+    m_tree.cost = nullptr;
+    use(m_find);
     
     update();
 }
 
+void JPSplus::allocate(Search& s) {
+    int count = m_size.width * m_size.height;
+    s.queue.init(m_queueSize, memoryManager().allocOnStack<PriorityQueue<Coord, U32>::Item>(m_queueSize));
+    s.cameFrom = memoryManager().allocOnStack<Coord>(count);
+    s.cost = memoryManager().allocOnStack<U32>(count);
+}
+
+void JPSplus::use(Search& s) {
+    m_queue = &s.queue;
+    m_cameFrom = s.cameFrom;
+    m_cost = s.cost;
+}
+
 void JPSplus::update() {
+    m_anchored = false;
     for (int y = 0; y < m_size.height; y++)
         for (int x = 0; x < m_size.width; x++)
             m_map[pathFinder().index(x, y)] = map()->getCell(x, y)->walkable;
@@ -39,11 +55,47 @@ void JPSplus::update() {
             jp.sw = getJumpSW(c);
             jp.nw = getJumpNW(c);
         }
+    
+    // Diagonal moves don't cut corners, so straight neighbours are enough to join areas
+    m_closestArea = None;
+    std::memset(m_area, 0xff, m_size.width * m_size.height * sizeof(U32));
+    U32 area = 0;
+    std::vector<int> stack;
+    for (int y = 1; y < m_size.height - 1; y++)
+        for (int x = 1; x < m_size.width - 1; x++) {
+            int i = pathFinder().index(x, y);
+            if (!m_map[i] || m_area[i] != None)
+                continue;
+            
+            m_area[i] = area;
+            stack.push_back(i);
+            while (stack.size()) {
+                int c = stack.back();
+                stack.pop_back();
+                for (int n : { c + 1, c - 1, c + m_size.width, c - m_size.width })
+                    if (m_map[n] && m_area[n] == None) {
+                        m_area[n] = area;
+                        stack.push_back(n);
+                    }
+            }
+            area++;
+        }
+}
+
+size_t JPSplus::memoryUsage() const {
+    size_t count = m_size.width * m_size.height;
+    size_t search = count * (sizeof(Coord) + sizeof(U32)) + m_queueSize * sizeof(PriorityQueue<Coord, U32>::Item);
+    size_t usage = count * (sizeof(bool) + sizeof(JP) + sizeof(U32)) + search;
+    // tree of findAnchored() and its reopen buffer
+    if (m_tree.cost)
+        usage += search + m_queueSize * sizeof(Coord);
+    return usage;
 }
 
 void JPSplus::find(Coord start, Coord end, nook::Array<nook::vec2>& path) {
-    m_queue.clear();
-    std::memset(m_cost.buf(), 0xff, m_cost.count() * sizeof(int));
+    use(m_find);
+    m_queue->clear();
+    std::memset(m_cost, 0xff, m_size.width * m_size.height * sizeof(U32));
     
     if (start == end) {
         path.push(map()->getPos(start.point()));
@@ -67,8 +119,20 @@ void JPSplus::find(Coord start, Coord end, nook::Array<nook::vec2>& path) {
     jumpSW(start, end);
     jumpNW(start, end);
     
-    while (m_queue.count()) {
-        Coord cur = m_queue.pop();
+    expand(end);
+    
+    // Create Path
+    Coord c = m_best;
+    while (c != start) {
+        path.push(map()->getPos(c.point()));
+        c = m_cameFrom[pathFinder().index(c.x, c.y)];
+    }
+    path.push(map()->getPos(start.point()));
+}
+
+void JPSplus::expand(Coord end) {
+    while (m_queue->count()) {
+        Coord cur = m_queue->pop();
         if (cur == end) {
             m_best = end;
             break;
@@ -139,14 +203,140 @@ void JPSplus::find(Coord start, Coord end, nook::Array<nook::vec2>& path) {
                 jumpNW(cur, end);
         }
     }
+}
+
+void JPSplus::findAnchored(Coord start, Coord goal, Array<vec2>& path) {
+    int si = pathFinder().index(start.x, start.y);
+    U32 area = m_area[si];
+    if (area == None) {
+        find(start, goal, path);
+        return;
+    }
+    if (m_area[pathFinder().index(goal.x, goal.y)] != area)
+        goal = closestInArea(goal, area);
     
-    // Create Path
-    Coord c = m_best;
-    while (c != start) {
+    if (start == goal) {
+        path.push(map()->getPos(start.point()));
+        return;
+    }
+    
+    if (!m_tree.cost) {
+        allocate(m_tree);
+        m_reopen.init(m_queueSize, memoryManager().allocOnStack<Coord>(m_queueSize));
+    }
+    use(m_tree);
+    m_best = goal;
+    m_bestC = 0;
+    m_bestH = pathFinder().heuristic(goal, start);
+    
+    if (!m_anchored || m_anchor != goal) {
+        // Backward from goal, moves are symmetric so the tree leads any cell in it to goal
+        m_queue->clear();
+        std::memset(m_cost, 0xff, m_size.width * m_size.height * sizeof(U32));
+        int gi = pathFinder().index(goal.x, goal.y);
+        m_cameFrom[gi] = goal;
+        m_cost[gi] = 0;
+        m_anchored = true;
+        m_anchor = goal;
+        
+        jumpN(goal, start);
+        jumpE(goal, start);
+        jumpS(goal, start);
+        jumpW(goal, start);
+        jumpNE(goal, start);
+        jumpSE(goal, start);
+        jumpSW(goal, start);
+        jumpNW(goal, start);
+    }
+    else if (m_cost[si] == None) {
+        Coord via;
+        if (probeTree(start, via)) {
+            pushAnchored(start, via, path);
+            return;
+        }
+        
+        // Open cells were queued by distance to the old start
+        m_reopen.setCount(0);
+        while (m_queue->count())
+            m_reopen.push(m_queue->pop());
+        for (Coord c : m_reopen)
+            m_queue->insert(c, m_cost[pathFinder().index(c.x, c.y)] + pathFinder().heuristic(c, start));
+    }
+    else {
+        pushAnchored(start, start, path);
+        return;
+    }
+    
+    // goal is in the start's area, so the search reaches start
+    expand(start);
+    // search stopped before adding successors of start, they are added if it resumes
+    if (m_best == start)
+        m_queue->insert(start, m_cost[si]);
+    pushAnchored(start, start, path);
+}
+
+Coord JPSplus::closestInArea(Coord goal, U32 area) {
+    if (m_closestArea == area && m_closestGoal == goal)
+        return m_closest;
+    
+    // nearest by moves, then by straight distance, so the choice doesn't depend on start
+    U32 best = None;
+    int bestD2 = 0;
+    for (int y = 1; y < m_size.height - 1; y++)
+        for (int x = 1; x < m_size.width - 1; x++) {
+            if (m_area[pathFinder().index(x, y)] != area)
+                continue;
+            Coord c(x, y);
+            U32 d = moveCost(c, goal);
+            int dx = x - (int)goal.x;
+            int dy = y - (int)goal.y;
+            if (d < best || (d == best && dx * dx + dy * dy < bestD2)) {
+                best = d;
+                bestD2 = dx * dx + dy * dy;
+                m_closest = c;
+            }
+        }
+    m_closestGoal = goal;
+    m_closestArea = area;
+    return m_closest;
+}
+
+bool JPSplus::probeTree(Coord start, Coord& via) {
+    const int dirs[8][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 }, { 1, 1 }, { 1, -1 }, { -1, 1 }, { -1, -1 } };
+    U32 best = None;
+    for (const int* d : dirs) {
+        int step = d[1] * m_size.width + d[0];
+        int i = pathFinder().index(start.x, start.y);
+        for (int n = 1; m_map[i + step] && m_map[i + d[0]] && m_map[i + d[1] * m_size.width]; n++) {
+            i += step;
+            if (m_cost[i] != None) {
+                Coord c(start.x + d[0] * n, start.y + d[1] * n);
+                U32 cost = moveCost(start, c) + m_cost[i];
+                if (cost < best) {
+                    best = cost;
+                    via = c;
+                }
+                break;
+            }
+        }
+    }
+    return best != None;
+}
+
+void JPSplus::pushAnchored(Coord start, Coord via, Array<vec2>& path) {
+    // From start to goal, reversed at the end
+    int first = path.count();
+    path.push(map()->getPos(start.point()));
+    Coord c = via;
+    if (c != start)
         path.push(map()->getPos(c.point()));
+    for (int steps = 0; c != m_anchor && steps < m_size.width * m_size.height; steps++) {
         c = m_cameFrom[pathFinder().index(c.x, c.y)];
+        path.push(map()->getPos(c.point()));
     }
-    path.push(map()->getPos(start.point()));
+    
+    for (int i = first, j = path.count() - 1; i < j; i++, j--)
+        std::swap(path[i], path[j]);
 }
 
 U16 JPSplus::getJumpN(Coord from) {
@@ -287,12 +477,12 @@ void JPSplus::jumpN(Coord from, Coord goal) {
         int goali = pathFinder().index(goal.x, goal.y);
         U32 cost = m_cost[fromi] + goal.y - from.y;
         if (cost < m_cost[goali]) {
-            m_queue.insert(goal, cost);
+            m_queue->insert(goal, cost);
             m_cameFrom[goali] = from;
             m_cost[goali] = cost;
         }
         else if (cost == m_cost[goali])
-            m_queue.insert(goal, cost);
+            m_queue->insert(goal, cost);
         return;
     }
     
@@ -302,7 +492,7 @@ void JPSplus::jumpN(Coord from, Coord goal) {
         int endi = pathFinder().index(end.x, end.y);
         if (cost < m_cost[endi]) {
             U32 h = pathFinder().heuristic(end, goal);
-            m_queue.insert(end, h + cost);
+            m_queue->insert(end, h + cost);
             m_cameFrom[endi] = from;
             m_cost[endi] = cost;
         }
@@ -335,12 +525,12 @@ void JPSplus::jumpE(Coord from, Coord goal) {
         int goali = pathFinder().index(goal.x, goal.y);
         U32 cost = m_cost[fromi] + goal.x - from.x;
         if (cost < m_cost[goali]) {
-            m_queue.insert(goal, cost);
+            m_queue->insert(goal, cost);
             m_cameFrom[goali] = from;
             m_cost[goali] = cost;
         }
         else if (cost == m_cost[goali])
-            m_queue.insert(goal, cost);
+            m_queue->insert(goal, cost);
         return;
     }
     
@@ -350,7 +540,7 @@ void JPSplus::jumpE(Coord from, Coord goal) {
         int endi = pathFinder().index(end.x, end.y);
         if (cost < m_cost[endi]) {
             U32 h = pathFinder().heuristic(end, goal);
-            m_queue.insert(end, h + cost);
+            m_queue->insert(end, h + cost);
             m_cameFrom[endi] = from;
             m_cost[endi] = cost;
         }
@@ -383,12 +573,12 @@ void JPSplus::jumpS(Coord from, Coord goal) {
         int goali = pathFinder().index(goal.x, goal.y);
         U32 cost = m_cost[fromi] + from.y - goal.y;
         if (cost < m_cost[goali]) {
-            m_queue.insert(goal, cost);
+            m_queue->insert(goal, cost);
             m_cameFrom[goali] = from;
             m_cost[goali] = cost;
         }
         else if (cost == m_cost[goali])
-            m_queue.insert(goal, cost);
+            m_queue->insert(goal, cost);
         return;
     }
     
@@ -398,7 +588,7 @@ void JPSplus::jumpS(Coord from, Coord goal) {
         int endi = pathFinder().index(end.x, end.y);
         if (cost < m_cost[endi]) {
             U32 h = pathFinder().heuristic(end, goal);
-            m_queue.insert(end, h + cost);
+            m_queue->insert(end, h + cost);
             m_cameFrom[endi] = from;
             m_cost[endi] = cost;
         }
@@ -431,12 +621,12 @@ void JPSplus::jumpW(Coord from, Coord goal) {
         int goali = pathFinder().index(goal.x, goal.y);
         U32 cost = m_cost[fromi] + from.x - goal.x;
         if (cost < m_cost[goali]) {
-            m_queue.insert(goal, cost);
+            m_queue->insert(goal, cost);
             m_cameFrom[goali] = from;
             m_cost[goali] = cost;
         }
         else if (cost == m_cost[goali])
-            m_queue.insert(goal, cost);
+            m_queue->insert(goal, cost);
         return;
     }
     
@@ -446,7 +636,7 @@ void JPSplus::jumpW(Coord from, Coord goal) {
         int endi = pathFinder().index(end.x, end.y);
         if (cost < m_cost[endi]) {
             U32 h = pathFinder().heuristic(end, goal);
-            m_queue.insert(end, h + cost);
+            m_queue->insert(end, h + cost);
             m_cameFrom[endi] = from;
             m_cost[endi] = cost;
         }
@@ -3,14 +3,27 @@
 
 #include "Coord.hpp"
 
+#include <cstddef>
+
 class JPSplus {
 public:
     JPSplus();
     
     void update();
     void find(Coord start, Coord end, nook::Array<nook::vec2>& path);
+    // For repeated queries to one goal from moving start. Search goes backward from goal and its tree
+    // is kept in its own buffers until other goal or update(). Start in the tree only reads the path, start
+    // outside it is joined by a straight or diagonal line if one hits the tree, otherwise search resumes.
+    // Goal outside of the start's area is replaced by the closest cell of that area, so the tree
+    // is rooted there and serves more starts from the same area.
+    void findAnchored(Coord start, Coord goal, nook::Array<nook::vec2>& path);
+    
+    bool* walkable() { return m_map; }
+    std::size_t memoryUsage() const;
     
 private:
+    static constexpr nook::U32 None = 0xffffffff;
+    
     struct JP {
         nook::U16 n;
         nook::U16 ne;
@@ -22,6 +35,25 @@ private:
         nook::U16 nw;
     };
     
+    // Buffers of one search, find() and the tree of findAnchored() don't share them
+    struct Search {
+        nook::PriorityQueue<Coord, nook::U32> queue;
+        Coord* cameFrom;
+        nook::U32* cost;
+    };
+    
+    void allocate(Search& s);
+    void use(Search& s);
+    void expand(Coord end);
+    // every straight or diagonal step costs 1, as in the jump tables
+    static nook::U32 moveCost(Coord a, Coord b) {
+        return nook::max2(std::abs((int)a.x - (int)b.x), std::abs((int)a.y - (int)b.y));
+    }
+    // cached for the last goal and area
+    Coord closestInArea(Coord goal, nook::U32 area);
+    bool probeTree(Coord start, Coord& via);
+    void pushAnchored(Coord start, Coord via, nook::Array<nook::vec2>& path);
+    
     nook::U16 getJumpN(Coord from);
     nook::U16 getJumpE(Coord from);
     nook::U16 getJumpS(Coord from);
@@ -43,9 +75,20 @@ private:
     nook::Size m_size;
     bool* m_map;
     JP* m_jps;
-    nook::PriorityQueue<Coord, nook::U32> m_queue;
-    nook::Array<Coord> m_cameFrom;
-    nook::Array<nook::U32> m_cost;
+    nook::U32* m_area; // connected area of walkable cell or None
+    int m_queueSize;
+    Search m_find;
+    Search m_tree; // allocated on the first findAnchored()
+    // buffers of the running search
+    nook::PriorityQueue<Coord, nook::U32>* m_queue;
+    Coord* m_cameFrom;
+    nook::U32* m_cost;
+    bool m_anchored; // m_tree holds tree rooted at m_anchor
+    Coord m_anchor;
+    nook::Array<Coord> m_reopen;
+    Coord m_closestGoal;
+    nook::U32 m_closestArea;
+    Coord m_closest;
     
     Coord m_best;
     nook::U32 m_bestC;
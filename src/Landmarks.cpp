@@ -0,0 +1,111 @@
+
+#include "Landmarks.hpp"
+#include "Map.hpp"
+
+#include <cstring>
+#include <vector>
+
+using namespace nook;
+
+Landmarks::Landmarks(int count) {
+    m_size = map()->size();
+    m_count = 0;
+    
+    int cells = m_size.width * m_size.height;
+    m_landmarks = memoryManager().allocOnStack<Coord>(count);
+    m_dist = memoryManager().allocOnStack<U16>(cells * count);
+    std::memset(m_dist, 0xff, cells * count * sizeof(U16));
+    
+    // first one is the farthest from some walkable cell, so it is on the border of the area
+    Coord first(0, 0);
+    for (int y = 1; y < m_size.height - 1 && !first.x; y++)
+        for (int x = 1; x < m_size.width - 1; x++)
+            if (map()->getCell(x, y)->walkable) {
+                first = Coord(x, y);
+                break;
+            }
+    if (!first.x)
+        return;
+    
+    m_count = count;
+    m_landmarks[0] = first;
+    m_landmarks[0] = fill(0);
+    
+    // farthest point: cell with the biggest distance to the nearest chosen landmark
+    for (int i = 0; i < count; i++) {
+        fill(i);
+        if (i + 1 == count)
+            break;
+        
+        int best = -1;
+        for (int c = 0; c < cells; c++) {
+            const U16* d = m_dist + c * m_count;
+            int nearest = Unreachable;
+            for (int k = 0; k <= i; k++)
+                nearest = min2(nearest, (int)d[k]);
+            if (nearest != Unreachable && nearest > best) {
+                best = nearest;
+                m_landmarks[i + 1] = Coord(c % m_size.width, c / m_size.width);
+            }
+        }
+    }
+}
+
+void Landmarks::update() {
+    for (int i = 0; i < m_count; i++)
+        fill(i);
+}
+
+void Landmarks::update(Rect dirty) {
+    // one cell around, a cell that became walkable is reached from there
+    int x0 = max2(dirty.x - 1, 0);
+    int y0 = max2(dirty.y - 1, 0);
+    int x1 = min2(dirty.x + dirty.width + 1, m_size.width);
+    int y1 = min2(dirty.y + dirty.height + 1, m_size.height);
+    for (int i = 0; i < m_count; i++) {
+        bool reached = false;
+        for (int y = y0; y < y1 && !reached; y++)
+            for (int x = x0; x < x1 && !reached; x++)
+                reached = m_dist[(y * m_size.width + x) * m_count + i] != Unreachable;
+        if (reached)
+            fill(i);
+    }
+}
+
+Coord Landmarks::fill(int i) {
+    int cells = m_size.width * m_size.height;
+    for (int c = 0; c < cells; c++)
+        m_dist[c * m_count + i] = Unreachable;
+    
+    Coord l = m_landmarks[i];
+    std::vector<Coord> front;
+    std::vector<Coord> next;
+    front.push_back(l);
+    m_dist[(l.y * m_size.width + l.x) * m_count + i] = 0;
+    Coord last = l;
+    
+    // breadth first, all moves cost 1
+    for (U16 d = 1; front.size() && d < Unreachable; d++) {
+        for (Coord p : front)
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++) {
+                    if (!dx && !dy)
+                        continue;
+                    Coord n(p.x + dx, p.y + dy);
+                    if (!map()->getCell(n.x, n.y)->walkable)
+                        continue;
+                    if (dx && dy && (!map()->getCell(p.x + dx, p.y)->walkable || !map()->getCell(p.x, p.y + dy)->walkable))
+                        continue;
+                    
+                    U16& nd = m_dist[(n.y * m_size.width + n.x) * m_count + i];
+                    if (nd == Unreachable) {
+                        nd = d;
+                        next.push_back(n);
+                        last = n;
+                    }
+                }
+        front.swap(next);
+        next.clear();
+    }
+    return last;
+}
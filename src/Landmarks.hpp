@@ -0,0 +1,42 @@
+
+#pragma once
+
+#include "Coord.hpp"
+
+// ALT heuristic. Distances from few landmarks to every cell, with moves of rough search
+// (8 directions, diagonal costs 1, walls are not cut). |d(L, a) - d(L, b)| <= d(a, b)
+// for every landmark L, so the maximum of them is admissible and consistent.
+class Landmarks {
+public:
+    // Landmarks are chosen one by one as the cell farthest from already chosen ones
+    Landmarks(int count);
+    // Refills distances after walkability changed, landmarks stay in place. A landmark on a cell
+    // that became a wall still gives admissible distances, they are just looser.
+    void update();
+    // Refills only landmarks that reached a cell of dirty or next to it, others can't see the change
+    void update(nook::Rect dirty);
+    
+    nook::U32 heuristic(Coord c1, Coord c2) const {
+        const nook::U16* d1 = m_dist + (c1.y * m_size.width + c1.x) * m_count;
+        const nook::U16* d2 = m_dist + (c2.y * m_size.width + c2.x) * m_count;
+        int h = 0;
+        for (int i = 0; i < m_count; i++)
+            if (d1[i] != Unreachable && d2[i] != Unreachable)
+                h = nook::max2(h, std::abs((int)d1[i] - (int)d2[i]));
+        return h;
+    }
+    
+    int count() const { return m_count; }
+    Coord landmark(int i) const { return m_landmarks[i]; }
+    
+private:
+    static constexpr nook::U16 Unreachable = 0xffff;
+    
+    // fills distances of landmark i, returns the farthest reached cell
+    Coord fill(int i);
+    
+    nook::Size m_size;
+    int m_count;
+    Coord* m_landmarks;
+    nook::U16* m_dist; // m_count distances per cell
+};
@@ -0,0 +1,140 @@
+
+#include "LazyTheta.hpp"
+#include "LineOfSight.hpp"
+#include "PathFinder.hpp"
+#include "Map.hpp"
+
+using namespace nook;
+
+namespace {
+    const Point2 neighbours[] = {
+        { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 },
+        { -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 }
+    };
+}
+
+LazyTheta::LazyTheta() {
+    m_size = map()->size();
+    
+    int count = m_size.width * m_size.height;
+    m_maxIter = m_size.width * 4;
+    m_queueSize = m_maxIter * 8;
+    m_map = memoryManager().allocOnStack<bool>(count);
+    m_queue.init(m_queueSize, memoryManager().allocOnStack<PriorityQueue<Coord, U32>::Item>(m_queueSize));
+    m_cameFrom.init(count, memoryManager().allocOnStack<Coord>(count));
+    m_cost.init(count, memoryManager().allocOnStack<float>(count));
+    m_open.init(count, memoryManager().allocOnStack<U32>(count));
+    m_closed.init(count, memoryManager().allocOnStack<U32>(count));
+    m_cameFrom.setCount(count);
+    m_cost.setCount(count);
+    m_open.setCount(count);
+    m_closed.setCount(count);
+    std::memset(m_open.buf(), 0, count * sizeof(U32));
+    std::memset(m_closed.buf(), 0, count * sizeof(U32));
+    m_search = 0;
+    
+    for (int y = 0; y < m_size.height; y++)
+        for (int x = 0; x < m_size.width; x++)
+            m_map[pathFinder().index(x, y)] = map()->getCell(x, y)->walkable;
+}
+
+void LazyTheta::find(Coord start, Coord end, Array<vec2>& path) {
+    m_queue.clear();
+    m_search++;
+    
+    if (start == end) {
+        path.push(map()->getPos(start.point()));
+        return;
+    }
+    
+    int startIdx = pathFinder().index(start.x, start.y);
+    m_cameFrom[startIdx] = start;
+    m_cost[startIdx] = 0.0f;
+    m_open[startIdx] = m_search;
+    m_queue.insert(start, 0);
+    
+    m_best = start;
+    m_bestH = dist(start, end);
+    U32 iter = 0;
+    
+    while (m_queue.count()) {
+        Coord cur = m_queue.pop();
+        int ci = pathFinder().index(cur.x, cur.y);
+        if (m_closed[ci] == m_search)
+            continue; // stale duplicate
+        m_closed[ci] = m_search;
+        
+        setVertex(cur, ci);
+        if (cur == end) {
+            m_best = end;
+            break;
+        }
+        
+        // closest point is taken from expanded cells, their parents are already checked
+        float h = dist(cur, end);
+        if (h < m_bestH) {
+            m_bestH = h;
+            m_best = cur;
+        }
+        if (++iter == m_maxIter)
+            break;
+        
+        Coord parent = m_cameFrom[ci];
+        for (Point2 n : neighbours) {
+            Coord next(cur.x + n.x, cur.y + n.y);
+            int ni = pathFinder().index(next.x, next.y);
+            if (!m_map[ni] || m_closed[ni] == m_search)
+                continue;
+            // diagonal move doesn't cut walls
+            if (n.x && n.y && (!m_map[ci + n.x] || !m_map[ci + n.y * m_size.width]))
+                continue;
+            
+            // lazily assume parent of cur sees next, it is checked in setVertex
+            push(next, parent, m_cost[pathFinder().index(parent.x, parent.y)] + dist(parent, next), end);
+        }
+    }
+    
+    // Create Path
+    Coord c = m_best;
+    while (c != start) {
+        path.push(map()->getPos(c.point()));
+        c = m_cameFrom[pathFinder().index(c.x, c.y)];
+    }
+    path.push(map()->getPos(start.point()));
+}
+
+// Parent was assumed visible when c was pushed, otherwise the best expanded neighbour becomes parent
+void LazyTheta::setVertex(Coord c, int ci) {
+    Coord parent = m_cameFrom[ci];
+    if (lineOfSight(m_map, m_size.width, parent, c))
+        return;
+    
+    float best = -1.0f;
+    for (Point2 n : neighbours) {
+        Coord nc(c.x + n.x, c.y + n.y);
+        int ni = pathFinder().index(nc.x, nc.y);
+        if (m_closed[ni] != m_search || (n.x && n.y && (!m_map[ci + n.x] || !m_map[ci + n.y * m_size.width])))
+            continue;
+        
+        float cost = m_cost[ni] + dist(nc, c);
+        if (best < 0.0f || cost < best) {
+            best = cost;
+            m_cameFrom[ci] = nc;
+        }
+    }
+    m_cost[ci] = best;
+}
+
+void LazyTheta::push(Coord c, Coord parent, float cost, Coord goal) {
+    int i = pathFinder().index(c.x, c.y);
+    if (m_open[i] == m_search && m_cost[i] <= cost)
+        return;
+    if (m_queue.count() == m_queueSize)
+        return;
+    
+    m_open[i] = m_search;
+    m_cost[i] = cost;
+    m_cameFrom[i] = parent;
+    
+    m_queue.insert(c, (U32)((cost + dist(c, goal)) * PriorityScale));
+}
@@ -0,0 +1,40 @@
+
+#pragma once
+
+#include "Coord.hpp"
+
+// Any-angle search, parent of a cell may be any cell it sees, not only a neighbour.
+// Line of sight is checked lazily when cell is expanded.
+class LazyTheta {
+public:
+    LazyTheta();
+    
+    void find(Coord start, Coord end, nook::Array<nook::vec2>& path);
+    
+    bool* walkable() { return m_map; }
+    
+private:
+    static constexpr float PriorityScale = 256.0f; // queue keeps fixed point costs
+    
+    float dist(Coord a, Coord b) const {
+        float dx = (float)a.x - (float)b.x;
+        float dy = (float)a.y - (float)b.y;
+        return std::sqrt(dx * dx + dy * dy);
+    }
+    void setVertex(Coord c, int ci);
+    void push(Coord c, Coord parent, float cost, Coord goal);
+    
+    nook::Size m_size;
+    bool* m_map;
+    nook::U32 m_maxIter;
+    nook::U32 m_queueSize;
+    nook::PriorityQueue<Coord, nook::U32> m_queue;
+    nook::Array<Coord> m_cameFrom;
+    nook::Array<float> m_cost;
+    nook::Array<nook::U32> m_open;   // cost is valid when equals m_search
+    nook::Array<nook::U32> m_closed; // expanded when equals m_search
+    nook::U32 m_search;
+    
+    Coord m_best;
+    float m_bestH;
+};
@@ -0,0 +1,38 @@
+
+#pragma once
+
+#include "Coord.hpp"
+
+// Supercover line between cell centers, every cell the segment touches must be walkable.
+// When it passes exactly through a corner, both side cells are checked, so walls are not cut.
+inline bool lineOfSight(const bool* walkable, int width, Coord from, Coord to) {
+    int x = from.x;
+    int y = from.y;
+    int nx = std::abs((int)to.x - x);
+    int ny = std::abs((int)to.y - y);
+    int sx = to.x > from.x ? 1 : -1;
+    int sy = to.y > from.y ? 1 : -1;
+    
+    for (int ix = 0, iy = 0; ix < nx || iy < ny;) {
+        int d = (1 + 2 * ix) * ny - (1 + 2 * iy) * nx;
+        if (d == 0) {
+            if (!walkable[y * width + x + sx] || !walkable[(y + sy) * width + x])
+                return false;
+            x += sx;
+            y += sy;
+            ix++;
+            iy++;
+        }
+        else if (d < 0) {
+            x += sx;
+            ix++;
+        }
+        else {
+            y += sy;
+            iy++;
+        }
+        if (!walkable[y * width + x])
+            return false;
+    }
+    return true;
+}
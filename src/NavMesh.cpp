@@ -0,0 +1,453 @@
+
+#include "NavMesh.hpp"
+#include "Map.hpp"
+#include "Rectangles.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace nook;
+
+NavMesh::NavMesh() {
+    m_size = map()->size();
+    m_tileCount = Point2(ceilDiv(m_size.width, TileSize), ceilDiv(m_size.height, TileSize));
+    
+    int count = m_size.width * m_size.height;
+    m_map = memoryManager().allocOnStack<bool>(count);
+    m_cell = memoryManager().allocOnStack<U32>(count);
+    std::memset(m_cell, 0xff, count * sizeof(U32));
+    // one polygon per cell at most
+    int pages = (count + PolygonPageSize - 1) / PolygonPageSize;
+    m_pages.init(pages, memoryManager().allocOnStack<PolygonPage*>(pages));
+    m_freePolygon = None;
+    m_polygonCount = 0;
+    m_queueSize = count;
+    m_queue.init(m_queueSize, memoryManager().allocOnStack<PriorityQueue<U32, U32>::Item>(m_queueSize));
+    m_search = 0;
+    
+    for (int y = 0; y < m_size.height; y++)
+        for (int x = 0; x < m_size.width; x++)
+            m_map[y * m_size.width + x] = map()->getCell(x, y)->walkable;
+    
+    for (int ty = 0; ty < m_tileCount.y; ty++)
+        for (int tx = 0; tx < m_tileCount.x; tx++)
+            buildTile(tx, ty);
+    for (U32 i = 0; i < m_polygonCount; i++)
+        linkPolygon(i);
+}
+
+U32 NavMesh::allocPolygon() {
+    U32 id = m_freePolygon;
+    if (id != None)
+        m_freePolygon = polygon(id).next;
+    else {
+        // no free ids, so all below the count are in use
+        id = m_polygonCount;
+        if (id == m_pages.count() * PolygonPageSize)
+            m_pages.push(m_polygonPool.alloc());
+    }
+    m_polygonCount++;
+    
+    Polygon& p = polygon(id);
+    p.portals = nullptr;
+    p.open = 0;
+    p.closed = 0;
+    return id;
+}
+
+void NavMesh::freePolygon(U32 id) {
+    Polygon& p = polygon(id);
+    clearPortals(p);
+    p.x0 = -1;
+    p.next = m_freePolygon;
+    m_freePolygon = id;
+    m_polygonCount--;
+}
+
+void NavMesh::clearPortals(Polygon& p) {
+    while (p.portals) {
+        Portal* next = p.portals->next;
+        m_portalPool.free(p.portals);
+        p.portals = next;
+    }
+}
+
+void NavMesh::clearTile(int tx, int ty) {
+    int x0 = tx * TileSize;
+    int y0 = ty * TileSize;
+    int x1 = min2(x0 + TileSize, m_size.width);
+    int y1 = min2(y0 + TileSize, m_size.height);
+    for (int y = y0; y < y1; y++)
+        for (int x = x0; x < x1; x++) {
+            U32& id = m_cell[y * m_size.width + x];
+            // every polygon is freed once, at its first cell
+            if (id != None && polygon(id).x0 == x && polygon(id).y0 == y)
+                freePolygon(id);
+            id = None;
+        }
+}
+
+void NavMesh::buildTile(int tx, int ty) {
+    int x0 = max2(tx * TileSize, 1);
+    int y0 = max2(ty * TileSize, 1);
+    int x1 = min2((tx + 1) * TileSize, m_size.width - 1) - 1;
+    int y1 = min2((ty + 1) * TileSize, m_size.height - 1) - 1;
+    
+    auto free = [&](int x, int y) {
+        int i = y * m_size.width + x;
+        return m_map[i] && m_cell[i] == None;
+    };
+    
+    decomposeRectangles(x0, y0, x1, y1, free, [&](int rx0, int ry0, int rx1, int ry1) {
+        U32 id = allocPolygon();
+        Polygon& p = polygon(id);
+        p.x0 = rx0;
+        p.y0 = ry0;
+        p.x1 = rx1;
+        p.y1 = ry1;
+        for (int j = ry0; j <= ry1; j++)
+            for (int i = rx0; i <= rx1; i++)
+                m_cell[j * m_size.width + i] = id;
+    });
+}
+
+void NavMesh::linkPolygon(U32 id) {
+    Polygon& p = polygon(id);
+    clearPortals(p);
+    
+    // Sides counter-clockwise: first cell outside, first grid corner, step and length
+    int w = p.x1 - p.x0 + 1;
+    int h = p.y1 - p.y0 + 1;
+    const int sides[4][7] = {
+        { p.x0, p.y0 - 1, p.x0, p.y0, 1, 0, w },
+        { p.x1 + 1, p.y0, p.x1 + 1, p.y0, 0, 1, h },
+        { p.x1, p.y1 + 1, p.x1 + 1, p.y1 + 1, -1, 0, w },
+        { p.x0 - 1, p.y1, p.x0, p.y1 + 1, 0, -1, h }
+    };
+    
+    for (const int* s : sides) {
+        U32 cur = None;
+        Coord a;
+        for (int i = 0; i <= s[6]; i++) {
+            U32 n = i < s[6] ? m_cell[(s[1] + s[5] * i) * m_size.width + s[0] + s[4] * i] : None;
+            if (n == cur)
+                continue;
+            Coord c(s[2] + s[4] * i, s[3] + s[5] * i);
+            if (cur != None) {
+                Portal* portal = m_portalPool.alloc();
+                *portal = { cur, a, c, p.portals };
+                p.portals = portal;
+            }
+            cur = n;
+            a = c;
+        }
+    }
+}
+
+void NavMesh::update(Rect dirty) {
+    int x0 = max2(dirty.x, 0);
+    int y0 = max2(dirty.y, 0);
+    int x1 = min2(dirty.x + dirty.width, m_size.width - 1);
+    int y1 = min2(dirty.y + dirty.height, m_size.height - 1);
+    if (x0 > x1 || y0 > y1)
+        return;
+    
+    for (int y = y0; y <= y1; y++)
+        for (int x = x0; x <= x1; x++)
+            m_map[y * m_size.width + x] = map()->getCell(x, y)->walkable;
+    
+    int tx0 = x0 / TileSize;
+    int ty0 = y0 / TileSize;
+    int tx1 = x1 / TileSize;
+    int ty1 = y1 / TileSize;
+    for (int ty = ty0; ty <= ty1; ty++)
+        for (int tx = tx0; tx <= tx1; tx++) {
+            clearTile(tx, ty);
+            buildTile(tx, ty);
+        }
+    
+    // neighbour tiles have portals to the removed polygons
+    int cx0 = max2(tx0 - 1, 0) * TileSize;
+    int cy0 = max2(ty0 - 1, 0) * TileSize;
+    int cx1 = min2((tx1 + 2) * TileSize, m_size.width);
+    int cy1 = min2((ty1 + 2) * TileSize, m_size.height);
+    for (int y = cy0; y < cy1; y++)
+        for (int x = cx0; x < cx1; x++) {
+            U32 id = m_cell[y * m_size.width + x];
+            if (id != None && polygon(id).x0 == x && polygon(id).y0 == y)
+                linkPolygon(id);
+        }
+}
+
+U32 NavMesh::polygonAt(vec2 p) const {
+    int x = (int)std::floor(p.x + m_size.width / 2);
+    int y = (int)std::floor(p.y + m_size.height / 2);
+    if (x < 0 || y < 0 || x >= m_size.width || y >= m_size.height)
+        return None;
+    return m_cell[y * m_size.width + x];
+}
+
+bool NavMesh::wallCorner(Coord c) const {
+    int i = c.y * m_size.width + c.x;
+    return !m_map[i] || !m_map[i - 1] || !m_map[i - m_size.width] || !m_map[i - m_size.width - 1];
+}
+
+vec2 NavMesh::wallOffset(Coord c, float radius) const {
+    // walls of blocked cells around the corner, the ones on both sides of an axis cancel out
+    int i = c.y * m_size.width + c.x;
+    int lt = !m_map[i - m_size.width - 1];
+    int rt = !m_map[i - m_size.width];
+    int lb = !m_map[i - 1];
+    int rb = !m_map[i];
+    int dx = lt + lb - rt - rb;
+    int dy = lt + rt - lb - rb;
+    return vec2((dx > 0) - (dx < 0), (dy > 0) - (dy < 0)) * radius;
+}
+
+bool NavMesh::portalSegment(const Portal& p, float radius, vec2& a, vec2& b) const {
+    a = cornerPos(p.a);
+    b = cornerPos(p.b);
+    float length = (b - a).length();
+    if (length < 2.0f * radius)
+        return false;
+    
+    vec2 d = (b - a) * (1.0f / length);
+    if (wallCorner(p.a))
+        a = a + d * radius;
+    if (wallCorner(p.b))
+        b = b - d * radius;
+    return true;
+}
+
+vec2 NavMesh::closestPoint(U32 poly, vec2 p, float radius) const {
+    const Polygon& r = polygon(poly);
+    vec2 min = cornerPos(Coord(r.x0, r.y0));
+    vec2 max = cornerPos(Coord(r.x1 + 1, r.y1 + 1));
+    float rx = min2(radius, (max.x - min.x) * 0.5f);
+    float ry = min2(radius, (max.y - min.y) * 0.5f);
+    return vec2(clamp(p.x, min.x + rx, max.x - rx), clamp(p.y, min.y + ry, max.y - ry));
+}
+
+bool NavMesh::find(vec2 start, vec2 end, float radius, Array<vec2>& path) {
+    U32 sp = polygonAt(start);
+    if (sp == None) {
+        path.push(start);
+        return false;
+    }
+    U32 ep = polygonAt(end);
+    
+    m_search++;
+    m_queue.clear();
+    Polygon& s = polygon(sp);
+    s.cost = 0.0f;
+    s.from = None;
+    s.entry = start;
+    s.open = m_search;
+    m_queue.insert(sp, (U32)((end - start).length() * PriorityScale));
+    
+    U32 best = sp;
+    float bestH = (closestPoint(sp, end, radius) - end).length();
+    bool found = false;
+    while (m_queue.count()) {
+        U32 cur = m_queue.pop();
+        Polygon& c = polygon(cur);
+        if (c.closed == m_search)
+            continue;
+        c.closed = m_search;
+        if (cur == ep) {
+            found = true;
+            break;
+        }
+        
+        float h = (closestPoint(cur, end, radius) - end).length();
+        if (h < bestH) {
+            bestH = h;
+            best = cur;
+        }
+        
+        // polygons are entered at the middle of the portal
+        for (const Portal* portal = c.portals; portal; portal = portal->next) {
+            Polygon& to = polygon(portal->to);
+            vec2 a, b;
+            if (to.closed == m_search || !portalSegment(*portal, radius, a, b))
+                continue;
+            
+            vec2 entry = (a + b) * 0.5f;
+            float cost = c.cost + (entry - c.entry).length();
+            if ((to.open == m_search && to.cost <= cost) || m_queue.count() == m_queueSize)
+                continue;
+            
+            to.open = m_search;
+            to.cost = cost;
+            to.from = cur;
+            to.fromPortal = portal;
+            to.entry = entry;
+            m_queue.insert(portal->to, (U32)((cost + (end - entry).length()) * PriorityScale));
+        }
+    }
+    
+    if (found)
+        pushFunnel(start, end, radius, ep, path);
+    else
+        pushFunnel(start, closestPoint(best, end, radius), radius, best, path);
+    return found;
+}
+
+void NavMesh::funnelSides(U32 pos, vec2 end, float radius, vec2& left, vec2& right) const {
+    if (pos == None) {
+        left = end;
+        right = end;
+        return;
+    }
+    // Walking out of polygon the end of its counter-clockwise side is on the left
+    const Portal& p = *polygon(pos).fromPortal;
+    vec2 a, b;
+    if (!portalSegment(p, radius, a, b)) {
+        a = (cornerPos(p.a) + cornerPos(p.b)) * 0.5f;
+        b = a;
+    }
+    left = b;
+    right = a;
+}
+
+bool NavMesh::apexOffset(U32 pos, bool left, float radius, vec2& offset) const {
+    if (pos == None || polygon(pos).from == None)
+        return false;
+    const Portal& p = *polygon(pos).fromPortal;
+    vec2 a, b;
+    Coord c = left ? p.b : p.a;
+    if (!portalSegment(p, radius, a, b) || !wallCorner(c))
+        return false;
+    offset = cornerPos(c) + wallOffset(c, radius);
+    return true;
+}
+
+bool NavMesh::clearSegment(vec2 a, vec2 b) const {
+    // cells along the segment, ends pulled in a bit so points on grid lines take the inner cell
+    vec2 d = b - a;
+    vec2 half(m_size.width / 2, m_size.height / 2);
+    a = a + half + d * 1e-4f;
+    b = b + half - d * 1e-4f;
+    int x = (int)std::floor(a.x);
+    int y = (int)std::floor(a.y);
+    int ex = (int)std::floor(b.x);
+    int ey = (int)std::floor(b.y);
+    int sx = d.x > 0.0f ? 1 : -1;
+    int sy = d.y > 0.0f ? 1 : -1;
+    float dtx = d.x != 0.0f ? std::fabs(1.0f / d.x) : 1e30f;
+    float dty = d.y != 0.0f ? std::fabs(1.0f / d.y) : 1e30f;
+    float tx = d.x != 0.0f ? (d.x > 0.0f ? x + 1 - a.x : a.x - x) * dtx : 1e30f;
+    float ty = d.y != 0.0f ? (d.y > 0.0f ? y + 1 - a.y : a.y - y) * dty : 1e30f;
+    
+    for (int steps = std::abs(ex - x) + std::abs(ey - y); steps >= 0; steps--) {
+        if (!m_map[y * m_size.width + x])
+            return false;
+        if (x == ex && y == ey)
+            return true;
+        if (tx < ty) {
+            tx += dtx;
+            x += sx;
+        }
+        else if (ty < tx) {
+            ty += dty;
+            y += sy;
+        }
+        else {
+            if (!m_map[y * m_size.width + x + sx] || !m_map[(y + sy) * m_size.width + x])
+                return false;
+            tx += dtx;
+            ty += dty;
+            x += sx;
+            y += sy;
+            steps--;
+        }
+    }
+    return m_map[ey * m_size.width + ex];
+}
+
+void NavMesh::pushFunnel(vec2 start, vec2 end, float radius, U32 last, Array<vec2>& path) {
+    // Corridor is linked forward, first is the start polygon and stands for start point
+    U32 first = last;
+    polygon(last).next = None;
+    for (U32 p = last; polygon(p).from != None; p = polygon(p).from) {
+        first = polygon(p).from;
+        polygon(first).next = p;
+    }
+    
+    auto cross = [](vec2 u, vec2 v) {
+        return u.x * v.y - u.y * v.x;
+    };
+    
+    // Simple stupid funnel: narrow both sides, when one crosses the other its point becomes the apex.
+    // Joints are written from start to end and reversed at the end.
+    int firstPoint = path.count();
+    path.push(start);
+    
+    // last joint is moved off its wall corner once the joint after it is known
+    int pending = -1;
+    vec2 offset;
+    auto settle = [&](vec2 next) {
+        if (pending >= 0 && clearSegment(path[pending - 1], offset) && clearSegment(offset, next))
+            path[pending] = offset;
+        pending = -1;
+    };
+    auto emit = [&](U32 pos, bool left, vec2 side) {
+        settle(side);
+        path.push(side);
+        if (apexOffset(pos, left, radius, offset))
+            pending = path.count() - 1;
+    };
+    vec2 apex = start;
+    vec2 left = start;
+    vec2 right = start;
+    U32 ai = first;
+    U32 li = first;
+    U32 ri = first;
+    for (U32 i = polygon(first).next;;) {
+        vec2 l, r;
+        funnelSides(i, end, radius, l, r);
+        bool restart = false;
+        
+        if (cross(right - apex, r - apex) >= 0.0f) {
+            if (apex == right || cross(left - apex, r - apex) < 0.0f) {
+                right = r;
+                ri = i;
+            }
+            else {
+                emit(li, true, left);
+                apex = left;
+                ai = li;
+                right = left;
+                ri = li;
+                restart = true;
+            }
+        }
+        
+        if (!restart && cross(left - apex, l - apex) <= 0.0f) {
+            if (apex == left || cross(right - apex, l - apex) > 0.0f) {
+                left = l;
+                li = i;
+            }
+            else {
+                emit(ri, false, right);
+                apex = right;
+                ai = ri;
+                left = right;
+                li = ri;
+                restart = true;
+            }
+        }
+        
+        // after a new apex the scan restarts from it
+        U32 from = restart ? ai : i;
+        if (from == None)
+            break;
+        i = polygon(from).next;
+    }
+    settle(end);
+    if (!(path[path.count() - 1] == end))
+        path.push(end);
+    
+    for (int i = firstPoint, j = path.count() - 1; i < j; i++, j--)
+        std::swap(path[i], path[j]);
+}
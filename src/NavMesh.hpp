@@ -0,0 +1,100 @@
+
+#pragma once
+
+#include "Coord.hpp"
+
+// Navigation mesh of walkable cells merged into rectangles. Rectangles never cross tile
+// borders, so changed walls rebuild only the tiles around them. Search goes over rectangles
+// and the funnel pulls the path tight through portals between them.
+class NavMesh {
+public:
+    NavMesh();
+    
+    // Rebuilds tiles touching dirty after walkability of cells inside it was changed in the map
+    void update(nook::Rect dirty);
+    
+    // Portals narrower than the unit are skipped. Returns false if end is unreachable,
+    // path then leads to the closest point of the closest reached rectangle.
+    bool find(nook::vec2 start, nook::vec2 end, float radius, nook::Array<nook::vec2>& path);
+    
+    nook::U32 polygonCount() const { return m_polygonCount; }
+    
+private:
+    static constexpr int TileSize = 16;
+    static constexpr int PolygonPageSize = 256;
+    static constexpr nook::U32 None = 0xffffffff;
+    static constexpr float PriorityScale = 256.0f; // queue keeps fixed point costs
+    
+    struct Portal {
+        nook::U32 to;
+        Coord a; // grid corners, a to b goes counter-clockwise around the polygon
+        Coord b;
+        Portal* next;
+    };
+    
+    // inclusive cells
+    struct Polygon {
+        int x0; // next free id while the polygon is free
+        int y0;
+        int x1;
+        int y1;
+        Portal* portals;
+        
+        // query state, cost is valid when open equals m_search
+        float cost;
+        nook::U32 from;
+        const Portal* fromPortal;
+        nook::vec2 entry; // where the search entered polygon
+        nook::U32 open;
+        nook::U32 closed; // expanded when equals m_search
+        nook::U32 next;   // corridor towards end, set by pushFunnel
+    };
+    
+    struct PolygonPage {
+        Polygon items[PolygonPageSize];
+    };
+    
+    Polygon& polygon(nook::U32 id) { return m_pages[id / PolygonPageSize]->items[id % PolygonPageSize]; }
+    const Polygon& polygon(nook::U32 id) const { return m_pages[id / PolygonPageSize]->items[id % PolygonPageSize]; }
+    nook::U32 allocPolygon();
+    void freePolygon(nook::U32 id);
+    void clearPortals(Polygon& p);
+    
+    nook::vec2 cornerPos(Coord c) const { return nook::vec2((int)c.x - m_size.width / 2, (int)c.y - m_size.height / 2); }
+    nook::U32 polygonAt(nook::vec2 p) const;
+    // wall touches grid corner, so the path keeps radius from it
+    bool wallCorner(Coord c) const;
+    // radius away from walls touching grid corner, perpendicular to each of them
+    nook::vec2 wallOffset(Coord c, float radius) const;
+    // portal ends moved inside by radius at wall corners, false if portal is narrower than the unit
+    bool portalSegment(const Portal& p, float radius, nook::vec2& a, nook::vec2& b) const;
+    nook::vec2 closestPoint(nook::U32 poly, nook::vec2 p, float radius) const;
+    
+    void clearTile(int tx, int ty);
+    void buildTile(int tx, int ty);
+    void linkPolygon(nook::U32 id);
+    // left and right side of the funnel at corridor polygon pos, None is the end.
+    // Portal too narrow for radius, which the search never takes, is passed at its middle.
+    void funnelSides(nook::U32 pos, nook::vec2 end, float radius, nook::vec2& left, nook::vec2& right) const;
+    // Wall corner of funnel side at pos moved by wallOffset, false for start, end and free corners.
+    // Funnel narrows over portal points, the joint is moved there when segments to it stay clear.
+    bool apexOffset(nook::U32 pos, bool left, float radius, nook::vec2& offset) const;
+    // segment doesn't pass a wall cell or squeeze between two diagonal ones
+    bool clearSegment(nook::vec2 a, nook::vec2 b) const;
+    void pushFunnel(nook::vec2 start, nook::vec2 end, float radius, nook::U32 last, nook::Array<nook::vec2>& path);
+    
+    nook::Size m_size;
+    nook::Point2 m_tileCount;
+    bool* m_map;
+    nook::U32* m_cell; // polygon id or None for walls
+    // ids index pages, freed ids are chained through Polygon::x0
+    nook::PagePool<PolygonPage> m_polygonPool;
+    nook::Array<PolygonPage*> m_pages;
+    nook::U32 m_freePolygon;
+    nook::U32 m_polygonCount;
+    nook::PagePool<Portal> m_portalPool;
+    
+    nook::PriorityQueue<nook::U32, nook::U32> m_queue;
+    nook::U32 m_queueSize;
+    nook::U32 m_search;
+};
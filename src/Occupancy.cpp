@@ -0,0 +1,109 @@
+
+#include "Occupancy.hpp"
+#include "DStarLite.hpp"
+#include "Map.hpp"
+#include "SymmetryReduction.hpp"
+
+using namespace nook;
+
+Occupancy::Occupancy(float minRadius) {
+    m_size = map()->size();
+    m_minRadius = minRadius;
+    m_occupied = 0;
+    m_mapCount = 0;
+    m_reduction = nullptr;
+    m_dstar = nullptr;
+    
+    int count = m_size.width * m_size.height;
+    m_count = memoryManager().allocOnStack<U16>(count);
+    std::memset(m_count, 0, count * sizeof(U16));
+}
+
+void Occupancy::attach(bool* map) {
+    ASSERT(m_mapCount < MaxMaps);
+    m_maps[m_mapCount++] = map;
+    if (empty())
+        return;
+    for (int i = 0; i < m_size.width * m_size.height; i++)
+        if (m_count[i])
+            map[i] = false;
+}
+
+void Occupancy::attach(SymmetryReduction* reduction) {
+    ASSERT(!m_reduction);
+    m_reduction = reduction;
+}
+
+void Occupancy::attach(DStarLite* dstar) {
+    ASSERT(!m_dstar);
+    m_dstar = dstar;
+    if (empty())
+        return;
+    for (int y = 0; y < m_size.height; y++)
+        for (int x = 0; x < m_size.width; x++)
+            if (occupied(x, y))
+                dstar->setWalkable(x, y, false);
+}
+
+void Occupancy::add(Circle o) {
+    if (o.radius >= m_minRadius)
+        mark(o, 1);
+}
+
+void Occupancy::remove(Circle o) {
+    if (o.radius >= m_minRadius)
+        mark(o, -1);
+}
+
+void Occupancy::mark(Circle o, int d) {
+    // same placement as WallTracing, cell (x, y) spans [x, x + 1] - half size
+    nook::Size hs = m_size / 2;
+    int x0 = max2((int)(o.pos.x - o.radius + hs.width), 1);
+    int y0 = max2((int)(o.pos.y - o.radius + hs.height), 1);
+    int x1 = min2((int)(o.pos.x + o.radius + hs.width), m_size.width - 2);
+    int y1 = min2((int)(o.pos.y + o.radius + hs.height), m_size.height - 2);
+    float r2 = o.radius * o.radius;
+    
+    for (int y = y0; y <= y1; y++)
+        for (int x = x0; x <= x1; x++) {
+            vec2 c(x + 0.5f - hs.width, y + 0.5f - hs.height);
+            if ((c - o.pos).length2() > r2)
+                continue;
+            
+            int i = y * m_size.width + x;
+            U16 was = m_count[i];
+            ASSERT(d > 0 ? was < 0xffff : was > 0);
+            m_count[i] += d;
+            if (!was || !m_count[i]) {
+                bool walkable = !m_count[i] && map()->getCell(x, y)->walkable;
+                for (int m = 0; m < m_mapCount; m++)
+                    m_maps[m][i] = walkable;
+                if (m_reduction)
+                    m_reduction->setOccupied(x, y, m_count[i] != 0);
+                if (m_dstar)
+                    m_dstar->setWalkable(x, y, walkable);
+                m_occupied += d;
+            }
+        }
+}
+
+bool Occupancy::crosses(const Array<vec2>& path) const {
+    if (empty())
+        return false;
+    
+    for (int i = 0; i + 1 < path.count(); i++) {
+        Point2 a = map()->getCoord(path[i]);
+        Point2 b = map()->getCoord(path[i + 1]);
+        int dx = (b.x > a.x) - (b.x < a.x);
+        int dy = (b.y > a.y) - (b.y < a.y);
+        for (;;) {
+            if (occupied(a.x, a.y))
+                return true;
+            if (a == b)
+                break;
+            a.x += a.x != b.x ? dx : 0;
+            a.y += a.y != b.y ? dy : 0;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,44 @@
+
+#pragma once
+
+#include "Coord.hpp"
+
+class DStarLite;
+class SymmetryReduction;
+
+// Cells blocked by big obstacles for rough search. Cell is occupied while its center
+// is inside of any obstacle with radius at least minRadius.
+class Occupancy {
+public:
+    Occupancy(float minRadius);
+    
+    void add(nook::Circle o);
+    void remove(nook::Circle o);
+    
+    // Walkability copy of rough engine, occupied cells are cleared in it and restored when free.
+    // Cells occupied before attach are cleared right away.
+    void attach(bool* map);
+    // Rectangles of the reduction with occupied cells are searched cell by cell
+    void attach(SymmetryReduction* reduction);
+    // D* Lite keeps its own walkability, requests repair the changed cells on replan
+    void attach(DStarLite* dstar);
+    
+    bool occupied(int x, int y) const { return m_count[y * m_size.width + x] != 0; }
+    bool empty() const { return m_occupied == 0; }
+    // true if straight or diagonal runs between rough path joints pass an occupied cell
+    bool crosses(const nook::Array<nook::vec2>& path) const;
+    
+private:
+    static constexpr int MaxMaps = 4;
+    
+    void mark(nook::Circle o, int d);
+    
+    nook::Size m_size;
+    float m_minRadius;
+    nook::U16* m_count; // number of obstacles over cell
+    int m_occupied;
+    bool* m_maps[MaxMaps];
+    int m_mapCount;
+    SymmetryReduction* m_reduction;
+    DStarLite* m_dstar;
+};
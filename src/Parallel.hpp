@@ -0,0 +1,30 @@
+
+#pragma once
+
+#include "misc/Common.hpp"
+
+#include <thread>
+#include <vector>
+
+// threadCount <= 0 means all hardware threads
+inline int resolveThreadCount(int threadCount) {
+    if (threadCount > 0)
+        return threadCount;
+    return nook::max2((int)std::thread::hardware_concurrency(), 1);
+}
+
+// f(thread, begin, end) is called for consecutive chunks of [0, count), thread is in [0, threadCount).
+// Chunks are at least 64 items, so small counts run on fewer threads or on the caller only.
+template<typename F>
+void parallelFor(int count, int threadCount, F f) {
+    const int minChunk = 64;
+    threadCount = nook::clamp(nook::ceilDiv(count, minChunk), 1, threadCount);
+    int chunk = nook::ceilDiv(count, threadCount);
+    
+    std::vector<std::thread> threads;
+    for (int t = 1; t < threadCount; t++)
+        threads.emplace_back(f, t, t * chunk, nook::min2((t + 1) * chunk, count));
+    f(0, 0, nook::min2(chunk, count));
+    for (std::thread& t : threads)
+        t.join();
+}
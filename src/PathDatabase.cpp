@@ -0,0 +1,255 @@
+
+#include "PathDatabase.hpp"
+#include "Map.hpp"
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+using namespace nook;
+
+namespace {
+    const U32 FileMagic = 0x4244504e; // NPDB
+    const U32 FileVersion = 1;
+
+    const Point2 Moves[8] = {
+        { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 }
+    };
+
+    // Walkability copy used only while building
+    struct Grid {
+        Size size;
+        std::vector<bool> map;
+        
+        int index(int x, int y) const { return y * size.width + x; }
+        // one step, diagonal doesn't cut walls
+        bool canMove(int x, int y, Point2 d) const {
+            return map[index(x + d.x, y + d.y)] && map[index(x + d.x, y)] && map[index(x, y + d.y)];
+        }
+    };
+}
+
+PathDatabase::PathDatabase() {
+    m_file = nullptr;
+    m_fileSize = 0;
+    m_fileCapacity = 0;
+    m_nodeCount = 0;
+    m_rank = nullptr;
+    m_component = nullptr;
+    m_runStart = nullptr;
+    m_runs = nullptr;
+}
+
+PathDatabase::~PathDatabase() {
+    unload();
+}
+
+const Point2* PathDatabase::moves() {
+    return Moves;
+}
+
+bool PathDatabase::build(const char* file, int threadCount) {
+    threadCount = resolveThreadCount(threadCount);
+    
+    Grid grid;
+    grid.size = map()->size();
+    int cells = grid.size.width * grid.size.height;
+    grid.map.resize(cells);
+    for (int y = 0; y < grid.size.height; y++)
+        for (int x = 0; x < grid.size.width; x++)
+            grid.map[grid.index(x, y)] = map()->getCell(x, y)->walkable;
+    
+    // Depth first order keeps cells of one area and one corridor together
+    std::vector<U32> rank(cells, None);
+    std::vector<U32> nodes;
+    std::vector<U32> component;
+    std::vector<U32> stack;
+    U32 label = 0;
+    for (int y = 1; y < grid.size.height - 1; y++)
+        for (int x = 1; x < grid.size.width - 1; x++) {
+            if (!grid.map[grid.index(x, y)] || rank[grid.index(x, y)] != None)
+                continue;
+            
+            stack.push_back(grid.index(x, y));
+            while (stack.size()) {
+                U32 c = stack.back();
+                stack.pop_back();
+                if (rank[c] != None)
+                    continue;
+                rank[c] = nodes.size();
+                nodes.push_back(c);
+                component.push_back(label);
+                
+                int cx = c % grid.size.width;
+                int cy = c / grid.size.width;
+                for (int d = 7; d >= 0; d--)
+                    if (grid.canMove(cx, cy, Moves[d]) && rank[grid.index(cx + Moves[d].x, cy + Moves[d].y)] == None)
+                        stack.push_back(grid.index(cx + Moves[d].x, cy + Moves[d].y));
+            }
+            label++;
+        }
+    
+    // One search per source, runs are merged in source order afterwards
+    if (nodes.size() > MaxNodes)
+        return false;
+    U32 nodeCount = nodes.size();
+    std::vector<std::vector<U32>> runs(nodeCount);
+    parallelFor(nodeCount, threadCount, [&](int, int begin, int end) {
+        std::vector<U8> first(nodeCount);
+        std::vector<U32> queue(nodeCount);
+        for (int s = begin; s < end; s++) {
+            std::fill(first.begin(), first.end(), NoMove);
+            U32 head = 0;
+            U32 tail = 0;
+            queue[tail++] = s;
+            while (head < tail) {
+                U32 c = nodes[queue[head++]];
+                int cx = c % grid.size.width;
+                int cy = c / grid.size.width;
+                for (int d = 0; d < 8; d++) {
+                    if (!grid.canMove(cx, cy, Moves[d]))
+                        continue;
+                    U32 n = rank[grid.index(cx + Moves[d].x, cy + Moves[d].y)];
+                    if (first[n] != NoMove || n == (U32)s)
+                        continue;
+                    first[n] = head == 1 ? (U8)d : first[rank[c]];
+                    queue[tail++] = n;
+                }
+            }
+            
+            // Source and unreachable targets are never asked, they extend any run.
+            // The first run starts at 0, so lookup always finds one.
+            std::vector<U32>& r = runs[s];
+            U8 cur = NoMove;
+            for (U32 k = 0; k < nodeCount; k++) {
+                if (first[k] == NoMove || first[k] == cur)
+                    continue;
+                r.push_back((r.empty() ? 0 : k << 4) | first[k]);
+                cur = first[k];
+            }
+            r.shrink_to_fit();
+        }
+    });
+    
+    // run offsets are U32 too
+    std::vector<U32> runStart(nodeCount + 1);
+    size_t runCount = 0;
+    for (U32 i = 0; i < nodeCount; i++) {
+        runStart[i] = runCount;
+        runCount += runs[i].size();
+        if (runCount > None)
+            return false;
+    }
+    runStart[nodeCount] = runCount;
+    
+    FILE* f = std::fopen(file, "wb");
+    if (!f)
+        return false;
+    
+    // Only U32 after the header, so load reads it as one array
+    FileHeader h = { FileMagic, FileVersion, (U32)grid.size.width, (U32)grid.size.height, nodeCount, (U32)runCount };
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && std::fwrite(rank.data(), sizeof(U32), cells, f) == (size_t)cells;
+    ok = ok && std::fwrite(component.data(), sizeof(U32), nodeCount, f) == nodeCount;
+    ok = ok && std::fwrite(runStart.data(), sizeof(U32), nodeCount + 1, f) == nodeCount + 1;
+    for (U32 i = 0; i < nodeCount && ok; i++)
+        ok = std::fwrite(runs[i].data(), sizeof(U32), runs[i].size(), f) == runs[i].size();
+    return std::fclose(f) == 0 && ok;
+}
+
+bool PathDatabase::load(const char* file) {
+    unload();
+    
+    FILE* f = std::fopen(file, "rb");
+    if (!f)
+        return false;
+    FileHeader h;
+    bool ok = std::fread(&h, sizeof(h), 1, f) == 1;
+    Size size = map()->size();
+    ok = ok && h.magic == FileMagic && h.version == FileVersion && h.width == (U32)size.width &&
+         h.height == (U32)size.height && h.nodeCount <= MaxNodes;
+    if (!ok) {
+        std::fclose(f);
+        return false;
+    }
+    
+    // Everything after the header is U32, one more read must hit the end of file
+    size_t cells = h.width * h.height;
+    size_t count = cells + (size_t)h.nodeCount * 2 + 1 + h.runCount;
+    if (count > m_fileCapacity) {
+        m_file = memoryManager().allocOnStack<U32>(count);
+        m_fileCapacity = count;
+    }
+    ok = std::fread(m_file, sizeof(U32), count, f) == count && std::fgetc(f) == EOF;
+    std::fclose(f);
+    if (!ok) {
+        unload();
+        return false;
+    }
+    
+    m_size = size;
+    m_fileSize = count;
+    m_nodeCount = h.nodeCount;
+    m_rank = m_file;
+    m_component = m_rank + cells;
+    m_runStart = m_component + m_nodeCount;
+    m_runs = m_runStart + m_nodeCount + 1;
+    return true;
+}
+
+void PathDatabase::unload() {
+    m_fileSize = 0;
+    m_nodeCount = 0;
+}
+
+U8 PathDatabase::firstMove(U32 from, U32 to) const {
+    const U32* begin = m_runs + m_runStart[from];
+    const U32* end = m_runs + m_runStart[from + 1];
+    if (begin == end)
+        return NoMove;
+    // the last run starting at or before to
+    const U32* run = std::upper_bound(begin, end, (to << 4) | 0xf) - 1;
+    return *run & 0xf;
+}
+
+U8 PathDatabase::firstMove(Coord from, Coord to) const {
+    if (!m_fileSize || from == to)
+        return NoMove;
+    U32 f = m_rank[from.y * m_size.width + from.x];
+    U32 t = m_rank[to.y * m_size.width + to.x];
+    if (f == None || t == None || m_component[f] != m_component[t])
+        return NoMove;
+    return firstMove(f, t);
+}
+
+bool PathDatabase::find(Coord start, Coord end, Array<vec2>& path) const {
+    if (start == end) {
+        path.push(map()->getPos(start.point()));
+        return true;
+    }
+    if (firstMove(start, end) == NoMove) {
+        path.push(map()->getPos(start.point()));
+        return false;
+    }
+    
+    // Joints are written from start to end and reversed at the end
+    int first = path.count();
+    U32 target = m_rank[end.y * m_size.width + end.x];
+    Coord c = start;
+    U8 last = NoMove;
+    path.push(map()->getPos(start.point()));
+    for (U32 steps = 0; c != end && steps < m_nodeCount; steps++) {
+        U8 d = firstMove(m_rank[c.y * m_size.width + c.x], target);
+        if (d != last && last != NoMove)
+            path.push(map()->getPos(c.point()));
+        last = d;
+        c.x += Moves[d].x;
+        c.y += Moves[d].y;
+    }
+    path.push(map()->getPos(c.point()));
+    
+    for (int i = first, j = path.count() - 1; i < j; i++, j--)
+        std::swap(path[i], path[j]);
+    return c == end;
+}
@@ -0,0 +1,63 @@
+
+#pragma once
+
+#include "Coord.hpp"
+
+#include <cstddef>
+
+// Compressed path database for maps which never change walkability.
+// For every walkable cell it keeps the first move of a shortest path to every other cell,
+// run-length compressed over depth first order of cells, so nearby targets share runs.
+// Query replays the path with one binary search per step.
+class PathDatabase {
+public:
+    static constexpr nook::U8 NoMove = 8;
+    
+    PathDatabase();
+    ~PathDatabase();
+    
+    // Offline, one breadth first search per walkable cell of the current map.
+    // threadCount <= 0 uses all hardware threads, the file is the same for any count.
+    // Fails for maps with more than MaxNodes walkable cells.
+    static bool build(const char* file, int threadCount = 0);
+    // Reads the file into stack memory, fails if it was built for other map size.
+    // Memory is reused by later loads that fit, a bigger file takes new memory.
+    bool load(const char* file);
+    
+    // Direction index for moves() or NoMove if to is unreachable
+    nook::U8 firstMove(Coord from, Coord to) const;
+    // Returns false if end is unreachable, path contains only start then
+    bool find(Coord start, Coord end, nook::Array<nook::vec2>& path) const;
+    
+    static const nook::Point2* moves();
+    std::size_t memoryUsage() const { return m_fileSize * sizeof(nook::U32); }
+    
+private:
+    static constexpr nook::U32 None = 0xffffffff;
+    // run keeps target order in the upper 28 bits
+    static constexpr nook::U32 MaxNodes = 1 << 28;
+    
+    struct FileHeader {
+        nook::U32 magic;
+        nook::U32 version;
+        nook::U32 width;
+        nook::U32 height;
+        nook::U32 nodeCount;
+        nook::U32 runCount;
+    };
+    
+    nook::U8 firstMove(nook::U32 from, nook::U32 to) const;
+    void unload();
+    
+    nook::U32* m_file;
+    std::size_t m_fileSize;     // 0 when nothing is loaded
+    std::size_t m_fileCapacity;
+    
+    // views into m_file
+    nook::Size m_size;
+    nook::U32 m_nodeCount;
+    const nook::U32* m_rank;      // order of cell or None for walls
+    const nook::U32* m_component; // by order
+    const nook::U32* m_runStart;  // runs of node i are [m_runStart[i], m_runStart[i + 1])
+    const nook::U32* m_runs;      // first target order << 4 | move
+};
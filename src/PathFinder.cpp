@@ -1,5 +1,6 @@
 
 #include "PathFinder.hpp"
+#include "LineOfSight.hpp"
 #include "Map.hpp"
 #include "scenes/GameScene.hpp"
 
@@ -12,10 +13,23 @@ PathFinder* PathFinder::s_instance;
 PathFinder::PathFinder() {
     s_instance = this;
     m_size = map()->size();
+    m_landmarks = nullptr;
+    m_landmarksStale = false;
+    m_heuristic = Heuristic::Chebyshev;
     
+    m_astar = nullptr;
+    m_jps = nullptr;
+    m_lazyTheta = nullptr;
+    m_dstarLite = nullptr;
+    m_reduction = nullptr;
     m_jpsPlus = memoryManager().createOnStack<JPSplus>();
     m_wallTracing = memoryManager().createOnStack<WallTracing>();
     
+    // Obstacles of this radius and bigger block rough paths of all grid engines.
+    // JPS+ jump table can't follow them, so findRough falls back to JPS.
+    m_occupancy = memoryManager().createOnStack<Occupancy>(1.0f);
+    m_wallTracing->setOccupancy(m_occupancy);
+    
     // Visual Path
     m_pathObject.partCount = 1;
     m_pathObject.parts = memoryManager().allocOnStack<RenderParam>();
@@ -42,18 +56,138 @@ PathFinder::PathFinder() {
 
 PathFinder::~PathFinder() {
     m_wallTracing->~WallTracing();
+    if (m_dstarLite)
+        m_dstarLite->~DStarLite();
     s_instance = nullptr;
     DynamicBuffer* buf = ((DynamicVAO*)m_pathObject.parts->vao)->buffer();
     memoryManager().remove(m_pathObject.parts->vao);
     memoryManager().remove(buf);
 }
 
-void PathFinder::findRough(vec2 start, vec2 end, Array<vec2>& path) {
+AStar* PathFinder::astar() {
+    if (!m_astar) {
+        m_astar = memoryManager().createOnStack<AStar>();
+        m_occupancy->attach(m_astar->walkable());
+    }
+    return m_astar;
+}
+
+JPS* PathFinder::jps() {
+    if (!m_jps) {
+        m_jps = memoryManager().createOnStack<JPS>();
+        m_occupancy->attach(m_jps->walkable());
+    }
+    return m_jps;
+}
+
+LazyTheta* PathFinder::lazyTheta() {
+    if (!m_lazyTheta) {
+        m_lazyTheta = memoryManager().createOnStack<LazyTheta>();
+        m_occupancy->attach(m_lazyTheta->walkable());
+    }
+    return m_lazyTheta;
+}
+
+DStarLite* PathFinder::dstarLite() {
+    if (!m_dstarLite) {
+        // few units keep one goal, each request holds arrays of the whole map
+        m_dstarLite = memoryManager().createOnStack<DStarLite>(8);
+        m_occupancy->attach(m_dstarLite);
+    }
+    return m_dstarLite;
+}
+
+void PathFinder::setReduced(bool reduced) {
+    if (reduced && !m_reduction) {
+        m_reduction = memoryManager().createOnStack<SymmetryReduction>(astar()->walkable());
+        m_occupancy->attach(m_reduction);
+    }
+    astar()->setReduction(reduced ? m_reduction : nullptr);
+}
+
+void PathFinder::setHeuristic(Heuristic h, int landmarkCount) {
+    if (h == Heuristic::Landmarks && !m_landmarks)
+        m_landmarks = memoryManager().createOnStack<Landmarks>(landmarkCount);
+    else if (h == Heuristic::Landmarks && m_landmarksStale)
+        m_landmarks->update();
+    if (h == Heuristic::Landmarks)
+        m_landmarksStale = false;
+    m_heuristic = h;
+}
+
+void PathFinder::update(Rect dirty) {
+    int x0 = max2(dirty.x, 0);
+    int y0 = max2(dirty.y, 0);
+    int x1 = min2(dirty.x + dirty.width, m_size.width);
+    int y1 = min2(dirty.y + dirty.height, m_size.height);
+    for (int y = y0; y < y1; y++)
+        for (int x = x0; x < x1; x++) {
+            bool w = map()->getCell(x, y)->walkable && !m_occupancy->occupied(x, y);
+            if (m_astar)
+                m_astar->walkable()[index(x, y)] = w;
+            if (m_jps)
+                m_jps->walkable()[index(x, y)] = w;
+            if (m_lazyTheta)
+                m_lazyTheta->walkable()[index(x, y)] = w;
+        }
+    
+    // counts occupied cells of new rectangles in A* walkability, so it goes after it
+    if (m_reduction)
+        m_reduction->update(dirty);
+    if (m_dstarLite)
+        m_dstarLite->update(dirty);
+    m_jpsPlus->update();
+    m_wallTracing->update(dirty);
+    if (m_heuristic == Heuristic::Landmarks)
+        m_landmarks->update(dirty);
+    else if (m_landmarks)
+        m_landmarksStale = true;
+}
+
+void PathFinder::findRough(vec2 start, vec2 end, Array<vec2>& path, bool avoidObstacles, bool smooth) {
     Point2 s = map()->getCoord(start);
     Point2 e = map()->getCoord(end);
     s.x = clamp(s.x, 1, m_size.width - 2);
     s.y = clamp(s.y, 1, m_size.height - 2);
     m_jpsPlus->find(Coord(s.x, s.y), Coord(e.x, e.y), path);
+    
+    if (avoidObstacles && m_occupancy->crosses(path)) {
+        path.setCount(0);
+        jps()->find(Coord(s.x, s.y), Coord(e.x, e.y), path);
+    }
+    
+    if (smooth)
+        smoothRough(path, avoidObstacles ? m_jps->walkable() : m_jpsPlus->walkable());
+}
+
+void PathFinder::findAnchored(vec2 start, vec2 goal, Array<vec2>& path, bool smooth) {
+    Point2 s = map()->getCoord(start);
+    Point2 g = map()->getCoord(goal);
+    s.x = clamp(s.x, 1, m_size.width - 2);
+    s.y = clamp(s.y, 1, m_size.height - 2);
+    g.x = clamp(g.x, 1, m_size.width - 2);
+    g.y = clamp(g.y, 1, m_size.height - 2);
+    m_jpsPlus->findAnchored(Coord(s.x, s.y), Coord(g.x, g.y), path);
+    
+    if (smooth)
+        smoothRough(path, m_jpsPlus->walkable());
+}
+
+void PathFinder::smoothRough(Array<vec2>& path, const bool* walkable) {
+    int n = path.count();
+    if (n < 3)
+        return;
+    
+    // joint i is dropped when the last kept one sees the next
+    int w = 0;
+    for (int i = 1; i < n - 1; i++) {
+        Point2 a = map()->getCoord(path[w]);
+        Point2 b = map()->getCoord(path[i + 1]);
+        if (!lineOfSight(walkable, m_size.width, Coord(a.x, a.y), Coord(b.x, b.y)))
+            path[++w] = path[i];
+    }
+    path[++w] = path[n - 1];
+    path.setCount(w + 1);
 }
 
 void PathFinder::showPath(Array<vec2>& path) {
@@ -2,8 +2,13 @@
 #pragma once
 
 #include "AStar.hpp"
+#include "DStarLite.hpp"
 #include "JPS.hpp"
 #include "JPSplus.hpp"
+#include "Landmarks.hpp"
+#include "LazyTheta.hpp"
+#include "Occupancy.hpp"
+#include "SubgoalGraph.hpp"
 #include "WallTracing.hpp"
 
 #include "visual/3D/RenderObject.hpp"
@@ -12,31 +17,72 @@ class PathFinder {
 public:
     static PathFinder* s_instance;
     
+    enum class Heuristic {
+        Chebyshev,
+        Landmarks   // max of Chebyshev and ALT, much closer on maps with long detours
+    };
+    
     PathFinder();
     ~PathFinder();
     
-    void findRough(nook::vec2 start, nook::vec2 end, nook::Array<nook::vec2>& path);
+    // With avoidObstacles cells under big obstacles are blocked. JPS+ table doesn't know them,
+    // so when its path crosses such cell the search is repeated with JPS over occupancy.
+    // With smooth joints that see each other past the ones between are removed.
+    void findRough(nook::vec2 start, nook::vec2 end, nook::Array<nook::vec2>& path, bool avoidObstacles = false,
+                   bool smooth = false);
+    // Call after walkability of cells inside dirty was changed in the map. Refreshes all rough
+    // engines, wall corners and distances of landmarks that reached the changed cells (whole map
+    // per landmark, so it is the slow part). Landmarks not in use are refilled on the next switch.
+    void update(nook::Rect dirty);
+    // For a unit chasing one goal. JPS+ keeps its tree from goal until other goal or update(),
+    // so repaths from the moving start mostly read it. Big obstacles are not avoided.
+    void findAnchored(nook::vec2 start, nook::vec2 goal, nook::Array<nook::vec2>& path, bool smooth = false);
     void showPath(nook::Array<nook::vec2>& path);
+    void smoothRough(nook::Array<nook::vec2>& path, const bool* walkable);
     
     int index(int x, int y) { return y * m_size.width + x; }
     
+    // Used by A*, JPS, JPS+, SubgoalGraph and DStarLite. LazyTheta, NavMesh and ContractionHierarchy
+    // keep their own Euclidean or exact estimates. Landmarks are computed on the first switch
+    // to them, landmarkCount is ignored after that.
+    void setHeuristic(Heuristic h, int landmarkCount = 8);
+    
     nook::U32 heuristic(Coord c1, Coord c2) {
 //        int x = (int)c1.x - (int)c2.x;
 //        int y = (int)c1.y - (int)c2.y;
 //        return x * x + y * y;
         int dx = std::abs((int)c1.x - (int)c2.x);
         int dy = std::abs((int)c1.y - (int)c2.y);
-        return nook::max2(dx, dy);
+        nook::U32 h = nook::max2(dx, dy);
+        if (m_heuristic == Heuristic::Landmarks)
+            h = nook::max2(h, m_landmarks->heuristic(c1, c2));
+        return h;
     }
     
+    // Grid engines whose walkability includes occupancy, created and attached on first use
+    AStar* astar();
+    JPS* jps();
+    LazyTheta* lazyTheta();
+    // Incremental search for units that keep one goal, kept up to date by update()
+    DStarLite* dstarLite();
+    // A* searches the rectangular symmetry reduction of its walkability, built on first use
+    void setReduced(bool reduced);
     WallTracing* wallTracing() { return m_wallTracing; }
+    Occupancy* occupancy() { return m_occupancy; }
     
 private:
     nook::Size m_size;
     AStar* m_astar;
     JPS* m_jps;
     JPSplus* m_jpsPlus;
+    LazyTheta* m_lazyTheta;
+    DStarLite* m_dstarLite;
+    SymmetryReduction* m_reduction;
     WallTracing* m_wallTracing;
+    Occupancy* m_occupancy;
+    Landmarks* m_landmarks;
+    Heuristic m_heuristic;
+    bool m_landmarksStale; // walls changed while other heuristic was used
     
     nook::RenderObject m_pathObject;
     nook::mat4 m_pathTransform;
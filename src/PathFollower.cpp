@@ -0,0 +1,283 @@
+
+#include "PathFollower.hpp"
+#include "PathFinder.hpp"
+
+using namespace nook;
+
+namespace {
+    template<typename T>
+    void allocArray(Array<T>& a, U32 capacity) {
+        a.init(capacity, memoryManager().allocOnStack<T>(capacity));
+    }
+
+    void copyPoints(Array<vec2>& to, const Array<vec2>& from) {
+        std::memcpy(to.buf(), from.buf(), from.count() * sizeof(vec2));
+        to.setCount(from.count());
+    }
+}
+
+PathFollower::PathFollower(int maxUnits, int threadCount) {
+    if (threadCount <= 0)
+        threadCount = max2((int)std::thread::hardware_concurrency() - 1, 1);
+    
+    m_maxUnits = maxUnits;
+    m_unitCount = 0;
+    m_units = memoryManager().allocOnStack<Unit>(maxUnits);
+    for (int i = 0; i < maxUnits; i++) {
+        Unit& u = m_units[i];
+        u.active = false;
+        u.pending = false;
+        u.serial = 0;
+        allocArray(u.rough, MaxRough);
+        allocArray(u.path, MaxPath);
+        allocArray(u.next, MaxPath);
+        allocArray(u.result, MaxPath);
+    }
+    allocArray(m_freeUnits, maxUnits);
+    allocArray(m_batch, maxUnits);
+    allocArray(m_received, maxUnits);
+    allocArray(m_jobs, maxUnits);
+    allocArray(m_results, maxUnits);
+    
+    m_running = 0;
+    m_quit = false;
+    // queries allocate their memory here, not on workers
+    m_queries = memoryManager().allocOnStack<WallTracing::Query*>(threadCount);
+    for (int i = 0; i < threadCount; i++) {
+        WallTracing::Query* q = memoryManager().createOnStack<WallTracing::Query>(*pathFinder().wallTracing());
+        m_queries[i] = q;
+        m_threads.emplace_back(&PathFollower::work, this, q);
+    }
+}
+
+PathFollower::~PathFollower() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+        m_jobs.setCount(0);
+    }
+    m_wake.notify_all();
+    for (std::thread& t : m_threads)
+        t.join();
+    for (int i = 0; i < (int)m_threads.size(); i++)
+        m_queries[i]->~Query();
+}
+
+int PathFollower::addUnit(float radius) {
+    int id;
+    if (m_freeUnits.count()) {
+        id = m_freeUnits[m_freeUnits.count() - 1];
+        m_freeUnits.setCount(m_freeUnits.count() - 1);
+    }
+    else if (m_unitCount < m_maxUnits)
+        id = m_unitCount++;
+    else
+        return -1;
+    
+    Unit& u = m_units[id];
+    u.active = true;
+    u.moving = false;
+    u.nextReady = false;
+    u.partial = false;
+    u.nextPartial = false;
+    u.redirect = false;
+    u.serial++;
+    u.radius = radius;
+    u.speed = 0.0f;
+    u.pos = vec2(0.0f, 0.0f);
+    u.rough.setCount(0);
+    u.path.setCount(0);
+    u.next.setCount(0);
+    return id;
+}
+
+void PathFollower::removeUnit(int unit) {
+    Unit& u = m_units[unit];
+    u.active = false;
+    u.moving = false;
+    u.redirect = false;
+    u.serial++;
+    // worker still writes into the unit, it is freed when the result comes
+    if (!u.pending)
+        m_freeUnits.push(unit);
+}
+
+void PathFollower::moveTo(int unit, vec2 dest) {
+    Unit& u = m_units[unit];
+    u.serial++;
+    u.dest = dest;
+    if (u.pending) {
+        u.redirect = true;
+        return;
+    }
+    startMove(unit);
+}
+
+void PathFollower::startMove(int unit) {
+    Unit& u = m_units[unit];
+    u.redirect = false;
+    u.nextReady = false;
+    u.partial = false;
+    u.path.setCount(0);
+    u.next.setCount(0);
+    
+    u.rough.setCount(0);
+    pathFinder().findRough(u.pos, u.dest, u.rough, true, true);
+    
+    // rough path ends in cell center, so the exact destination replaces it
+    if (u.rough.count())
+        u.rough[0] = u.dest;
+    else
+        u.rough.push(u.dest);
+    u.target = max2((int)u.rough.count() - 2, 0);
+    u.moving = true;
+    
+    request(unit, false, u.pos, u.rough[u.target]);
+}
+
+void PathFollower::stop(int unit) {
+    Unit& u = m_units[unit];
+    u.serial++;
+    u.moving = false;
+    u.redirect = false;
+    u.nextReady = false;
+    u.path.setCount(0);
+    u.next.setCount(0);
+}
+
+void PathFollower::setPosition(int unit, vec2 pos, float speed) {
+    m_units[unit].pos = pos;
+    m_units[unit].speed = speed;
+}
+
+vec2 PathFollower::waypoint(int unit) const {
+    const Unit& u = m_units[unit];
+    if (!u.moving)
+        return u.pos;
+    return u.path.count() ? u.path[u.path.count() - 1] : u.rough[u.target];
+}
+
+void PathFollower::update() {
+    // changes delayed by workers still reading the other obstacle set
+    pathFinder().wallTracing()->commitObstacles();
+    
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::memcpy(m_received.buf(), m_results.buf(), m_results.count() * sizeof(Result));
+        m_received.setCount(m_results.count());
+        m_results.setCount(0);
+    }
+    for (const Result& r : m_received)
+        receive(r);
+    
+    for (int i = 0; i < m_unitCount; i++) {
+        Unit& u = m_units[i];
+        if (!u.moving)
+            continue;
+        
+        while (u.path.count() > 1 && (u.path[u.path.count() - 1] - u.pos).length() < ArriveDistance)
+            u.path.setCount(u.path.count() - 1);
+        
+        float dist = (u.rough[u.target] - u.pos).length();
+        bool atEnd = u.path.count() == 1 && (u.path[0] - u.pos).length() < ArriveDistance;
+        // cut path is continued from its end before anything else
+        if (u.partial) {
+            if (atEnd && !u.pending) {
+                u.partial = false;
+                request(i, false, u.path[0], u.rough[u.target]);
+            }
+            continue;
+        }
+        
+        bool arrived = dist < ArriveDistance || atEnd;
+        if (!u.target) {
+            if (arrived)
+                u.moving = false;
+            continue;
+        }
+        
+        if (arrived && u.nextReady) {
+            copyPoints(u.path, u.next);
+            u.partial = u.nextPartial;
+            u.next.setCount(0);
+            u.nextReady = false;
+            u.target--;
+        }
+        else if (!u.pending && !u.nextReady && dist < max2(u.speed * LookaheadTime, ArriveDistance))
+            request(i, true, u.rough[u.target], u.rough[u.target - 1]);
+    }
+    
+    if (m_batch.count()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (const Job& job : m_batch)
+                m_jobs.push(job);
+        }
+        m_batch.setCount(0);
+        m_wake.notify_all();
+    }
+}
+
+void PathFollower::receive(const Result& r) {
+    Unit& u = m_units[r.unit];
+    u.pending = false;
+    if (!u.active) {
+        m_freeUnits.push(r.unit);
+        return;
+    }
+    if (u.serial != r.serial) {
+        if (u.redirect)
+            startMove(r.unit);
+        return;
+    }
+    
+    if (r.next) {
+        copyPoints(u.next, u.result);
+        u.nextPartial = r.partial;
+        u.nextReady = true;
+    }
+    else {
+        copyPoints(u.path, u.result);
+        u.partial = r.partial;
+    }
+}
+
+void PathFollower::sync() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle.wait(lock, [&]() { return !m_jobs.count() && !m_running; });
+}
+
+void PathFollower::request(int unit, bool next, vec2 from, vec2 to) {
+    Unit& u = m_units[unit];
+    ASSERT(!u.pending);
+    u.pending = true;
+    m_batch.push({ unit, u.serial, next, u.radius, from, to });
+}
+
+void PathFollower::work(WallTracing::Query* q) {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [&]() { return m_quit || m_jobs.count(); });
+            if (m_quit)
+                return;
+            job = m_jobs[m_jobs.count() - 1];
+            m_jobs.setCount(m_jobs.count() - 1);
+            m_running++;
+        }
+        
+        // only this worker touches result while the unit is pending
+        Array<vec2>& result = m_units[job.unit].result;
+        int count = MaxPath;
+        WallTracing::Status status =
+            pathFinder().wallTracing()->find(*q, job.from, job.to, job.radius, result.buf(), count);
+        result.setCount(count);
+        bool partial = status == WallTracing::Status::Exhausted || status == WallTracing::Status::Overflow;
+        
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_results.push({ job.unit, job.serial, job.next, partial && count > 0 });
+        if (!--m_running && !m_jobs.count())
+            m_idle.notify_all();
+    }
+}
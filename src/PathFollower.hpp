@@ -0,0 +1,106 @@
+
+#pragma once
+
+#include "WallTracing.hpp"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Rough path to destination and precise paths to its points for many units.
+// Precise path to the next rough point is found on worker threads while unit is
+// still walking the current one. Requests of all units are sent once per update().
+// Each unit has at most one query on workers, all memory is allocated in constructor.
+class PathFollower {
+public:
+    // threadCount <= 0 uses all hardware threads but one
+    PathFollower(int maxUnits, int threadCount = 0);
+    ~PathFollower();
+    
+    // -1 when all maxUnits units are in use
+    int addUnit(float radius);
+    void removeUnit(int unit);
+    
+    // Rough path is found immediately, precise ones are requested on next update().
+    // While a query of the unit is on worker the destination waits for its result.
+    void moveTo(int unit, nook::vec2 dest);
+    void stop(int unit);
+    void setPosition(int unit, nook::vec2 pos, float speed);
+    
+    // Game thread, once per tick after positions are set. Obstacle changes are committed here,
+    // queries already on workers keep the obstacles they started with.
+    void update();
+    // Waits for all running queries. Must be called before walls are changed, obstacles need no sync.
+    void sync();
+    
+    bool moving(int unit) const { return m_units[unit].moving; }
+    // Point to steer to, straight to rough point while precise path is not ready yet
+    nook::vec2 waypoint(int unit) const;
+    
+private:
+    static constexpr float LookaheadTime = 1.0f; // seconds of walking before rough point
+    static constexpr float ArriveDistance = 0.3f;
+    static constexpr int MaxPath = 64; // longer precise path is cut and found again from its end
+    static constexpr int MaxRough = 512;
+    
+    struct Unit {
+        bool active;
+        bool moving;
+        bool pending;     // query is on worker, it writes into result
+        bool nextReady;
+        bool partial;     // path ends before rough[target]
+        bool nextPartial;
+        bool redirect;    // dest is sent when the pending result comes
+        nook::U32 serial; // new destination drops results of older queries
+        float radius;
+        float speed;
+        nook::vec2 pos;
+        nook::vec2 dest;
+        
+        nook::Array<nook::vec2> rough;  // from end to start
+        int target;                     // rough point the path leads to
+        nook::Array<nook::vec2> path;   // precise to rough[target], from end to start
+        nook::Array<nook::vec2> next;   // precise from rough[target] to rough[target - 1]
+        nook::Array<nook::vec2> result; // written by worker
+    };
+    
+    struct Job {
+        int unit;
+        nook::U32 serial;
+        bool next;
+        float radius;
+        nook::vec2 from;
+        nook::vec2 to;
+    };
+    
+    struct Result {
+        int unit;
+        nook::U32 serial;
+        bool next;
+        bool partial;
+    };
+    
+    void startMove(int unit);
+    void request(int unit, bool next, nook::vec2 from, nook::vec2 to);
+    void receive(const Result& r);
+    void work(WallTracing::Query* q);
+    
+    // all arrays hold at most one item per unit
+    int m_maxUnits;
+    int m_unitCount;
+    Unit* m_units;
+    nook::Array<int> m_freeUnits;
+    nook::Array<Job> m_batch; // collected during update
+    nook::Array<Result> m_received;
+    
+    std::vector<std::thread> m_threads;
+    WallTracing::Query** m_queries;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_idle;
+    nook::Array<Job> m_jobs;
+    nook::Array<Result> m_results;
+    int m_running;
+    bool m_quit;
+};
@@ -0,0 +1,30 @@
+
+#pragma once
+
+#include "Coord.hpp"
+
+// Greedy split of free cells inside inclusive [x0, x1] x [y0, y1] into rectangles: as wide as
+// possible from the first free cell, then as high as possible. add(x0, y0, x1, y1) gets inclusive
+// bounds and must mark the cells, so free(x, y) is false for them after it returns.
+template<typename Free, typename Add>
+void decomposeRectangles(int x0, int y0, int x1, int y1, Free free, Add add) {
+    for (int y = y0; y <= y1; y++)
+        for (int x = x0; x <= x1; x++) {
+            if (!free(x, y))
+                continue;
+            
+            int rx1 = x;
+            while (rx1 < x1 && free(rx1 + 1, y))
+                rx1++;
+            int ry1 = y;
+            while (ry1 < y1) {
+                bool row = true;
+                for (int i = x; i <= rx1 && row; i++)
+                    row = free(i, ry1 + 1);
+                if (!row)
+                    break;
+                ry1++;
+            }
+            add(x, y, rx1, ry1);
+        }
+}
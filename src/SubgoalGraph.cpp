@@ -0,0 +1,310 @@
+
+#include "SubgoalGraph.hpp"
+#include "PathFinder.hpp"
+#include "Map.hpp"
+
+#include <vector>
+
+using namespace nook;
+
+SubgoalGraph::SubgoalGraph() {
+    m_size = map()->size();
+    
+    int count = m_size.width * m_size.height;
+    m_map = memoryManager().allocOnStack<bool>(count);
+    m_cell = memoryManager().allocOnStack<U32>(count);
+    m_component = memoryManager().allocOnStack<U16>(count);
+    
+    for (int y = 0; y < m_size.height; y++)
+        for (int x = 0; x < m_size.width; x++)
+            m_map[pathFinder().index(x, y)] = map()->getCell(x, y)->walkable;
+    labelComponents();
+    
+    std::vector<Coord> subgoals;
+    std::memset(m_cell, 0xff, count * sizeof(U32));
+    for (int y = 1; y < m_size.height - 1; y++)
+        for (int x = 1; x < m_size.width - 1; x++) {
+            Coord c(x, y);
+            if (isSubgoal(c)) {
+                m_cell[index(c)] = subgoals.size();
+                subgoals.push_back(c);
+            }
+        }
+    
+    m_count = subgoals.size();
+    m_subgoals = memoryManager().allocOnStack<Coord>(max2(m_count, 1u));
+    std::memcpy(m_subgoals, subgoals.data(), m_count * sizeof(Coord));
+    
+    std::vector<Edge> edges;
+    m_edgeStart = memoryManager().allocOnStack<U32>(m_count + 1);
+    for (U32 i = 0; i < m_count; i++) {
+        m_edgeStart[i] = edges.size();
+        forReachable(m_subgoals[i], [&](U32 id, U32 cost) {
+            edges.push_back({ id, cost });
+        });
+    }
+    m_edgeStart[m_count] = edges.size();
+    m_edges = memoryManager().allocOnStack<Edge>(max2((U32)edges.size(), 1u));
+    std::memcpy(m_edges, edges.data(), edges.size() * sizeof(Edge));
+    
+    int nodes = m_count + 2;
+    m_queueSize = edges.size() + nodes;
+    m_queue.init(m_queueSize, memoryManager().allocOnStack<PriorityQueue<U32, U32>::Item>(m_queueSize));
+    m_cost = memoryManager().allocOnStack<U32>(nodes);
+    m_cameFrom = memoryManager().allocOnStack<U32>(nodes);
+    m_open = memoryManager().allocOnStack<U32>(nodes);
+    m_closed = memoryManager().allocOnStack<U32>(nodes);
+    m_goal = memoryManager().allocOnStack<U32>(nodes);
+    m_goalCost = memoryManager().allocOnStack<U32>(nodes);
+    std::memset(m_open, 0, nodes * sizeof(U32));
+    std::memset(m_closed, 0, nodes * sizeof(U32));
+    std::memset(m_goal, 0, nodes * sizeof(U32));
+    m_search = 0;
+}
+
+bool SubgoalGraph::isSubgoal(Coord c) const {
+    if (!m_map[index(c)])
+        return false;
+    
+    for (int dy = -1; dy <= 1; dy += 2)
+        for (int dx = -1; dx <= 1; dx += 2) {
+            int i = index(c);
+            if (!m_map[i + dy * m_size.width + dx] && m_map[i + dx] && m_map[i + dy * m_size.width])
+                return true;
+        }
+    return false;
+}
+
+template<typename F>
+void SubgoalGraph::forReachable(Coord c, F f) const {
+    // straight scans stop at walls and subgoals, their lengths bound scans from diagonal cells
+    const int dirs[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+    int clear[4];
+    for (int k = 0; k < 4; k++) {
+        Coord p = c;
+        int n = 0;
+        clear[k] = 0;
+        while (canMove(p, dirs[k][0], dirs[k][1])) {
+            p.x += dirs[k][0];
+            p.y += dirs[k][1];
+            n++;
+            if (m_cell[index(p)] != None) {
+                f(m_cell[index(p)], n);
+                n--;
+                break;
+            }
+        }
+        clear[k] = n;
+    }
+    
+    for (int sy = -1; sy <= 1; sy += 2)
+        for (int sx = -1; sx <= 1; sx += 2) {
+            int mx = clear[sx > 0 ? 0 : 1];
+            int my = clear[sy > 0 ? 2 : 3];
+            Coord p = c;
+            int d = 0;
+            while (canMove(p, sx, sy)) {
+                p.x += sx;
+                p.y += sy;
+                d++;
+                if (m_cell[index(p)] != None) {
+                    f(m_cell[index(p)], d);
+                    break;
+                }
+                
+                Coord q = p;
+                int i = 0;
+                while (i < mx && canMove(q, sx, 0)) {
+                    q.x += sx;
+                    i++;
+                    if (m_cell[index(q)] != None) {
+                        f(m_cell[index(q)], d + i);
+                        i--;
+                        break;
+                    }
+                }
+                mx = i;
+                
+                q = p;
+                i = 0;
+                while (i < my && canMove(q, 0, sy)) {
+                    q.y += sy;
+                    i++;
+                    if (m_cell[index(q)] != None) {
+                        f(m_cell[index(q)], d + i);
+                        i--;
+                        break;
+                    }
+                }
+                my = i;
+            }
+        }
+}
+
+void SubgoalGraph::reachable(Coord c, Array<Edge>& out) const {
+    if (m_cell[index(c)] != None)
+        out.push({ m_cell[index(c)], 0 });
+    forReachable(c, [&](U32 id, U32 cost) {
+        out.push({ id, cost });
+    });
+}
+
+bool SubgoalGraph::walkDirect(Coord a, Coord b, bool diagonalFirst, Coord& bend) const {
+    int dx = (b.x > a.x) - (b.x < a.x);
+    int dy = (b.y > a.y) - (b.y < a.y);
+    int nx = std::abs((int)b.x - (int)a.x);
+    int ny = std::abs((int)b.y - (int)a.y);
+    int diagonal = min2(nx, ny);
+    int straight = std::abs(nx - ny);
+    int sx = nx > ny ? dx : 0;
+    int sy = nx > ny ? 0 : dy;
+    
+    Coord p = a;
+    auto walk = [&](int mx, int my, int n) {
+        for (int i = 0; i < n; i++) {
+            if (!canMove(p, mx, my))
+                return false;
+            p.x += mx;
+            p.y += my;
+        }
+        return true;
+    };
+    
+    if (diagonalFirst) {
+        if (!walk(dx, dy, diagonal))
+            return false;
+        bend = p;
+        return walk(sx, sy, straight);
+    }
+    if (!walk(sx, sy, straight))
+        return false;
+    bend = p;
+    return walk(dx, dy, diagonal);
+}
+
+void SubgoalGraph::labelComponents() {
+    int count = m_size.width * m_size.height;
+    for (int i = 0; i < count; i++)
+        m_component[i] = NoComponent;
+    
+    // flood fill with the same moves as search, components past the last label stay unknown
+    std::vector<Coord> stack;
+    U16 label = 0;
+    for (int y = 1; y < m_size.height - 1 && label < NoComponent; y++)
+        for (int x = 1; x < m_size.width - 1 && label < NoComponent; x++) {
+            Coord c(x, y);
+            if (!m_map[index(c)] || m_component[index(c)] != NoComponent)
+                continue;
+            
+            m_component[index(c)] = label;
+            stack.push_back(c);
+            while (stack.size()) {
+                Coord p = stack.back();
+                stack.pop_back();
+                for (int dy = -1; dy <= 1; dy++)
+                    for (int dx = -1; dx <= 1; dx++) {
+                        Coord n(p.x + dx, p.y + dy);
+                        if ((dx || dy) && canMove(p, dx, dy) && m_component[index(n)] != label) {
+                            m_component[index(n)] = label;
+                            stack.push_back(n);
+                        }
+                    }
+            }
+            label++;
+        }
+}
+
+bool SubgoalGraph::find(Coord start, Coord end, Array<vec2>& path) {
+    if (start == end) {
+        path.push(map()->getPos(start.point()));
+        return true;
+    }
+    
+    if (!sameArea(start, end)) {
+        path.push(map()->getPos(start.point()));
+        return false;
+    }
+    
+    Coord bend;
+    if (directBend(start, end, bend)) {
+        path.push(map()->getPos(end.point()));
+        if (bend != start && bend != end)
+            path.push(map()->getPos(bend.point()));
+        path.push(map()->getPos(start.point()));
+        return true;
+    }
+    
+    m_search++;
+    m_queue.clear();
+    U32 startId = m_count;
+    U32 endId = m_count + 1;
+    
+    // edges are symmetric, so subgoals reached from end reach end
+    forReachable(end, [&](U32 id, U32 cost) {
+        m_goal[id] = m_search;
+        m_goalCost[id] = cost;
+    });
+    
+    m_open[startId] = m_search;
+    m_cost[startId] = 0;
+    m_cameFrom[startId] = startId;
+    m_queue.insert(startId, 0);
+    
+    bool found = false;
+    while (m_queue.count()) {
+        U32 cur = m_queue.pop();
+        if (m_closed[cur] == m_search)
+            continue;
+        m_closed[cur] = m_search;
+        if (cur == endId) {
+            found = true;
+            break;
+        }
+        
+        if (cur == startId)
+            forReachable(start, [&](U32 id, U32 cost) {
+                relax(cur, id, cost, start, end);
+            });
+        else {
+            for (U32 e = m_edgeStart[cur]; e < m_edgeStart[cur + 1]; e++)
+                relax(cur, m_edges[e].to, m_edges[e].cost, start, end);
+            if (m_goal[cur] == m_search)
+                relax(cur, endId, m_goalCost[cur], start, end);
+        }
+    }
+    
+    if (!found) {
+        path.push(map()->getPos(start.point()));
+        return false;
+    }
+    
+    // Create Path, every edge gets its bend back
+    U32 cur = endId;
+    path.push(map()->getPos(end.point()));
+    while (cur != startId) {
+        U32 prev = m_cameFrom[cur];
+        Coord a = nodeCoord(prev, start, end);
+        Coord b = nodeCoord(cur, start, end);
+        if (directBend(a, b, bend) && bend != a && bend != b)
+            path.push(map()->getPos(bend.point()));
+        path.push(map()->getPos(a.point()));
+        cur = prev;
+    }
+    return true;
+}
+
+void SubgoalGraph::relax(U32 from, U32 to, U32 cost, Coord start, Coord end) {
+    if (m_closed[to] == m_search)
+        return;
+    
+    cost += m_cost[from];
+    if (m_open[to] == m_search && m_cost[to] <= cost)
+        return;
+    if (m_queue.count() == m_queueSize)
+        return;
+    
+    m_open[to] = m_search;
+    m_cost[to] = cost;
+    m_cameFrom[to] = from;
+    m_queue.insert(to, cost + pathFinder().heuristic(nodeCoord(to, start, end), end));
+}
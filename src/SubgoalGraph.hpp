@@ -0,0 +1,84 @@
+
+#pragma once
+
+#include "Coord.hpp"
+
+#include <vector>
+
+// Simple subgoal graph. Subgoals are placed at convex corners of walls and connected
+// when one is reachable from another by diagonal then straight moves without passing other subgoals.
+// Start and end are connected to the graph per query. Built once, for static maps.
+class SubgoalGraph {
+public:
+    struct Edge {
+        nook::U32 to;
+        nook::U32 cost;
+    };
+    
+    SubgoalGraph();
+    
+    // Returns false at once if end is in other area than start, path contains only start then
+    bool find(Coord start, Coord end, nook::Array<nook::vec2>& path);
+    
+    nook::U32 subgoalCount() const { return m_count; }
+    Coord subgoal(nook::U32 id) const { return m_subgoals[id]; }
+    // edges of subgoal id are [edges(id), edges(id + 1)), both directions are stored
+    const Edge* edges(nook::U32 id) const { return m_edges + m_edgeStart[id]; }
+    // Appends subgoals directly reachable from c, c itself with cost 0 if it is a subgoal.
+    // Capacity of subgoalCount() + 1 always fits.
+    void reachable(Coord c, nook::Array<Edge>& out) const;
+    // False if b isn't reachable from a by diagonal and straight moves, bend is the joint between
+    bool directBend(Coord a, Coord b, Coord& bend) const {
+        return walkDirect(a, b, true, bend) || walkDirect(a, b, false, bend);
+    }
+    // Cheap rejection, may be true for different areas on maps with too many of them
+    bool sameArea(Coord a, Coord b) const {
+        nook::U16 ca = m_component[index(a)];
+        nook::U16 cb = m_component[index(b)];
+        return m_map[index(b)] && (ca == NoComponent || cb == NoComponent || ca == cb);
+    }
+    
+private:
+    static constexpr nook::U32 None = 0xffffffff;
+    static constexpr nook::U16 NoComponent = 0xffff;
+    
+    int index(Coord c) const { return c.y * m_size.width + c.x; }
+    // one step, diagonal doesn't cut walls
+    bool canMove(Coord c, int dx, int dy) const {
+        int i = index(c);
+        return m_map[i + dy * m_size.width + dx] && (!dx || !dy || (m_map[i + dx] && m_map[i + dy * m_size.width]));
+    }
+    bool isSubgoal(Coord c) const;
+    // f(id, cost) for subgoals directly reachable from c
+    template<typename F>
+    void forReachable(Coord c, F f) const;
+    // diagonal then straight or straight then diagonal, bend is the point between
+    bool walkDirect(Coord a, Coord b, bool diagonalFirst, Coord& bend) const;
+    void labelComponents();
+    
+    Coord nodeCoord(nook::U32 id, Coord start, Coord end) const {
+        return id < m_count ? m_subgoals[id] : id == m_count ? start : end;
+    }
+    void relax(nook::U32 from, nook::U32 to, nook::U32 cost, Coord start, Coord end);
+    
+    nook::Size m_size;
+    bool* m_map;
+    nook::U32* m_cell; // subgoal id or None
+    nook::U16* m_component;
+    
+    nook::U32 m_count;
+    Coord* m_subgoals;
+    nook::U32* m_edgeStart; // edges of subgoal i are [m_edgeStart[i], m_edgeStart[i + 1])
+    Edge* m_edges;
+    
+    // per query state indexed by subgoal id, start is m_count and end m_count + 1
+    nook::PriorityQueue<nook::U32, nook::U32> m_queue;
+    nook::U32 m_queueSize;
+    nook::U32* m_cost;
+    nook::U32* m_cameFrom;
+    nook::U32* m_open;   // cost is valid when equals m_search
+    nook::U32* m_closed; // expanded when equals m_search
+    nook::U32* m_goal;   // reaches end directly when equals m_search
+    nook::U32* m_goalCost;
+    nook::U32 m_search;
+};
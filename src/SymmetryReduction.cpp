@@ -0,0 +1,108 @@
+
+#include "SymmetryReduction.hpp"
+#include "Map.hpp"
+#include "Rectangles.hpp"
+
+using namespace nook;
+
+SymmetryReduction::SymmetryReduction(const bool* walkable) {
+    m_size = map()->size();
+    m_walkable = walkable;
+    
+    int count = m_size.width * m_size.height;
+    m_map = memoryManager().allocOnStack<bool>(count);
+    m_rect = memoryManager().allocOnStack<U32>(count);
+    std::memset(m_rect, 0xff, count * sizeof(U32));
+    // one rectangle per cell at most
+    int pages = (count + RectPageSize - 1) / RectPageSize;
+    m_pages.init(pages, memoryManager().allocOnStack<RectPage*>(pages));
+    m_freeRect = None;
+    m_rectCount = 0;
+    
+    for (int y = 0; y < m_size.height; y++)
+        for (int x = 0; x < m_size.width; x++)
+            m_map[y * m_size.width + x] = map()->getCell(x, y)->walkable;
+    decompose(1, 1, m_size.width - 2, m_size.height - 2);
+}
+
+void SymmetryReduction::decompose(int x0, int y0, int x1, int y1) {
+    auto free = [&](int x, int y) {
+        int i = y * m_size.width + x;
+        return m_map[i] && m_rect[i] == None;
+    };
+    decomposeRectangles(x0, y0, x1, y1, free, [&](int rx0, int ry0, int rx1, int ry1) {
+        U32 id = allocRect();
+        Rectangle& r = rect(id);
+        r = { rx0, ry0, rx1, ry1, 0 };
+        for (int j = ry0; j <= ry1; j++)
+            for (int i = rx0; i <= rx1; i++) {
+                m_rect[j * m_size.width + i] = id;
+                r.occupied += !m_walkable[j * m_size.width + i];
+            }
+    });
+}
+
+U32 SymmetryReduction::allocRect() {
+    U32 id = m_freeRect;
+    if (id != None)
+        m_freeRect = rect(id).x0;
+    else {
+        // no free ids, so all below the count are in use
+        id = m_rectCount;
+        if (id == m_pages.count() * RectPageSize)
+            m_pages.push(m_pool.alloc());
+    }
+    m_rectCount++;
+    return id;
+}
+
+void SymmetryReduction::freeRect(U32 id) {
+    m_rectCount--;
+    rect(id).x0 = m_freeRect;
+    m_freeRect = id;
+}
+
+void SymmetryReduction::setOccupied(int x, int y, bool occupied) {
+    U32 id = m_rect[y * m_size.width + x];
+    if (id == None)
+        return;
+    Rectangle& r = rect(id);
+    r.occupied += occupied ? 1 : -1;
+    ASSERT(r.occupied >= 0);
+}
+
+void SymmetryReduction::update(Rect dirty) {
+    int x0 = max2(dirty.x, 1);
+    int y0 = max2(dirty.y, 1);
+    int x1 = min2(dirty.x + dirty.width, m_size.width - 2);
+    int y1 = min2(dirty.y + dirty.height, m_size.height - 2);
+    if (x0 > x1 || y0 > y1)
+        return;
+    
+    // Rectangles over changed cells are dropped, free cells are split again
+    // only inside the box they and dirty area cover
+    int bx0 = x0;
+    int by0 = y0;
+    int bx1 = x1;
+    int by1 = y1;
+    for (int y = y0; y <= y1; y++)
+        for (int x = x0; x <= x1; x++) {
+            int i = y * m_size.width + x;
+            m_map[i] = map()->getCell(x, y)->walkable;
+            U32 id = m_rect[i];
+            if (id == None)
+                continue;
+            
+            // its other cells in dirty are None from now on
+            const Rectangle& r = rect(id);
+            bx0 = min2(bx0, r.x0);
+            by0 = min2(by0, r.y0);
+            bx1 = max2(bx1, r.x1);
+            by1 = max2(by1, r.y1);
+            for (int ry = r.y0; ry <= r.y1; ry++)
+                for (int rx = r.x0; rx <= r.x1; rx++)
+                    m_rect[ry * m_size.width + rx] = None;
+            freeRect(id);
+        }
+    decompose(bx0, by0, bx1, by1);
+}
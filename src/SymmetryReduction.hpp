@@ -0,0 +1,121 @@
+
+#pragma once
+
+#include "Coord.hpp"
+
+// Rectangular symmetry reduction for 4-connected search. Walkable cells are split into
+// empty rectangles, interior cells are pruned and opposite sides are joined by macro edges,
+// so paths through open areas are found without expanding the cells inside.
+// Engines walk the reduced graph with forSuccessors() instead of the grid neighbours.
+// Rectangles are built over map walls only, a rectangle with cells cleared in the engine's
+// walkability (occupancy) loses its macro edges and is searched cell by cell until it is free.
+class SymmetryReduction {
+public:
+    // walkable is the array of the engine that walks the graph, kept in sync by Occupancy
+    SymmetryReduction(const bool* walkable);
+    
+    // Called by Occupancy when cell becomes occupied or free
+    void setOccupied(int x, int y, bool occupied);
+    
+    // Rebuilds rectangles touching dirty after walkability of cells inside it was changed in the map
+    // and in the engine's array
+    void update(nook::Rect dirty);
+    
+    // f(next, cost) for c on a rectangle side or for start anywhere. End is connected
+    // from sides of its rectangle, so it may be inside one.
+    template<typename F>
+    void forSuccessors(Coord c, Coord end, F f) const;
+    
+    bool pruned(Coord c) const {
+        nook::U32 id = m_rect[index(c)];
+        return id != None && !rect(id).occupied && inside(rect(id), c);
+    }
+    nook::U32 rectangleCount() const { return m_rectCount; }
+    
+private:
+    static constexpr nook::U32 None = 0xffffffff;
+    static constexpr int RectPageSize = 256;
+    
+    // inclusive
+    struct Rectangle {
+        int x0; // next free id while the rectangle is free
+        int y0;
+        int x1;
+        int y1;
+        int occupied; // cells blocked in walkable
+    };
+    
+    struct RectPage {
+        Rectangle items[RectPageSize];
+    };
+    
+    int index(Coord c) const { return c.y * m_size.width + c.x; }
+    Rectangle& rect(nook::U32 id) { return m_pages[id / RectPageSize]->items[id % RectPageSize]; }
+    const Rectangle& rect(nook::U32 id) const { return m_pages[id / RectPageSize]->items[id % RectPageSize]; }
+    nook::U32 allocRect();
+    void freeRect(nook::U32 id);
+    static bool inside(const Rectangle& r, Coord c) {
+        return c.x > r.x0 && c.x < r.x1 && c.y > r.y0 && c.y < r.y1;
+    }
+    // rectangles over free cells of the box, see decomposeRectangles
+    void decompose(int x0, int y0, int x1, int y1);
+    
+    nook::Size m_size;
+    bool* m_map; // map walls only
+    const bool* m_walkable;
+    nook::U32* m_rect; // rectangle id or None for walls
+    // ids index pages, freed ids are chained through Rectangle::x0
+    nook::PagePool<RectPage> m_pool;
+    nook::Array<RectPage*> m_pages;
+    nook::U32 m_freeRect;
+    nook::U32 m_rectCount;
+};
+
+template<typename F>
+void SymmetryReduction::forSuccessors(Coord c, Coord end, F f) const {
+    if (m_rect[index(c)] == None)
+        return;
+    const Rectangle& r = rect(m_rect[index(c)]);
+    const int dirs[4][2] = { { -1, 0 }, { 0, -1 }, { 1, 0 }, { 0, 1 } };
+    if (r.occupied) {
+        // plain grid moves, macro edges could pass occupied cells
+        for (int k = 0; k < 4; k++) {
+            Coord n(c.x + dirs[k][0], c.y + dirs[k][1]);
+            if (m_walkable[index(n)])
+                f(n, 1);
+        }
+        return;
+    }
+    
+    // rectangle is empty, so any monotone path inside it is the shortest
+    if (m_rect[index(end)] == m_rect[index(c)])
+        f(end, std::abs((int)end.x - (int)c.x) + std::abs((int)end.y - (int)c.y));
+    
+    if (inside(r, c)) {
+        f(Coord(r.x0, c.y), c.x - r.x0);
+        f(Coord(r.x1, c.y), r.x1 - c.x);
+        f(Coord(c.x, r.y0), c.y - r.y0);
+        f(Coord(c.x, r.y1), r.y1 - c.y);
+        return;
+    }
+    
+    for (int k = 0; k < 4; k++) {
+        Coord n(c.x + dirs[k][0], c.y + dirs[k][1]);
+        if (m_walkable[index(n)] && !inside(r, n))
+            f(n, 1);
+    }
+    
+    // macro edges across, only when there is something inside
+    if (r.x1 - r.x0 > 1) {
+        if (c.x == r.x0)
+            f(Coord(r.x1, c.y), r.x1 - r.x0);
+        else if (c.x == r.x1)
+            f(Coord(r.x0, c.y), r.x1 - r.x0);
+    }
+    if (r.y1 - r.y0 > 1) {
+        if (c.y == r.y0)
+            f(Coord(c.x, r.y1), r.y1 - r.y0);
+        else if (c.y == r.y1)
+            f(Coord(c.x, r.y0), r.y1 - r.y0);
+    }
+}
@@ -1,12 +1,17 @@
 
 #include "WallTracing.hpp"
 #include "Map.hpp"
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <climits>
 
 using namespace nook;
 
 namespace {
     const float kr2 = 1.08f;
-    const int kMaxIter = 20;
 
     inline U32 getCell(int x, int y) {
         U32 cell = 0;
@@ -20,12 +25,182 @@ namespace {
     inline float heuristics(vec2 p1, vec2 p2) {
         return (p1 - p2).length();
     }
+
+    // slab test of segment against axis aligned box, touching counts
+    inline bool segmentBox(vec2 from, vec2 to, vec2 min, vec2 max) {
+        float t0 = 0.0f;
+        float t1 = 1.0f;
+        vec2 d = to - from;
+        for (int i = 0; i < 2; i++) {
+            float f = i ? from.y : from.x;
+            float dd = i ? d.y : d.x;
+            float lo = i ? min.y : min.x;
+            float hi = i ? max.y : max.x;
+            if (dd == 0.0f) {
+                if (f < lo || f > hi)
+                    return false;
+                continue;
+            }
+            float a = (lo - f) / dd;
+            float b = (hi - f) / dd;
+            if (a > b)
+                std::swap(a, b);
+            t0 = max2(t0, a);
+            t1 = min2(t1, b);
+            if (t0 > t1)
+                return false;
+        }
+        return true;
+    }
+
+    // Andrew's monotone chain over hull scratch of count + 1 points,
+    // result is counter-clockwise without collinear points, returns its count
+    int convexHull(vec2* points, int count, vec2* hull) {
+        std::sort(points, points + count, [](vec2 a, vec2 b) {
+            return a.x < b.x || (a.x == b.x && a.y < b.y);
+        });
+        if (count < 3)
+            return count;
+        
+        int k = 0;
+        for (int i = 0; i < count; i++) {
+            while (k >= 2 && (hull[k - 1] - hull[k - 2]).cross(points[i] - hull[k - 2]) <= 0.0f)
+                k--;
+            hull[k++] = points[i];
+        }
+        for (int i = count - 2, t = k + 1; i >= 0; i--) {
+            while (k >= t && (hull[k - 1] - hull[k - 2]).cross(points[i] - hull[k - 2]) <= 0.0f)
+                k--;
+            hull[k++] = points[i];
+        }
+        std::memcpy(points, hull, (k - 1) * sizeof(vec2));
+        return k - 1;
+    }
+
+    inline bool insideHull(const vec2* hull, int count, vec2 p) {
+        for (int i = 0, j = count - 1; i < count; j = i++)
+            if ((hull[i] - hull[j]).cross(p - hull[j]) <= 0.0f)
+                return false;
+        return true;
+    }
+
+    template<typename T>
+    void allocArray(Array<T>& a, U32 capacity) {
+        a.init(capacity, memoryManager().allocOnStack<T>(capacity));
+    }
+
+    // full size, zeroed
+    template<typename T>
+    void allocTable(Array<T>& a, U32 count) {
+        allocArray(a, count);
+        a.setCount(count);
+        std::memset(a.buf(), 0, count * sizeof(T));
+    }
 }
 
-WallTracing::WallTracing() {
+WallTracing::Query::Query(const WallTracing& owner) {
     m_curCheck = 1;
     m_curRequest = 1;
+    m_curChanged = 0;
+    m_obstacles = nullptr;
+    m_radiusClass = nullptr;
+    m_useClusters = false;
+    m_corridor = nullptr;
+    m_corridorCount = 0;
+    m_queueFull = false;
+    std::memset(m_stats, 0, sizeof(m_stats));
     
+    allocArray(m_points, MaxPathPoints);
+    m_queueCount = 0;
+    allocArray(m_queuePages, MaxQueuePages);
+    m_queuePages.push(m_queuePool.alloc());
+    allocTable(m_cornerChecked, owner.m_cornerCapacity);
+    allocTable(m_cornerRequest, owner.m_cornerCapacity);
+    allocTable(m_cornerGoal, owner.m_cornerCapacity);
+    allocTable(m_obstacleChecked, owner.m_obstacleCapacity);
+    allocTable(m_obstacleRequest, owner.m_obstacleCapacity);
+    allocTable(m_chainRequest, owner.m_cornerCapacity);
+    allocTable(m_changedHead, owner.m_levelCells);
+    allocTable(m_changedStamp, owner.m_levelCells);
+    allocTable(m_changedNext, owner.m_obstacleCapacity * 2);
+}
+
+void WallTracing::Query::clear() {
+    m_queueCount = 0;
+    m_queueFull = false;
+    m_points.setCount(0);
+    m_nextPool.clear();
+}
+
+void WallTracing::Query::queueInsert(Next* n, float priority) {
+    if (m_queueCount == m_queuePages.count() * QueuePageSize) {
+        if (m_queuePages.count() == MaxQueuePages) {
+            m_queueFull = true;
+            return;
+        }
+        m_queuePages.push(m_queuePool.alloc());
+    }
+    
+    U32 i = m_queueCount++;
+    while (i) {
+        U32 parent = (i - 1) / 2;
+        QueueItem& p = queueItem(parent);
+        if (p.priority <= priority)
+            break;
+        queueItem(i) = p;
+        i = parent;
+    }
+    queueItem(i) = { n, priority };
+}
+
+WallTracing::Next* WallTracing::Query::queuePop() {
+    Next* top = queueItem(0).next;
+    QueueItem last = queueItem(--m_queueCount);
+    U32 i = 0;
+    while (true) {
+        U32 c = i * 2 + 1;
+        if (c >= m_queueCount)
+            break;
+        if (c + 1 < m_queueCount && queueItem(c + 1).priority < queueItem(c).priority)
+            c++;
+        if (last.priority <= queueItem(c).priority)
+            break;
+        queueItem(i) = queueItem(c);
+        i = c;
+    }
+    if (m_queueCount)
+        queueItem(i) = last;
+    return top;
+}
+
+void WallTracing::Query::copyPath(Array<vec2>& path) const {
+    int n = m_points.count();
+    if (!n)
+        return;
+    // the last point is pushed, so capacity of path is checked
+    int first = path.count();
+    path.setCount(first + n - 1);
+    path.push(m_points[n - 1]);
+    std::memcpy(path.buf() + first, m_points.buf(), (n - 1) * sizeof(vec2));
+}
+
+void WallTracing::Query::copyPath(vec2* path, int& count) const {
+    // the end of a longer path is dropped, points are stored from end to start
+    int n = min2((int)m_points.count(), count);
+    std::memcpy(path, m_points.buf() + m_points.count() - n, n * sizeof(vec2));
+    count = n;
+}
+
+WallTracing::WallTracing(int threadCount, int maxObstacles) {
+    threadCount = resolveThreadCount(threadCount);
+    m_threadCount = threadCount;
+    
+    m_cornerCount = 0;
+    m_curMark = 0;
+    m_occupancy = nullptr;
+    
+    m_dummyObstacle.id = 0;
+    m_dummyObstacle.cluster = 0;
     m_dummyObstacle.radius = 0.2f;
     
     m_size = map()->size();
@@ -37,237 +212,851 @@ WallTracing::WallTracing() {
     for (int i = 0; i < rc; i++)
         new (m_regions + i) Region();
     
-    const U32 maxQueue = 20;
-    m_queue.init(maxQueue, memoryManager().allocOnStack<PriorityQueue<WallTracing::Next*, float>::Item>(maxQueue));
+    // Each obstacle grid level doubles cell size, the last one covers the whole map
+    m_levelCount = 1;
+    while ((RegionSize << (m_levelCount - 1)) < max2(m_size.width, m_size.height))
+        m_levelCount++;
+    m_obstacleLevels = memoryManager().allocOnStack<ObstacleLevel>(m_levelCount);
+    m_levelCells = 0;
+    for (int li = 0; li < m_levelCount; li++) {
+        ObstacleLevel& l = m_obstacleLevels[li];
+        l.cellSize = RegionSize << li;
+        l.count.x = ceilDiv(m_size.width, l.cellSize);
+        l.count.y = ceilDiv(m_size.height, l.cellSize);
+        int cc = l.count.x * l.count.y;
+        l.firstCell = m_levelCells;
+        m_levelCells += cc;
+    }
+    
+    m_cornerCapacity = 2 * (m_size.width - 1) * (m_size.height - 1);
+    allocArray(m_freeCornerIds, m_cornerCapacity);
+    allocTable(m_cornersById, m_cornerCapacity);
+    allocTable(m_cornerMark, m_cornerCapacity);
+    allocArray(m_chains, m_cornerCapacity);
+    allocArray(m_freeChainIds, m_cornerCapacity);
+    allocTable(m_chainMark, m_cornerCapacity);
+    allocTable(m_chainState, m_cornerCapacity);
+    allocArray(m_pendingChains, m_cornerCapacity);
+    allocArray(m_radiusClasses, MaxRadiusClasses);
+    allocArray(m_visibility, MaxVisibilityGraphs);
+    allocArray(m_buildQueries, threadCount);
     
-    List1<Corner*> corners;
-    nook::Size hs = map()->size() / 2;
+    m_obstacleCapacity = maxObstacles + 1;
+    initObstacleSet(m_obstacleSets[0]);
+    initObstacleSet(m_obstacleSets[1]);
+    m_front = 0;
+    allocTable(m_clusterParent, m_obstacleCapacity);
+    allocTable(m_clusterOf, m_obstacleCapacity);
+    allocTable(m_hullScratch, m_obstacleCapacity * 8 + 1);
     
-    auto pushCorner = [&](Coord c, vec2 n, bool o) {
-        Corner* corner = m_cornerPool.alloc();
-        corner->coord = c;
-        corner->outer = o;
-        corner->pos = vec2((int)c.x - hs.width, (int)c.y - hs.height);
-        corner->normal = n;
-        corner->right = corner->left = nullptr;
-        corner->checked = m_curCheck;
-        corner->request = m_curRequest;
-        
-        Coord rc = getRegion(corner);
-        m_regions[rc.y * m_regionCount.x + rc.x].corners.push(corner);
-        corners.push(corner);
-    };
+    // Classify 2x2 cells by rows on all threads. Corners are then created in row order,
+    // so corner ids and region lists don't depend on the thread count.
+    // Corner marks aren't used until chains are built, so their table holds the cells.
+    ASSERT(m_cornerCapacity * sizeof(U32) >= (size_t)m_size.width * m_size.height);
+    U8* cells = (U8*)m_cornerMark.buf();
+    parallelFor(m_size.height - 1, threadCount, [&](int, int begin, int end) {
+        for (int y = begin + 1; y <= end; y++)
+            for (int x = 1; x < m_size.width; x++)
+                cells[y * m_size.width + x] = getCell(x, y);
+    });
     
+    Corner* created[2];
     for (int y = 1; y < m_size.height; y++)
-        for (int x = 1; x < m_size.width; x++) {
-            U32 cell = getCell(x, y);
-            switch (cell) {
-                case 1:  // ▜
-                    pushCorner(Coord(x, y), vec2(-1.0f, -1.0f), false);
-                    break;
-                case 2:  // ▛
-                    pushCorner(Coord(x, y), vec2(1.0f, -1.0f), false);
-                    break;
-                case 4:  // ▙
-                    pushCorner(Coord(x, y), vec2(1.0f, 1.0f), false);
-                    break;
-                case 8:  // ▟
-                    pushCorner(Coord(x, y), vec2(-1.0f, 1.0f), false);
-                    break;
-                case 5:  // ▚
-                    pushCorner(Coord(x, y), vec2(-1.0f, -1.0f), false);
-                    pushCorner(Coord(x, y), vec2(1.0f, 1.0f), false);
-                    break;
-                case 10: // ▞
-                    pushCorner(Coord(x, y), vec2(1.0f, -1.0f), false);
-                    pushCorner(Coord(x, y), vec2(-1.0f, 1.0f), false);
-                    break;
-                case 7:  // ┛
-                    pushCorner(Coord(x, y), vec2(1.0f, -1.0f), true);
-                    break;
-                case 11: // ┗
-                    pushCorner(Coord(x, y), vec2(-1.0f, -1.0f), true);
-                    break;
-                case 13: // ┏
-                    pushCorner(Coord(x, y), vec2(-1.0f, 1.0f), true);
-                    break;
-                case 14: // ┓
-                    pushCorner(Coord(x, y), vec2(1.0f, 1.0f), true);
-                    break;
-                default:
+        for (int x = 1; x < m_size.width; x++)
+            extractCorners(Coord(x, y), cells[y * m_size.width + x], created);
+    std::memset(m_cornerMark.buf(), 0, m_cornerCapacity * sizeof(U32));
+    
+    // Ids follow (y, x), so right links are resolved with binary search over m_cornersById.
+    // Each corner has exactly one left, so threads never write the same corner.
+    Corner** sorted = m_cornersById.buf();
+    Corner** sortedEnd = sorted + m_cornerCount;
+    parallelFor(m_cornerCount, threadCount, [&](int, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            Corner* corner = sorted[i];
+            Corner pc = traceWall(corner);
+            Corner** it = std::lower_bound(sorted, sortedEnd, pc.coord, [](Corner* c, Coord p) {
+                return c->coord.y < p.y || (c->coord.y == p.y && c->coord.x < p.x);
+            });
+            for (; it != sortedEnd && (*it)->coord == pc.coord; ++it)
+                if (**it == pc) {
+                    corner->right = *it;
+                    (*it)->left = corner;
                     break;
-            }
+                }
         }
+    });
     
-    for (Corner* corner : corners) {
-        int dx = 0;
-        int dy = 0;
-        int dir = 0;
-        U32 wall = 0;
-        
-        if (corner->outer) {
-            if (corner->normal.x == 1.0f) {
-                if (corner->normal.y == 1.0f) {
-                    dx = -1;
-                    wall = 12;
-                    dir = 2;
-                }
-                else {
-                    dy = 1;
-                    wall = 6;
-                    dir = 8;
+    for (U32 i = 0; i < m_cornerCount; i++)
+        pushSegment(sorted[i], getRegion(sorted[i]->right));
+    
+    m_curMark++;
+    for (U32 i = 0; i < m_cornerCount; i++)
+        m_cornerMark[i] = m_curMark;
+    for (U32 i = 0; i < m_cornerCount; i++)
+        chainRun(sorted[i]);
+    registerChains();
+    
+    m_query = memoryManager().createOnStack<Query>(*this);
+}
+
+WallTracing::~WallTracing() {
+    m_query->~Query();
+    for (int i = 0; i < m_buildQueries.count(); i++)
+        m_buildQueries[i]->~Query();
+    for (int i = 0; i < m_radiusClasses.count(); i++)
+        m_radiusClasses[i]->~RadiusClass();
+    for (int i = 0; i < m_visibility.count(); i++)
+        m_visibility[i]->~VisibilityGraph();
+    
+    int rc = m_regionCount.x * m_regionCount.y;
+    for (int i = 0; i < rc; i++)
+        m_regions[i].~Region();
+    for (ObstacleSet& s : m_obstacleSets)
+        for (int i = 0; i < m_levelCells; i++)
+            s.cells[i].~List1();
+}
+
+void WallTracing::update(Rect dirty) {
+    // corner at (x, y) is built from cells (x - 1, y - 1) - (x, y)
+    int x0 = max2(dirty.x, 1);
+    int y0 = max2(dirty.y, 1);
+    int x1 = min2(dirty.x + dirty.width, m_size.width - 1);
+    int y1 = min2(dirty.y + dirty.height, m_size.height - 1);
+    if (x0 > x1 || y0 > y1)
+        return;
+    
+    auto inside = [&](Coord c) {
+        return c.x >= x0 && c.x <= x1 && c.y >= y0 && c.y <= y1;
+    };
+    
+    // Regions also hold corners whose wall segment passes through them,
+    // so this catches segments that only cross the dirty area too
+    List<Corner*> removed;
+    List<Corner*> relink;
+    m_curMark++;
+    int rx0 = max2((x0 - 1) / RegionSize, 0);
+    int ry0 = max2((y0 - 1) / RegionSize, 0);
+    int rx1 = min2(x1 / RegionSize, m_regionCount.x - 1);
+    int ry1 = min2(y1 / RegionSize, m_regionCount.y - 1);
+    for (int y = ry0; y <= ry1; y++)
+        for (int x = rx0; x <= rx1; x++)
+            for (Corner* c : m_regions[y * m_regionCount.x + x].corners) {
+                if (m_cornerMark[c->id] == m_curMark)
+                    continue;
+                m_cornerMark[c->id] = m_curMark;
+                
+                if (inside(c->coord)) {
+                    removed.push(c);
+                    continue;
                 }
+                Coord rc = c->right->coord;
+                if (min2(c->coord.x, rc.x) <= x1 && max2(c->coord.x, rc.x) >= x0 &&
+                    min2(c->coord.y, rc.y) <= y1 && max2(c->coord.y, rc.y) >= y0)
+                    relink.push(c);
+            }
+    
+    // Chains of edited corners are released while links are intact,
+    // their other members are chained again together with the edited corners
+    U32 removedMark = ++m_curMark;
+    for (Corner* c : removed)
+        m_cornerMark[c->id] = removedMark;
+    List<Corner*> rechain;
+    m_curMark++;
+    for (Corner* c : relink)
+        releaseChain(c, removedMark, rechain);
+    for (Corner* c : removed)
+        releaseChain(c, removedMark, rechain);
+    
+    for (Corner* c : relink)
+        unlinkCorner(c);
+    for (Corner* c : removed)
+        unlinkCorner(c);
+    for (Corner* c : removed) {
+        Coord rc = getRegion(c);
+        m_regions[rc.y * m_regionCount.x + rc.x].corners.remove(c);
+        m_cornersById[c->id] = nullptr;
+        for (int i = 0; i < m_visibility.count(); i++)
+            clearEdges(*m_visibility[i], c->id);
+        m_freeCornerIds.push(c->id);
+        m_cornerPool.free(c);
+    }
+    
+    List<Corner*> corners;
+    for (Corner* c : relink)
+        corners.push(c);
+    List<Corner*> added;
+    Corner* created[2];
+    for (int y = y0; y <= y1; y++)
+        for (int x = x0; x <= x1; x++) {
+            int n = extractCorners(Coord(x, y), getCell(x, y), created);
+            for (int i = 0; i < n; i++) {
+                m_cornerMark[created[i]->id] = m_curMark;
+                corners.push(created[i]);
+                rechain.push(created[i]);
+                added.push(created[i]);
+            }
+        }
+    
+    for (Corner* corner : corners)
+        linkCorner(corner);
+    
+    // Segments of radius classes are rebuilt with chains, every corner whose right changed
+    // is in a released chain
+    for (int i = 0; i < m_radiusClasses.count(); i++) {
+        RadiusClass& rc = *m_radiusClasses[i];
+        rc.points.setCount(m_cornerCount);
+        for (Corner* c : corners)
+            rc.points[c->id] = c->pos + c->normal * rc.radius;
+    }
+    buildChains(rechain);
+    
+    // Walls changed only inside of dirty area, so an edge can change only when its segment crosses
+    // the area inflated by radius. Edge is not longer than range between corners inflated by radius,
+    // so its corner is within range + 2 * radius. New corners get all their edges.
+    nook::Size hs = m_size / 2;
+    vec2 dmin((float)x0 - hs.width, (float)y0 - hs.height);
+    vec2 dmax((float)x1 - hs.width, (float)y1 - hs.height);
+    m_curMark++;
+    for (Corner* c : added)
+        m_cornerMark[c->id] = m_curMark;
+    for (int i = 0; i < m_visibility.count(); i++) {
+        VisibilityGraph& g = *m_visibility[i];
+        vec2 inf(g.radius + 0.001f, g.radius + 0.001f);
+        float margin = g.range + 2.0f * g.radius;
+        forOuterCorners(dmin - margin, dmax + margin, [&](Corner* c) {
+            if (m_cornerMark[c->id] == m_curMark)
+                buildEdges(g, c);
+            else
+                refreshEdges(g, c, dmin - inf, dmax + inf);
+        });
+    }
+}
+
+WallTracing::Corner* WallTracing::createCorner(Coord c, vec2 n, bool o) {
+    nook::Size hs = m_size / 2;
+    
+    Corner* corner = m_cornerPool.alloc();
+    if (m_freeCornerIds.count()) {
+        corner->id = m_freeCornerIds[m_freeCornerIds.count() - 1];
+        m_freeCornerIds.setCount(m_freeCornerIds.count() - 1);
+    }
+    else
+        corner->id = m_cornerCount++;
+    ASSERT(corner->id < m_cornerCapacity);
+    m_cornersById[corner->id] = corner;
+    corner->coord = c;
+    corner->outer = o;
+    corner->pos = vec2((int)c.x - hs.width, (int)c.y - hs.height);
+    corner->normal = n;
+    corner->right = corner->left = nullptr;
+    corner->chain = NoChain;
+    
+    Coord rc = getRegion(corner);
+    m_regions[rc.y * m_regionCount.x + rc.x].corners.push(corner);
+    return corner;
+}
+
+int WallTracing::extractCorners(Coord c, U32 cell, Corner** corners) {
+    int n = 0;
+    switch (cell) {
+        case 1:  // ▜
+            corners[n++] = createCorner(c, vec2(-1.0f, -1.0f), false);
+            break;
+        case 2:  // ▛
+            corners[n++] = createCorner(c, vec2(1.0f, -1.0f), false);
+            break;
+        case 4:  // ▙
+            corners[n++] = createCorner(c, vec2(1.0f, 1.0f), false);
+            break;
+        case 8:  // ▟
+            corners[n++] = createCorner(c, vec2(-1.0f, 1.0f), false);
+            break;
+        case 5:  // ▚
+            corners[n++] = createCorner(c, vec2(-1.0f, -1.0f), false);
+            corners[n++] = createCorner(c, vec2(1.0f, 1.0f), false);
+            break;
+        case 10: // ▞
+            corners[n++] = createCorner(c, vec2(1.0f, -1.0f), false);
+            corners[n++] = createCorner(c, vec2(-1.0f, 1.0f), false);
+            break;
+        case 7:  // ┛
+            corners[n++] = createCorner(c, vec2(1.0f, -1.0f), true);
+            break;
+        case 11: // ┗
+            corners[n++] = createCorner(c, vec2(-1.0f, -1.0f), true);
+            break;
+        case 13: // ┏
+            corners[n++] = createCorner(c, vec2(-1.0f, 1.0f), true);
+            break;
+        case 14: // ┓
+            corners[n++] = createCorner(c, vec2(1.0f, 1.0f), true);
+            break;
+        default:
+            break;
+    }
+    return n;
+}
+
+void WallTracing::getWall(const Corner* corner, int& dx, int& dy, U32& wall, int& dir) const {
+    dx = 0;
+    dy = 0;
+    
+    if (corner->outer) {
+        if (corner->normal.x == 1.0f) {
+            if (corner->normal.y == 1.0f) {
+                dx = -1;
+                wall = 12;
+                dir = 2;
             }
             else {
-                if (corner->normal.y == 1.0f) {
-                    dy = -1;
-                    wall = 9;
-                    dir = 4;
-                }
-                else {
-                    dx = 1;
-                    wall = 3;
-                    dir = 1;
-                }
+                dy = 1;
+                wall = 6;
+                dir = 8;
             }
         }
-        else { // inner
-            if (corner->normal.x == 1.0f) {
-                if (corner->normal.y == 1.0f) {
-                    dy = 1;
-                    wall = 6;
-                    dir = 8;
-                }
-                else {
-                    dx = 1;
-                    wall = 3;
-                    dir = 1;
-                }
+        else {
+            if (corner->normal.y == 1.0f) {
+                dy = -1;
+                wall = 9;
+                dir = 4;
             }
             else {
-                if (corner->normal.y == 1.0f) {
-                    dx = -1;
-                    wall = 12;
-                    dir = 2;
-                }
-                else {
-                    dy = -1;
-                    wall = 9;
-                    dir = 4;
-                }
+                dx = 1;
+                wall = 3;
+                dir = 1;
             }
         }
-        
-        Coord p(corner->coord.x + dx, corner->coord.y + dy);
-        U32 cell = getCell(p.x, p.y);
-        while (cell == wall) {
-            p.x += dx;
-            p.y += dy;
-            cell = getCell(p.x, p.y);
+    }
+    else { // inner
+        if (corner->normal.x == 1.0f) {
+            if (corner->normal.y == 1.0f) {
+                dy = 1;
+                wall = 6;
+                dir = 8;
+            }
+            else {
+                dx = 1;
+                wall = 3;
+                dir = 1;
+            }
         }
-        
-        Corner pc = getCorner(p, cell, dir);
-        Coord prc = getRegion(&pc);
-        Region& pr = m_regions[prc.y * m_regionCount.x + prc.x];
-        
-        for (Corner* cp : pr.corners) {
-            if (*cp == pc) {
-                corner->right = cp;
-                cp->left = corner;
-                break;
+        else {
+            if (corner->normal.y == 1.0f) {
+                dx = -1;
+                wall = 12;
+                dir = 2;
+            }
+            else {
+                dy = -1;
+                wall = 9;
+                dir = 4;
             }
         }
+    }
+}
+
+WallTracing::Corner WallTracing::traceWall(const Corner* corner) {
+    int dx, dy, dir;
+    U32 wall;
+    getWall(corner, dx, dy, wall, dir);
+    
+    Coord p(corner->coord.x + dx, corner->coord.y + dy);
+    U32 cell = getCell(p.x, p.y);
+    while (cell == wall) {
+        p.x += dx;
+        p.y += dy;
+        cell = getCell(p.x, p.y);
+    }
+    
+    return getCorner(p, cell, dir);
+}
+
+void WallTracing::linkCorner(Corner* corner) {
+    Corner pc = traceWall(corner);
+    Coord prc = getRegion(&pc);
+    Region& pr = m_regions[prc.y * m_regionCount.x + prc.x];
         
-        Coord r = getRegion(corner);
-        if (dx) {
-            for (int x = r.x; x != prc.x; x += dx)
-                m_regions[r.y * m_regionCount.x + x + dx].corners.push(corner);
-        }
-        else {
-            for (int y = r.y; y != prc.y; y += dy)
-                m_regions[(y + dy) * m_regionCount.x + r.x].corners.push(corner);
+    for (Corner* cp : pr.corners) {
+        if (*cp == pc) {
+            corner->right = cp;
+            cp->left = corner;
+            break;
         }
     }
+    
+    pushSegment(corner, prc);
 }
 
-WallTracing::~WallTracing() {
-    int rc = m_regionCount.x * m_regionCount.y;
-    for (int i = 0; i < rc; i++)
-        m_regions[i].~Region();
+void WallTracing::pushSegment(Corner* corner, Coord prc) {
+    int dx, dy, dir;
+    U32 wall;
+    getWall(corner, dx, dy, wall, dir);
+    
+    Coord r = getRegion(corner);
+    if (dx) {
+        for (int x = r.x; x != prc.x; x += dx)
+            m_regions[r.y * m_regionCount.x + x + dx].corners.push(corner);
+    }
+    else {
+        for (int y = r.y; y != prc.y; y += dy)
+            m_regions[(y + dy) * m_regionCount.x + r.x].corners.push(corner);
+    }
+}
+
+void WallTracing::unlinkCorner(Corner* corner) {
+    int dx, dy, dir;
+    U32 wall;
+    getWall(corner, dx, dy, wall, dir);
+    
+    Coord r = getRegion(corner);
+    Coord prc = getRegion(corner->right);
+    if (dx) {
+        for (int x = r.x; x != prc.x; x += dx)
+            m_regions[r.y * m_regionCount.x + x + dx].corners.remove(corner);
+    }
+    else {
+        for (int y = r.y; y != prc.y; y += dy)
+            m_regions[(y + dy) * m_regionCount.x + r.x].corners.remove(corner);
+    }
+    
+    if (corner->right->left == corner)
+        corner->right->left = nullptr;
+    corner->right = nullptr;
+}
+
+void WallTracing::initObstacleSet(ObstacleSet& s) {
+    s.cells = memoryManager().allocOnStack<List1<Obstacle*>>(m_levelCells);
+    for (int i = 0; i < m_levelCells; i++)
+        new (s.cells + i) List1<Obstacle*>();
+    s.count = 1; // 0 is m_dummyObstacle
+    allocArray(s.freeIds, m_obstacleCapacity);
+    allocTable(s.byId, m_obstacleCapacity);
+    s.clusterRadius = -1.0f;
+    allocArray(s.clusters, m_obstacleCapacity / 2 + 1);
+    s.clusters.push({ 0, 0, 0, 0 }); // 0 means no cluster
+    allocArray(s.clusterMembers, m_obstacleCapacity);
+    allocArray(s.clusterHulls, m_obstacleCapacity * 8);
+    s.applied = 0;
+    s.readers = 0;
 }
 
 void WallTracing::addObstacle(Circle o) {
-    nook::Size hs = map()->size() / 2;
-    Point2 bl(o.pos.x - o.radius + hs.width, o.pos.y - o.radius + hs.height);
-    Point2 tr(o.pos.x + o.radius + hs.width, o.pos.y + o.radius + hs.height);
-    bl /= RegionSize;
-    tr /= RegionSize;
+    if (m_occupancy)
+        m_occupancy->add(o);
+    m_changes.push({ ObstacleChange::Type::Add, o });
+    commitObstacles();
+}
+
+void WallTracing::removeObstacle(Circle o) {
+    if (m_occupancy)
+        m_occupancy->remove(o);
+    m_changes.push({ ObstacleChange::Type::Remove, o });
+    commitObstacles();
+}
+
+void WallTracing::clusterObstacles(float radius) {
+    m_changes.push({ ObstacleChange::Type::Cluster, Circle(vec2(0.0f, 0.0f), radius) });
+    commitObstacles();
+}
+
+// Back set is written only while it has no readers, then it becomes front if it is newer.
+// A query pins a set only if it is still front after the query is counted, so a set seen without
+// readers after the swap can't be pinned until it is front again.
+bool WallTracing::commitObstacles() {
+    U32 n = m_changes.size();
+    for (int i = 0; i < 2; i++) {
+        int front = m_front.load();
+        ObstacleSet& back = m_obstacleSets[1 - front];
+        if (back.applied == n || back.readers.load())
+            continue;
+        applyChanges(back);
+        if (m_obstacleSets[front].applied < n)
+            m_front.store(1 - front);
+    }
     
-    Obstacle* ob = m_obstaclePool.alloc();
+    if (m_obstacleSets[0].applied == n && m_obstacleSets[1].applied == n) {
+        m_changes.clear();
+        m_obstacleSets[0].applied = 0;
+        m_obstacleSets[1].applied = 0;
+        return true;
+    }
+    return m_obstacleSets[m_front.load()].applied == n;
+}
+
+void WallTracing::applyChanges(ObstacleSet& s) {
+    U32 i = 0;
+    for (const ObstacleChange& c : m_changes) {
+        if (i++ < s.applied)
+            continue;
+        if (c.type == ObstacleChange::Type::Add)
+            addObstacle(s, c.circle);
+        else if (c.type == ObstacleChange::Type::Remove)
+            removeObstacle(s, c.circle);
+        else
+            clusterObstacles(s, c.circle.radius);
+    }
+    s.applied = i;
+}
+
+void WallTracing::addObstacle(ObstacleSet& s, Circle o) {
+    Obstacle* ob = s.pool.alloc();
+    if (s.freeIds.count()) {
+        ob->id = s.freeIds[s.freeIds.count() - 1];
+        s.freeIds.setCount(s.freeIds.count() - 1);
+    }
+    else
+        ob->id = s.count++;
+    ASSERT(ob->id < m_obstacleCapacity);
+    s.byId[ob->id] = ob;
     ob->pos = o.pos;
     ob->radius = o.radius;
-    ob->checked = m_curCheck;
-    ob->request = m_curRequest;
+    ob->cluster = 0;
+    s.clusterRadius = -1.0f;
     
-    for (int y = bl.y; y <= tr.y; y++)
-        for (int x = bl.x; x <= tr.x; x++)
-            m_regions[y * m_regionCount.x + x].obstacles.push(ob);
+    obstacleCell(s, o)->push(ob);
 }
 
-void WallTracing::removeObstacle(Circle o) {
-    nook::Size hs = map()->size() / 2;
-    Point2 bl(o.pos.x - o.radius + hs.width, o.pos.y - o.radius + hs.height);
-    Point2 tr(o.pos.x + o.radius + hs.width, o.pos.y + o.radius + hs.height);
-    bl /= RegionSize;
-    tr /= RegionSize;
-    
+void WallTracing::removeObstacle(ObstacleSet& s, Circle o) {
+    List1<Obstacle*>* cell = obstacleCell(s, o);
     Obstacle* ob = nullptr;
-    Region& r = m_regions[bl.y * m_regionCount.x + bl.x];
-    for (Obstacle* ro : r.obstacles)
+    for (Obstacle* ro : *cell)
         if (ro->pos == o.pos) {
             ob = ro;
             break;
         }
     ASSERT(ob);
     
-    for (int y = bl.y; y <= tr.y; y++)
-        for (int x = bl.x; x <= tr.x; x++)
-            m_regions[y * m_regionCount.x + x].obstacles.remove(ob);
-    m_obstaclePool.free(ob);
+    cell->remove(ob);
+    s.clusterRadius = -1.0f;
+    s.byId[ob->id] = nullptr;
+    s.freeIds.push(ob->id);
+    s.pool.free(ob);
 }
 
-void WallTracing::find(vec2 start, vec2 end, float radius, Array<vec2>& path) {
-    m_curCheck++;
-    m_queue.clear();
-    m_path.clear();
-    m_nextPool.clear();
-    m_curRadius = radius;
-    m_end = end;
-    m_iter = kMaxIter;
-    
-    m_curObstacle = getObstacle(start);
-    m_lastObstacle = nullptr;
-    m_endObstacle = findObstacle(end);
-    if (m_endObstacle == &m_dummyObstacle) {
-        m_lastObstacle = findObstacle(end, radius);
-        if (m_lastObstacle != &m_dummyObstacle) {
-            vec2 v = end - m_lastObstacle->pos;
+WallTracing::ObstacleLock::ObstacleLock(const WallTracing& owner, Query& q) : q(q), prev(q.m_obstacles) {
+    for (;;) {
+        int front = owner.m_front.load();
+        const ObstacleSet& s = owner.m_obstacleSets[front];
+        s.readers++;
+        if (owner.m_front.load() == front) {
+            q.m_obstacles = &s;
+            return;
+        }
+        s.readers--;
+    }
+}
+
+WallTracing::ObstacleLock::~ObstacleLock() {
+    q.m_obstacles->readers--;
+    q.m_obstacles = prev;
+}
+
+// Obstacle is kept only in the cell of its center at the level where radius is at most half of the cell,
+// so its circle never leaves the cell grown by half of the cell size
+int WallTracing::looseCell(Circle o, int& level) const {
+    level = 0;
+    while (level + 1 < m_levelCount && o.radius * 2.0f > m_obstacleLevels[level].cellSize)
+        level++;
+    
+    const ObstacleLevel& l = m_obstacleLevels[level];
+    nook::Size hs = m_size / 2;
+    int x = clamp((int)(o.pos.x + hs.width) / l.cellSize, 0, l.count.x - 1);
+    int y = clamp((int)(o.pos.y + hs.height) / l.cellSize, 0, l.count.y - 1);
+    return y * l.count.x + x;
+}
+
+List1<WallTracing::Obstacle*>* WallTracing::obstacleCell(const ObstacleSet& s, Circle o) const {
+    int li;
+    int cell = looseCell(o, li);
+    return s.cells + m_obstacleLevels[li].firstCell + cell;
+}
+
+// f(level, cell) is called for cells of all levels that can hold circles touching the box,
+// f returns true to stop, then true is returned
+template<typename F>
+bool WallTracing::forLooseCells(vec2 min, vec2 max, F f) const {
+    nook::Size hs = m_size / 2;
+    for (int li = 0; li < m_levelCount; li++) {
+        const ObstacleLevel& l = m_obstacleLevels[li];
+        float loose = l.cellSize * 0.5f;
+        int x0 = max2((int)(min.x - loose + hs.width) / l.cellSize, 0);
+        int y0 = max2((int)(min.y - loose + hs.height) / l.cellSize, 0);
+        int x1 = min2((int)(max.x + loose + hs.width) / l.cellSize, l.count.x - 1);
+        int y1 = min2((int)(max.y + loose + hs.height) / l.cellSize, l.count.y - 1);
+        for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++)
+                if (f(li, y * l.count.x + x))
+                    return true;
+    }
+    return false;
+}
+
+// f returns true to stop, then true is returned
+template<typename F>
+bool WallTracing::forObstacles(const ObstacleSet& s, vec2 min, vec2 max, F f) const {
+    return forLooseCells(min, max, [&](int li, int cell) {
+        for (Obstacle* o : s.cells[m_obstacleLevels[li].firstCell + cell])
+            if (f(o))
+                return true;
+        return false;
+    });
+}
+
+void WallTracing::clusterObstacles(ObstacleSet& s, float radius) {
+    s.clusterRadius = radius;
+    s.clusters.setCount(1);
+    s.clusterMembers.setCount(0);
+    s.clusterHulls.setCount(0);
+    
+    U32* parent = m_clusterParent.buf();
+    for (U32 i = 0; i < s.count; i++)
+        parent[i] = i;
+    auto root = [&](U32 i) {
+        while (parent[i] != i)
+            i = parent[i] = parent[parent[i]];
+        return i;
+    };
+    
+    // Inflated circles overlap when centers are closer than sum of radii and both unit radii.
+    // Closest point of such neighbour is within o->radius + 2 * radius from o.
+    for (U32 i = 1; i < s.count; i++) {
+        Obstacle* o = s.byId[i];
+        if (!o)
+            continue;
+        o->cluster = 0;
+        float reach = o->radius + radius * 2.0f;
+        forObstacles(s, o->pos - reach, o->pos + reach, [&](Obstacle* no) {
+            float r = o->radius + no->radius + radius * 2.0f;
+            if (no != o && (no->pos - o->pos).length2() < r * r)
+                parent[root(no->id)] = root(o->id);
+            return false;
+        });
+    }
+    
+    // Members are counted at their root, groups of 2 and more get a range of clusterMembers
+    U32* clusterOf = m_clusterOf.buf();
+    std::memset(clusterOf, 0, s.count * sizeof(U32));
+    for (U32 i = 1; i < s.count; i++)
+        if (s.byId[i])
+            clusterOf[root(i)]++;
+    U32 memberCount = 0;
+    for (U32 i = 1; i < s.count; i++) {
+        if (parent[i] != i || clusterOf[i] < 2) {
+            if (parent[i] == i)
+                clusterOf[i] = 0;
+            continue;
+        }
+        s.clusters.push({ memberCount, 0, 0, 0 });
+        memberCount += clusterOf[i];
+        clusterOf[i] = s.clusters.count() - 1;
+    }
+    s.clusterMembers.setCount(memberCount);
+    for (U32 i = 1; i < s.count; i++) {
+        Obstacle* o = s.byId[i];
+        if (!o)
+            continue;
+        o->cluster = clusterOf[root(i)];
+        if (o->cluster) {
+            Cluster& cl = s.clusters[o->cluster];
+            s.clusterMembers[cl.first + cl.count++] = o;
+        }
+    }
+    
+    // Octagon around each circle contains it and its vertices are about kr2 away like obstacle tangents
+    const float rcos = 1.0f / std::cos(3.14159265f / 8.0f);
+    for (int i = 1; i < s.clusters.count(); i++) {
+        Cluster& cl = s.clusters[i];
+        cl.hullFirst = s.clusterHulls.count();
+        for (U32 k = 0; k < cl.count; k++) {
+            Obstacle* o = s.clusterMembers[cl.first + k];
+            float r = (o->radius + radius + 0.01f) * rcos;
+            for (int v = 0; v < 8; v++) {
+                float a = v * 3.14159265f / 4.0f;
+                s.clusterHulls.push(o->pos + vec2(std::cos(a), std::sin(a)) * r);
+            }
+        }
+        cl.hullCount = convexHull(s.clusterHulls.buf() + cl.hullFirst, cl.count * 8, m_hullScratch.buf());
+        s.clusterHulls.setCount(cl.hullFirst + cl.hullCount);
+    }
+}
+
+WallTracing::Status WallTracing::find(vec2 start, vec2 end, float radius, Array<vec2>& path, Budget budget) {
+    return find(*m_query, start, end, radius, path, budget);
+}
+
+WallTracing::Status WallTracing::find(Query& q, vec2 start, vec2 end, float radius, Array<vec2>& path,
+                                      Budget budget) const {
+    ObstacleLock lock(*this, q);
+    q.m_corridor = nullptr;
+    q.m_corridorCount = 0;
+    Status status = search(q, start, end, radius, budget);
+    q.copyPath(path);
+    return status;
+}
+
+WallTracing::Status WallTracing::find(Query& q, vec2 start, vec2 end, float radius, vec2* path, int& count,
+                                      Budget budget) const {
+    ObstacleLock lock(*this, q);
+    q.m_corridor = nullptr;
+    q.m_corridorCount = 0;
+    Status status = search(q, start, end, radius, budget);
+    if (status == Status::Complete && (int)q.m_points.count() > count)
+        status = Status::Exhausted;
+    q.copyPath(path, count);
+    return status;
+}
+
+WallTracing::Status WallTracing::findInCorridor(Query& q, vec2 start, vec2 end, float radius,
+                                                const Array<vec2>& corridor, float width,
+                                                Array<vec2>& path, Budget budget) const {
+    ObstacleLock lock(*this, q);
+    q.m_corridor = corridor.buf();
+    q.m_corridorCount = corridor.count();
+    q.m_corridorWidth2 = width * width;
+    if (q.m_corridorCount) {
+        q.m_corridorMin = q.m_corridorMax = q.m_corridor[0];
+        for (int i = 1; i < q.m_corridorCount; i++) {
+            vec2 p = q.m_corridor[i];
+            q.m_corridorMin = vec2(min2(q.m_corridorMin.x, p.x), min2(q.m_corridorMin.y, p.y));
+            q.m_corridorMax = vec2(max2(q.m_corridorMax.x, p.x), max2(q.m_corridorMax.y, p.y));
+        }
+        q.m_corridorMin = q.m_corridorMin - width;
+        q.m_corridorMax = q.m_corridorMax + width;
+    }
+    Status status = search(q, start, end, radius, budget);
+    q.copyPath(path);
+    return status;
+}
+
+WallTracing::Status WallTracing::repair(Query& q, Array<vec2>& path, float radius, const Array<Circle>& changed,
+                                        Budget budget) const {
+    ObstacleLock lock(*this, q);
+    int n = path.count();
+    if (n < 2)
+        return Status::Complete;
+    
+    q.m_curRadius = radius;
+    q.m_radiusClass = getRadiusClass(radius);
+    q.m_useClusters = radius == q.m_obstacles->clusterRadius;
+    q.m_curObstacle = getObstacle(q, path[n - 1]);
+    q.m_endObstacle = findObstacle(q, path[0]);
+    q.m_corridor = nullptr;
+    q.m_corridorCount = 0;
+    
+    // Changed circles are bucketed like obstacles, so segments look only at nearby ones
+    ASSERT(changed.count() <= m_obstacleCapacity * 2);
+    q.m_curChanged++;
+    for (int k = 0; k < changed.count(); k++) {
+        int li;
+        int cell = looseCell(changed[k], li);
+        cell += m_obstacleLevels[li].firstCell;
+        if (q.m_changedStamp[cell] != q.m_curChanged) {
+            q.m_changedStamp[cell] = q.m_curChanged;
+            q.m_changedHead[cell] = UINT_MAX;
+        }
+        q.m_changedNext[k] = q.m_changedHead[cell];
+        q.m_changedHead[cell] = k;
+    }
+    
+    // Walls don't move, so only segments near changes are tested and only against obstacles.
+    // Segment i goes from path[i + 1] to path[i].
+    int lo = n;
+    int hi = -1;
+    for (int i = 0; i < n - 1; i++) {
+        vec2 a = path[i + 1];
+        vec2 b = path[i];
+        vec2 min(min2(a.x, b.x) - radius, min2(a.y, b.y) - radius);
+        vec2 max(max2(a.x, b.x) + radius, max2(a.y, b.y) + radius);
+        bool touched = forLooseCells(min, max, [&](int li, int cell) {
+            cell += m_obstacleLevels[li].firstCell;
+            if (q.m_changedStamp[cell] != q.m_curChanged)
+                return false;
+            for (U32 k = q.m_changedHead[cell]; k != UINT_MAX; k = q.m_changedNext[k]) {
+                const Circle& c = changed[k];
+                if (c.pos.x + c.radius < min.x || c.pos.x - c.radius > max.x ||
+                    c.pos.y + c.radius < min.y || c.pos.y - c.radius > max.y)
+                    continue;
+                float r = c.radius + radius;
+                if (pointToLine(c.pos, a, b).length2() <= r * r)
+                    return true;
+            }
+            return false;
+        });
+        if (!touched)
+            continue;
+        
+        float dist = (b - a).length();
+        if (findCollision(q, a, b, false).cost < dist - 0.001f) {
+            lo = min2(lo, i);
+            hi = i;
+        }
+    }
+    if (hi < 0)
+        return Status::Complete;
+    
+    // Broken span is searched again and spliced in, a failed repair falls back to the whole path
+    Status status = search(q, path[hi + 1], path[lo], radius, budget);
+    if (status != Status::Complete) {
+        status = search(q, path[n - 1], path[0], radius, budget);
+        path.setCount(0);
+        q.copyPath(path);
+        return status;
+    }
+    
+    // points after the span are moved in place, path grows by push so its capacity is checked
+    int tail = n - hi - 2;
+    int size = lo + q.m_points.count() + tail;
+    while (path.count() < size)
+        path.push(vec2());
+    std::memmove(path.buf() + size - tail, path.buf() + hi + 2, tail * sizeof(vec2));
+    path.setCount(size);
+    std::memcpy(path.buf() + lo, q.m_points.buf(), q.m_points.count() * sizeof(vec2));
+    return status;
+}
+
+void WallTracing::beginQuery(Query& q, vec2 start, vec2 end, float radius, Budget budget) const {
+    q.m_curCheck++;
+    q.clear();
+    q.m_curRadius = radius;
+    q.m_radiusClass = getRadiusClass(radius);
+    q.m_useClusters = radius == q.m_obstacles->clusterRadius;
+    q.m_end = end;
+    q.m_iter = budget.iterations > 0 ? budget.iterations : INT_MAX;
+    
+    q.m_curObstacle = getObstacle(q, start);
+    q.m_lastObstacle = nullptr;
+    q.m_endObstacle = findObstacle(q, end);
+    if (q.m_endObstacle == &m_dummyObstacle) {
+        q.m_lastObstacle = findObstacle(q, end, radius);
+        if (q.m_lastObstacle != &m_dummyObstacle) {
+            vec2 v = end - q.m_lastObstacle->pos;
             v *= 10.0f / v.length();
-            m_lastOLine = m_lastObstacle->pos + v;
+            q.m_lastOLine = q.m_lastObstacle->pos + v;
         }
     }
     
-    m_best = nullptr;
+    q.m_best = nullptr;
+    q.m_bestH = FLT_MAX;
+}
+
+WallTracing::Status WallTracing::search(Query& q, vec2 start, vec2 end, float radius, Budget budget) const {
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point deadline;
+    if (budget.microseconds > 0.0f)
+        deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<float, std::micro>(budget.microseconds));
+    
+    beginQuery(q, start, end, radius, budget);
     
-    Next col = findCollision(start, end, true);
+    Next col = findCollision(q, start, end, true);
     if (col.type) {
         if (col.type == 2)
-            col.obstacle->checked = m_curCheck;
+            q.m_obstacleChecked[col.obstacle->id] = q.m_curCheck;
         
         float h = heuristics(end, col.pos);
         float p = col.cost + h;
         
-        Next* left = m_nextPool.alloc();
+        Next* left = q.m_nextPool.alloc();
         left->type = col.type;
         left->dir = 1;
         left->last = col.last;
@@ -275,9 +1064,9 @@ void WallTracing::find(vec2 start, vec2 end, float radius, Array<vec2>& path) {
         left->pos = col.pos;
         left->from = nullptr;
         left->corner = col.corner;
-        m_queue.insert(left, p);
+        q.queueInsert(left, p);
         
-        Next* right = m_nextPool.alloc();
+        Next* right = q.m_nextPool.alloc();
         right->type = col.type;
         right->dir = 2;
         right->last = col.last;
@@ -285,76 +1074,608 @@ void WallTracing::find(vec2 start, vec2 end, float radius, Array<vec2>& path) {
         right->pos = col.pos;
         right->from = nullptr;
         right->corner = col.corner;
-        m_queue.insert(right, p);
+        q.queueInsert(right, p);
         
-        m_best = left;
-        m_bestH = h;
+        updateBest(q, left, h);
     }
     else
-        m_path.push(end);
+        q.m_points.push(end);
     
-    while (m_queue.count()) {
-        Next* r = m_queue.pop();
+    Status status = col.type ? Status::Partial : Status::Complete;
+    while (q.queueCount()) {
+        Next* r = q.queuePop();
         if (r->last) {
-            m_best = r;
+            q.m_best = r;
+            status = Status::Complete;
+            break;
+        }
+        if (!inCorridor(q, r->pos))
+            continue;
+        if (q.m_queueFull) {
+            status = Status::Overflow;
             break;
         }
-        if (!m_iter) {
-            debugLog("max iter")
+        if (!q.m_iter || (budget.microseconds > 0.0f && Clock::now() >= deadline)) {
+            status = Status::Exhausted;
             break;
         }
-        m_iter--;
+        q.m_iter--;
         
         if (r->type == 1) {
             Corner* c = r->corner;
-            vec2 cpos = c->pos + c->normal * radius;
+            vec2 cpos = inflate(q, c);
             if (r->pos == cpos) {
-                pushNextCorner(r, r->dir == 1 ? c->left : c->right);
+                pushNextCorner(q, r, r->dir == 1 ? c->left : c->right);
                 
                 vec2 to = end - cpos;
                 vec2 d = r->dir == 1 ? vec2(c->normal.y, -c->normal.x) : vec2(-c->normal.y, c->normal.x);
                 if (c->outer && to.x * d.x >= 0.0f && to.y * d.y >= 0.0f) {
-                    c->request = m_curRequest + 1;
-                    c->left->request = m_curRequest + 1;
-                    pushNextCollision(r);
+                    q.m_cornerRequest[c->id] = q.m_curRequest + 1;
+                    q.m_cornerRequest[c->left->id] = q.m_curRequest + 1;
+                    pushNextCollision(q, r);
                 }
             }
             else {
                 if (r->dir == 1) {
-                    c->checked = m_curCheck - 1;
-                    pushNextCorner(r, c);
+                    q.m_cornerChecked[c->id] = q.m_curCheck - 1;
+                    pushNextCorner(q, r, c);
                 }
                 else
-                    pushNextCorner(r, c->right);
+                    pushNextCorner(q, r, c->right);
             }
         }
         else
-            pushNextObstacle(r);
+            pushNextObstacle(q, r);
     }
     
-    while (m_best) {
-        m_path.push(m_best->pos);
-        m_best = m_best->from;
+    if (status == Status::Partial && q.m_queueFull)
+        status = Status::Overflow;
+    if (!buildPath(q, start) && status != Status::Overflow)
+        status = Status::Exhausted;
+    
+    q.m_stats[(int)status]++;
+    return status;
+}
+
+bool WallTracing::buildPath(Query& q, vec2 start) const {
+    Array<vec2>& pts = q.m_points;
+    int depth = 0;
+    for (Next* n = q.m_best; n; n = n->from)
+        depth++;
+    // nodes closest to the end are dropped from a longer path
+    int skip = max2((int)pts.count() + depth + 1 - MaxPathPoints, 0);
+    bool whole = !skip;
+    if (skip) {
+        skip -= pts.count();
+        pts.setCount(0);
     }
-    m_path.push(start);
+    for (Next* n = q.m_best; n; n = n->from)
+        if (skip)
+            skip--;
+        else
+            pts.push(n->pos);
+    q.m_best = nullptr;
+    pts.push(start);
     
-    List<vec2>::Node* node = m_path.root()->prev;
-    for (int i = m_path.size() - 2; i > 0; i--) {
-        vec2 from = node->elem;
-        vec2 to = node->prev->prev->elem;
+    // Points go from end to start. Kept points are packed to the back behind w,
+    // segment pts[w] - pts[i] is always clear: it is a search step or was tested before.
+    int n = pts.count();
+    int w = n - 1;
+    for (int i = n - 2; i > 0; i--) {
+        vec2 from = pts[w];
+        vec2 to = pts[i - 1];
+        vec2 a = pts[i] - from;
+        vec2 b = to - pts[i];
+        if (a.cross(b) == 0.0f && a.dot(b) >= 0.0f)
+            continue; // straight continuation of clear segments
+        
         float dist = (from - to).length();
-        Next col = findCollision(from, to, true);
+        Next col = findCollision(q, from, to, true);
         if (col.cost < dist - 0.001f)
-            node = node->prev;
-        else
-            m_path.remove(node->prev);
+            pts[--w] = pts[i];
+    }
+    if (n > 1)
+        pts[--w] = pts[0];
+    std::memmove(pts.buf(), pts.buf() + w, (n - w) * sizeof(vec2));
+    pts.setCount(n - w);
+    
+    if (pts.count() == 2 && pts[0] == pts[1])
+        pts.setCount(1);
+    return whole;
+}
+
+void WallTracing::addRadiusClass(float radius) {
+    if (getRadiusClass(radius))
+        return;
+    
+    ASSERT(m_radiusClasses.count() < MaxRadiusClasses);
+    RadiusClass* rc = memoryManager().createOnStack<RadiusClass>();
+    rc->radius = radius;
+    allocArray(rc->points, m_cornerCapacity);
+    rc->points.setCount(m_cornerCount);
+    for (U32 i = 0; i < m_cornerCount; i++)
+        if (Corner* c = m_cornersById[i])
+            rc->points[i] = c->pos + c->normal * radius;
+    
+    rc->chains = memoryManager().allocOnStack<Segment*>(m_cornerCapacity);
+    std::memset(rc->chains, 0, m_cornerCapacity * sizeof(Segment*));
+    for (U32 i = 0; i < m_chains.count(); i++)
+        if (m_chainState[i] == 1)
+            buildChainSegments(*rc, i);
+    m_radiusClasses.push(rc);
+}
+
+void WallTracing::buildChainSegments(RadiusClass& rc, U32 id) {
+    Segment** tail = &rc.chains[id];
+    Corner* c = m_chains[id].first;
+    for (U32 i = 0; i < m_chains[id].count; i++, c = c->right) {
+        Segment* s = rc.segmentPool.alloc();
+        *s = { c->id, c, rc.points[c->id], rc.points[c->right->id], nullptr };
+        *tail = s;
+        tail = &s->next;
+    }
+    *tail = nullptr;
+}
+
+template<typename F>
+void WallTracing::forChainRegions(const Chain& ch, F f) const {
+    nook::Size hs = m_size / 2;
+    int x0 = clamp((int)(ch.min.x + hs.width) / RegionSize, 0, m_regionCount.x - 1);
+    int y0 = clamp((int)(ch.min.y + hs.height) / RegionSize, 0, m_regionCount.y - 1);
+    int x1 = clamp((int)(ch.max.x + hs.width) / RegionSize, 0, m_regionCount.x - 1);
+    int y1 = clamp((int)(ch.max.y + hs.height) / RegionSize, 0, m_regionCount.y - 1);
+    for (int y = y0; y <= y1; y++)
+        for (int x = x0; x <= x1; x++)
+            f(m_regions[y * m_regionCount.x + x]);
+}
+
+void WallTracing::pendChain(U32 id) {
+    if (m_chainState[id] == 0) {
+        m_chainState[id] = 2;
+        m_pendingChains.push(id);
+    }
+}
+
+void WallTracing::registerChains() {
+    for (U32 id : m_pendingChains) {
+        if (m_chainState[id] != 2)
+            continue;
+        if (!m_chains[id].count) {
+            m_chainState[id] = 0;
+            continue;
+        }
+        m_chainState[id] = 1;
+        forChainRegions(m_chains[id], [&](Region& r) { r.chains.push(id); });
+        for (int i = 0; i < m_radiusClasses.count(); i++)
+            buildChainSegments(*m_radiusClasses[i], id);
+    }
+    m_pendingChains.setCount(0);
+}
+
+void WallTracing::unregisterChain(U32 id) {
+    if (m_chainState[id] == 1) {
+        forChainRegions(m_chains[id], [&](Region& r) { r.chains.remove(id); });
+        for (int i = 0; i < m_radiusClasses.count(); i++) {
+            RadiusClass& rc = *m_radiusClasses[i];
+            for (Segment* s = rc.chains[id]; s;) {
+                Segment* next = s->next;
+                rc.segmentPool.free(s);
+                s = next;
+            }
+            rc.chains[id] = nullptr;
+        }
+    }
+    m_chainState[id] = 0;
+}
+
+// Releases chain of c and collects its members that are not marked with removedMark.
+// Members are marked with m_curMark, links must be still intact.
+void WallTracing::releaseChain(Corner* c, U32 removedMark, List<Corner*>& members) {
+    U32 id = c->chain;
+    if (id == NoChain) {
+        if (m_cornerMark[c->id] != m_curMark && m_cornerMark[c->id] != removedMark) {
+            m_cornerMark[c->id] = m_curMark;
+            members.push(c);
+        }
+        return;
+    }
+    if (m_chainMark[id] == m_curMark)
+        return;
+    m_chainMark[id] = m_curMark;
+    unregisterChain(id);
+    m_freeChainIds.push(id);
+    
+    Corner* first = m_chains[id].first;
+    for (U32 i = 0; i < m_chains[id].count; i++, first = first->right)
+        if (m_cornerMark[first->id] != removedMark) {
+            m_cornerMark[first->id] = m_curMark;
+            members.push(first);
+        }
+    m_chains[id].count = 0;
+}
+
+void WallTracing::growChain(U32 id, Corner* c) {
+    Chain& ch = m_chains[id];
+    // segment ends at the right corner
+    vec2 p = c->right->pos;
+    ch.min = vec2(min2(ch.min.x, min2(c->pos.x, p.x)), min2(ch.min.y, min2(c->pos.y, p.y)));
+    ch.max = vec2(max2(ch.max.x, max2(c->pos.x, p.x)), max2(ch.max.y, max2(c->pos.y, p.y)));
+    ch.count++;
+    c->chain = id;
+}
+
+// Chains the run of corners around c that are marked with m_curMark and have no chain yet.
+// Run continues the chain of its left neighbour and its tail joins the chain of its right
+// neighbour while they have room, so unmarked corners keep their chains.
+void WallTracing::chainRun(Corner* c) {
+    auto pending = [&](Corner* p) {
+        return m_cornerMark[p->id] == m_curMark && p->chain == NoChain;
+    };
+    if (!pending(c))
+        return;
+    
+    Corner* first = c;
+    while (pending(first->left) && first->left != c)
+        first = first->left;
+    
+    // only the last corner of a chain links to a run
+    U32 id = NoChain;
+    Corner* left = first->left;
+    if (m_cornerMark[left->id] != m_curMark && m_chains[left->chain].count < ChainSize) {
+        id = left->chain;
+        unregisterChain(id);
+        pendChain(id);
+    }
+    
+    Corner* tail = nullptr; // first corner of the last new chain
+    for (c = first; pending(c); c = c->right) {
+        if (id == NoChain || m_chains[id].count == ChainSize) {
+            if (m_freeChainIds.count()) {
+                id = m_freeChainIds[m_freeChainIds.count() - 1];
+                m_freeChainIds.setCount(m_freeChainIds.count() - 1);
+            }
+            else {
+                id = m_chains.count();
+                m_chains.push(Chain());
+            }
+            m_chains[id].min = m_chains[id].max = c->pos;
+            m_chains[id].count = 0;
+            m_chains[id].first = c;
+            pendChain(id);
+            tail = c;
+        }
+        growChain(id, c);
+    }
+    
+    // likewise only the first corner of a chain is linked from a run
+    if (!tail || m_cornerMark[c->id] == m_curMark)
+        return;
+    U32 right = c->chain;
+    if (m_chains[right].count + m_chains[id].count > ChainSize)
+        return;
+    unregisterChain(right);
+    pendChain(right);
+    m_chains[right].first = tail;
+    for (; tail != c; tail = tail->right)
+        growChain(right, tail);
+    m_chains[id].count = 0;
+    m_freeChainIds.push(id);
+}
+
+// Corners must be marked with m_curMark, their old chains released
+void WallTracing::buildChains(const List<Corner*>& corners) {
+    for (Corner* c : corners)
+        c->chain = NoChain;
+    for (Corner* c : corners)
+        chainRun(c);
+    registerChains();
+}
+
+const WallTracing::RadiusClass* WallTracing::getRadiusClass(float radius) const {
+    for (int i = 0; i < m_radiusClasses.count(); i++)
+        if (m_radiusClasses[i]->radius == radius)
+            return m_radiusClasses[i];
+    return nullptr;
+}
+
+void WallTracing::addVisibilityGraph(float radius, float range) {
+    ASSERT(m_visibility.count() < MaxVisibilityGraphs);
+    VisibilityGraph* g = memoryManager().createOnStack<VisibilityGraph>();
+    g->radius = radius;
+    g->range = range;
+    g->edges = memoryManager().allocOnStack<VisibilityGraph::Edge*>(m_cornerCapacity);
+    std::memset(g->edges, 0, m_cornerCapacity * sizeof(VisibilityGraph::Edge*));
+    m_visibility.push(g);
+    
+    // Thread 0 uses m_query, queries of other threads are kept for later graphs
+    while (m_buildQueries.count() < m_threadCount - 1)
+        m_buildQueries.push(memoryManager().createOnStack<Query>(*this));
+    auto query = [&](int t) -> Query& {
+        return t ? *m_buildQueries[t - 1] : *m_query;
+    };
+    
+    // Edges are counted first, so the first build fills one block and threads allocate nothing
+    U32* first = memoryManager().allocOnStack<U32>(m_cornerCount + 1);
+    first[0] = 0;
+    parallelFor(m_cornerCount, m_threadCount, [&](int t, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            Corner* c = m_cornersById[i];
+            U32 n = 0;
+            if (c && c->outer)
+                forEdges(*g, query(t), c, [&](Corner*, float) { n++; });
+            first[i + 1] = n;
+        }
+    });
+    for (U32 i = 0; i < m_cornerCount; i++)
+        first[i + 1] += first[i];
+    
+    g->blockSize = first[m_cornerCount];
+    g->block = memoryManager().allocOnStack<VisibilityGraph::Edge>(max2(g->blockSize, 1u));
+    parallelFor(m_cornerCount, m_threadCount, [&](int t, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            Corner* c = m_cornersById[i];
+            if (!c || !c->outer || first[i] == first[i + 1])
+                continue;
+            VisibilityGraph::Edge* e = g->block + first[i];
+            forEdges(*g, query(t), c, [&](Corner* b, float cost) {
+                *e = { b->id, cost, e + 1 };
+                e++;
+            });
+            (e - 1)->next = nullptr;
+            g->edges[i] = g->block + first[i];
+        }
+    });
+}
+
+WallTracing::Status WallTracing::findVisible(Query& q, vec2 start, vec2 end, float radius, Array<vec2>& path,
+                                             Budget budget) const {
+    ObstacleLock lock(*this, q);
+    const VisibilityGraph* g = nullptr;
+    for (int i = 0; i < m_visibility.count(); i++)
+        if (m_visibility[i]->radius == radius)
+            g = m_visibility[i];
+    if (!g)
+        return find(q, start, end, radius, path, budget);
+    
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point deadline;
+    if (budget.microseconds > 0.0f)
+        deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<float, std::micro>(budget.microseconds));
+    
+    q.m_corridor = nullptr;
+    q.m_corridorCount = 0;
+    beginQuery(q, start, end, radius, budget);
+    
+    Next col = findCollision(q, start, end, true);
+    if (!col.type) {
+        q.m_points.push(end);
+        buildPath(q, start);
+        q.copyPath(path);
+        q.m_stats[(int)Status::Complete]++;
+        return Status::Complete;
+    }
+    
+    forOuterCorners(end - g->range, end + g->range, [&](Corner* c) {
+        vec2 cpos = inflate(q, c);
+        float dist = (end - cpos).length();
+        if (dist > g->range || !isTaut(c, end))
+            return;
+        Next wall = findCollision(q, cpos, end, true, false);
+        if (!wall.type || wall.cost >= dist - 0.001f)
+            q.m_cornerGoal[c->id] = q.m_curCheck;
+    });
+    
+    forOuterCorners(start - g->range, start + g->range, [&](Corner* c) {
+        vec2 cpos = inflate(q, c);
+        float dist = (cpos - start).length();
+        if (dist > g->range || !isTaut(c, start))
+            return;
+        Next sc = findCollision(q, start, cpos, true);
+        if (sc.type && sc.cost < dist - 0.001f)
+            return;
+        
+        Next* next = q.m_nextPool.alloc();
+        next->type = 1;
+        next->dir = 0;
+        next->last = false;
+        next->cost = dist;
+        next->pos = cpos;
+        next->from = nullptr;
+        next->corner = c;
+        q.queueInsert(next, dist + heuristics(cpos, end));
+    });
+    
+    // A* over the graph, edges are checked only against obstacles
+    Status status = Status::Complete;
+    while (q.queueCount()) {
+        Next* r = q.queuePop();
+        if (r->last) {
+            q.m_best = r;
+            break;
+        }
+        
+        Corner* c = r->corner;
+        if (q.m_cornerChecked[c->id] == q.m_curCheck)
+            continue;
+        if (q.m_queueFull || !q.m_iter || (budget.microseconds > 0.0f && Clock::now() >= deadline)) {
+            status = q.m_queueFull ? Status::Overflow : Status::Exhausted;
+            break;
+        }
+        q.m_iter--;
+        q.m_cornerChecked[c->id] = q.m_curCheck;
+        updateBest(q, r, heuristics(end, r->pos));
+        
+        if (q.m_cornerGoal[c->id] == q.m_curCheck && !findCollision(q, r->pos, end, false).type) {
+            Next* next = q.m_nextPool.alloc();
+            next->type = 0;
+            next->last = true;
+            next->cost = r->cost + (end - r->pos).length();
+            next->pos = end;
+            next->from = r;
+            q.queueInsert(next, next->cost);
+        }
+        
+        for (const VisibilityGraph::Edge* e = g->edges[c->id]; e; e = e->next) {
+            if (q.m_cornerChecked[e->id] == q.m_curCheck)
+                continue;
+            Corner* nc = m_cornersById[e->id];
+            vec2 npos = inflate(q, nc);
+            if (findCollision(q, r->pos, npos, false).type)
+                continue;
+            
+            Next* next = q.m_nextPool.alloc();
+            next->type = 1;
+            next->dir = 0;
+            next->last = false;
+            next->cost = r->cost + e->cost;
+            next->pos = npos;
+            next->from = r;
+            next->corner = nc;
+            q.queueInsert(next, next->cost + heuristics(npos, end));
+        }
+    }
+    
+    // Blocked by obstacles or end is not connected to the graph. Over the budget or the queue
+    // the path leads to the expanded corner closest to end.
+    if (status == Status::Complete && (!q.m_best || !q.m_best->last))
+        return find(q, start, end, radius, path, budget);
+    
+    if (!buildPath(q, start) && status != Status::Overflow)
+        status = Status::Exhausted;
+    q.copyPath(path);
+    q.m_stats[(int)status]++;
+    return status;
+}
+
+template<typename F>
+void WallTracing::forEdges(const VisibilityGraph& g, Query& q, Corner* a, F f) const {
+    q.m_curRadius = g.radius;
+    q.m_radiusClass = getRadiusClass(g.radius);
+    q.m_curObstacle = &m_dummyObstacle;
+    
+    forOuterCorners(a->pos - g.range, a->pos + g.range, [&](Corner* b) {
+        float dist = edgeCost(g, q, a, b);
+        if (dist >= 0.0f)
+            f(b, dist);
+    });
+}
+
+// Length of edge from a to b checked against walls only, -1 if there is no edge
+float WallTracing::edgeCost(const VisibilityGraph& g, Query& q, Corner* a, Corner* b) const {
+    if (b == a)
+        return -1.0f;
+    vec2 apos = a->pos + a->normal * g.radius;
+    vec2 bpos = b->pos + b->normal * g.radius;
+    float dist = (bpos - apos).length();
+    if (dist > g.range || !isTaut(a, b->pos) || !isTaut(b, a->pos))
+        return -1.0f;
+    
+    Next col = findCollision(q, apos, bpos, true, false);
+    if (col.type && col.cost < dist - 0.001f)
+        return -1.0f;
+    return dist;
+}
+
+void WallTracing::buildEdges(VisibilityGraph& g, Corner* a) {
+    clearEdges(g, a->id);
+    forEdges(g, *m_query, a, [&](Corner* b, float cost) {
+        VisibilityGraph::Edge* e = g.edgePool.alloc();
+        *e = { b->id, cost, g.edges[a->id] };
+        g.edges[a->id] = e;
+    });
+}
+
+// Edges of a to freed ids or crossing [min, max] are dropped, then edges crossing it are checked again.
+// Ids reused by new corners are inside of [min, max], so their old edges are dropped too.
+void WallTracing::refreshEdges(VisibilityGraph& g, Corner* a, vec2 min, vec2 max) {
+    vec2 apos = a->pos + a->normal * g.radius;
+    VisibilityGraph::Edge** link = &g.edges[a->id];
+    while (VisibilityGraph::Edge* e = *link) {
+        Corner* b = m_cornersById[e->id];
+        if (b && !segmentBox(apos, b->pos + b->normal * g.radius, min, max)) {
+            link = &e->next;
+            continue;
+        }
+        *link = e->next;
+        if (e < g.block || e >= g.block + g.blockSize)
+            g.edgePool.free(e);
+    }
+    
+    Query& q = *m_query;
+    q.m_curRadius = g.radius;
+    q.m_radiusClass = getRadiusClass(g.radius);
+    q.m_curObstacle = &m_dummyObstacle;
+    forOuterCorners(a->pos - g.range, a->pos + g.range, [&](Corner* b) {
+        if (!segmentBox(apos, b->pos + b->normal * g.radius, min, max))
+            return;
+        float cost = edgeCost(g, q, a, b);
+        if (cost < 0.0f)
+            return;
+        VisibilityGraph::Edge* e = g.edgePool.alloc();
+        *e = { b->id, cost, g.edges[a->id] };
+        g.edges[a->id] = e;
+    });
+}
+
+void WallTracing::clearEdges(VisibilityGraph& g, U32 id) {
+    for (VisibilityGraph::Edge* e = g.edges[id]; e;) {
+        VisibilityGraph::Edge* next = e->next;
+        // edges of the first build stay in its block
+        if (e < g.block || e >= g.block + g.blockSize)
+            g.edgePool.free(e);
+        e = next;
     }
+    g.edges[id] = nullptr;
+}
+
+template<typename F>
+void WallTracing::forOuterCorners(vec2 min, vec2 max, F f) const {
+    nook::Size hs = m_size / 2;
+    int rx0 = clamp((int)(min.x + hs.width) / RegionSize, 0, m_regionCount.x - 1);
+    int ry0 = clamp((int)(min.y + hs.height) / RegionSize, 0, m_regionCount.y - 1);
+    int rx1 = clamp((int)(max.x + hs.width) / RegionSize, 0, m_regionCount.x - 1);
+    int ry1 = clamp((int)(max.y + hs.height) / RegionSize, 0, m_regionCount.y - 1);
     
-    if (m_path.size() == 2 && m_path.first() == m_path.last())
-        m_path.remove(m_path.root()->prev);
+    for (int y = ry0; y <= ry1; y++)
+        for (int x = rx0; x <= rx1; x++)
+            for (Corner* c : m_regions[y * m_regionCount.x + x].corners) {
+                // region lists also have corners whose wall only passes through
+                if (!c->outer || getRegion(c) != Coord(x, y))
+                    continue;
+                if (c->pos.x < min.x || c->pos.y < min.y || c->pos.x > max.x || c->pos.y > max.y)
+                    continue;
+                f(c);
+            }
+}
+
+// Path through convex corner is taut when both walls of corner lie on one side of it
+bool WallTracing::isTaut(const Corner* c, vec2 from) const {
+    float l = sign(c->left->pos, from, c->pos);
+    float r = sign(c->right->pos, from, c->pos);
+    return l * r >= 0.0f;
+}
+
+// Partial result leads to the closest point, which must be inside of corridor too
+void WallTracing::updateBest(Query& q, Next* n, float h) const {
+    if (h < q.m_bestH && inCorridor(q, n->pos)) {
+        q.m_bestH = h;
+        q.m_best = n;
+    }
+}
+
+bool WallTracing::inCorridor(const Query& q, vec2 p) const {
+    if (!q.m_corridorCount)
+        return true;
+    if (p.x < q.m_corridorMin.x || p.y < q.m_corridorMin.y || p.x > q.m_corridorMax.x || p.y > q.m_corridorMax.y)
+        return false;
+    if (q.m_corridorCount == 1)
+        return (q.m_corridor[0] - p).length2() <= q.m_corridorWidth2;
     
-    for (vec2 p : m_path)
-        path.push(p);
+    for (int i = 1; i < q.m_corridorCount; i++)
+        if (pointToLine(p, q.m_corridor[i - 1], q.m_corridor[i]).length2() <= q.m_corridorWidth2)
+            return true;
+    return false;
 }
 
 WallTracing::Corner WallTracing::getCorner(Coord coord, U32 cell, int dir) {
@@ -407,60 +1728,51 @@ WallTracing::Corner WallTracing::getCorner(Coord coord, U32 cell, int dir) {
     return corner;
 }
 
-WallTracing::Obstacle* WallTracing::getObstacle(vec2 pos) {
-    nook::Size hs = map()->size() / 2;
-    U32 rx = (U32)(pos.x + hs.width) / RegionSize;
-    U32 ry = (U32)(pos.y + hs.height) / RegionSize;
-    Region& r = m_regions[ry * m_regionCount.x + rx];
-    
-    for (Obstacle* ro : r.obstacles)
+const WallTracing::Obstacle* WallTracing::getObstacle(const Query& q, vec2 pos) const {
+    const Obstacle* ob = &m_dummyObstacle;
+    forObstacles(*q.m_obstacles, pos, pos, [&](Obstacle* ro) {
         if (ro->pos == pos)
-            return ro;
-    return &m_dummyObstacle;
+            ob = ro;
+        return ro->pos == pos;
+    });
+    return ob;
 }
 
-WallTracing::Obstacle* WallTracing::findObstacle(vec2 pos) {
-    nook::Size hs = map()->size() / 2;
-    U32 rx = (U32)(pos.x + hs.width) / RegionSize;
-    U32 ry = (U32)(pos.y + hs.height) / RegionSize;
-    Region& r = m_regions[ry * m_regionCount.x + rx];
-    
-    for (Obstacle* ro : r.obstacles)
+const WallTracing::Obstacle* WallTracing::findObstacle(const Query& q, vec2 pos) const {
+    const Obstacle* ob = &m_dummyObstacle;
+    forObstacles(*q.m_obstacles, pos, pos, [&](Obstacle* ro) {
         if ((ro->pos - pos).length() <= ro->radius)
-            return ro;
-    return &m_dummyObstacle;
+            ob = ro;
+        return ob != &m_dummyObstacle;
+    });
+    return ob;
 }
 
-WallTracing::Obstacle* WallTracing::findObstacle(vec2 pos, float radius) {
-    nook::Size hs = map()->size() / 2;
-    U32 rx = (U32)(pos.x + hs.width) / RegionSize;
-    U32 ry = (U32)(pos.y + hs.height) / RegionSize;
-    Region& r = m_regions[ry * m_regionCount.x + rx];
-    
-    for (Obstacle* ro : r.obstacles) {
-        if (ro == m_curObstacle)
-            continue;
-        if ((ro->pos - pos).length() <= (ro->radius + radius) * kr2)
-            return ro;
-    }
-    return &m_dummyObstacle;
+const WallTracing::Obstacle* WallTracing::findObstacle(Query& q, vec2 pos, float radius) const {
+    const Obstacle* ob = &m_dummyObstacle;
+    forObstacles(*q.m_obstacles, pos, pos, [&](Obstacle* ro) {
+        if (ro != q.m_curObstacle && (ro->pos - pos).length() <= (ro->radius + radius) * kr2)
+            ob = ro;
+        return ob != &m_dummyObstacle;
+    });
+    return ob;
 }
 
-void WallTracing::pushNextCorner(Next* n, Corner* nc) {
-    if (nc->checked == m_curCheck)
+void WallTracing::pushNextCorner(Query& q, Next* n, Corner* nc) const {
+    if (q.m_cornerChecked[nc->id] == q.m_curCheck)
         return;
     
-    vec2 cpos = nc->pos + nc->normal * m_curRadius;
-    Next col = findCollision(n->pos, cpos, false);
+    vec2 cpos = inflate(q, nc);
+    Next col = findCollision(q, n->pos, cpos, false);
     
     if (col.type) { // can be only obstacle
-        if (col.obstacle->checked != m_curCheck) {
-            col.obstacle->checked = m_curCheck;
+        if (q.m_obstacleChecked[col.obstacle->id] != q.m_curCheck) {
+            q.m_obstacleChecked[col.obstacle->id] = q.m_curCheck;
             
-            float h = heuristics(col.pos, m_end);
+            float h = heuristics(col.pos, q.m_end);
             float cost = n->cost + col.cost;
             
-            Next* next = m_nextPool.alloc();
+            Next* next = q.m_nextPool.alloc();
             next->type = 2;
             next->dir = n->dir;
             next->last = col.last;
@@ -468,21 +1780,18 @@ void WallTracing::pushNextCorner(Next* n, Corner* nc) {
             next->pos = col.pos;
             next->from = n;
             next->obstacle = col.obstacle;
-            m_queue.insert(next, h + cost);
+            q.queueInsert(next, h + cost);
             
-            if (h < m_bestH) {
-                m_bestH = h;
-                m_best = next;
-            }
+            updateBest(q, next, h);
         }
     }
     else {
-        nc->checked = m_curCheck;
+        q.m_cornerChecked[nc->id] = q.m_curCheck;
         
-        float h = heuristics(cpos, m_end);
+        float h = heuristics(cpos, q.m_end);
         float cost = n->cost + col.cost;
         
-        Next* next = m_nextPool.alloc();
+        Next* next = q.m_nextPool.alloc();
         next->type = 1;
         next->dir = n->dir;
         next->last = false;
@@ -490,23 +1799,23 @@ void WallTracing::pushNextCorner(Next* n, Corner* nc) {
         next->pos = cpos;
         next->from = n;
         next->corner = nc;
-        m_queue.insert(next, h + cost);
+        q.queueInsert(next, h + cost);
         
-        if (h < m_bestH) {
-            m_bestH = h;
-            m_best = next;
-        }
+        updateBest(q, next, h);
     }
 }
 
-void WallTracing::pushNextObstacle(Next* n) {
+void WallTracing::pushNextObstacle(Query& q, Next* n) const {
     Obstacle* o = n->obstacle;
-    o->request = m_curRequest + 1;
+    if (q.m_useClusters && o->cluster && pushNextCluster(q, n))
+        return;
+    
+    q.m_obstacleRequest[o->id] = q.m_curRequest + 1;
     vec2 cp = o->pos - n->pos;
-    vec2 ne = m_end - n->pos;
+    vec2 ne = q.m_end - n->pos;
     
     float d2 = cp.length2();
-    float r = o->radius + m_curRadius + 0.01f;
+    float r = o->radius + q.m_curRadius + 0.01f;
     float r2 = r * r;
     float tr = std::sqrt(r2 * (kr2 * kr2 - 1.0f));
     float s = (int)(n->dir & 2) - 1;
@@ -528,66 +1837,22 @@ void WallTracing::pushNextObstacle(Next* n) {
     }
     
     if (dir.cross(ne) * s <= 0.0f) {
-        pushNextCollision(n);
+        pushNextCollision(q, n);
     }
     else {
         vec2 to = n->pos + dir;
         bool last = false;
-        if (o == m_lastObstacle)
-            last = lineIntersect(n->pos, to, o->pos, m_lastOLine, to);
+        if (o == q.m_lastObstacle)
+            last = lineIntersect(n->pos, to, o->pos, q.m_lastOLine, to);
         
-        Next col = findCollision(n->pos, to, true);
-        if (col.type == 1) {
-            U32 ch = n->dir == 1 ? col.corner->checked : col.corner->right->checked;
-            if (ch == m_curCheck)
-                return;
-            
-            float h = heuristics(m_end, col.pos);
-            float cost = n->cost + col.cost;
-            
-            Next* next = m_nextPool.alloc();
-            next->type = 1;
-            next->dir = n->dir;
-            next->last = col.last;
-            next->cost = cost;
-            next->pos = col.pos;
-            next->from = n;
-            next->obstacle = col.obstacle;
-            m_queue.insert(next, h + cost);
-            
-            if (h < m_bestH) {
-                m_bestH = h;
-                m_best = next;
-            }
-        }
-        else if (col.type == 2) {
-            if (col.obstacle->checked == m_curCheck)
-                return;
-            col.obstacle->checked = m_curCheck;
-            
-            float h = heuristics(m_end, col.pos);
-            float cost = n->cost + col.cost;
-            
-            Next* next = m_nextPool.alloc();
-            next->type = 2;
-            next->dir = n->dir;
-            next->last = col.last;
-            next->cost = cost;
-            next->pos = col.pos;
-            next->from = n;
-            next->obstacle = col.obstacle;
-            m_queue.insert(next, h + cost);
-            
-            if (h < m_bestH) {
-                m_bestH = h;
-                m_best = next;
-            }
-        }
+        Next col = findCollision(q, n->pos, to, true);
+        if (col.type)
+            pushCollision(q, n, col);
         else {
-            float h = heuristics(m_end, to);
+            float h = heuristics(q.m_end, to);
             float cost = n->cost + col.cost;
             
-            Next* next = m_nextPool.alloc();
+            Next* next = q.m_nextPool.alloc();
             next->type = 2;
             next->dir = n->dir;
             next->last = last;
@@ -595,25 +1860,141 @@ void WallTracing::pushNextObstacle(Next* n) {
             next->pos = to;
             next->from = n;
             next->obstacle = o;
-            m_queue.insert(next, h + cost);
+            q.queueInsert(next, h + cost);
             
-            if (h < m_bestH) {
-                m_bestH = h;
-                m_best = next;
-            }
+            updateBest(q, next, h);
+        }
+    }
+}
+
+// Walks around the hull of obstacle cluster in one step, false if end is inside the hull
+bool WallTracing::pushNextCluster(Query& q, Next* n) const {
+    const Cluster& cl = q.m_obstacles->clusters[n->obstacle->cluster];
+    const vec2* h = q.m_obstacles->clusterHulls.buf() + cl.hullFirst;
+    int count = cl.hullCount;
+    if (insideHull(h, count, q.m_end))
+        return false;
+    
+    for (U32 i = 0; i < cl.count; i++)
+        q.m_obstacleChecked[q.m_obstacles->clusterMembers[cl.first + i]->id] = q.m_curCheck;
+    
+    float s = (int)(n->dir & 2) - 1;
+    vec2 p = n->pos;
+    bool inside = insideHull(h, count, p);
+    int k = 0;
+    if (inside) {
+        // there is no tangent from inside, leave by the vertex farthest to the side of dir
+        vec2 ne = q.m_end - p;
+        for (int i = 1; i < count; i++)
+            if (ne.cross(h[i] - p) * s < ne.cross(h[k] - p) * s)
+                k = i;
+    }
+    else {
+        k = h[0] == p ? 1 : 0;
+        for (int i = 0; i < count; i++)
+            if (!(h[i] == p) && (h[k] - p).cross(h[i] - p) * s < 0.0f)
+                k = i;
+    }
+    
+    // right side keeps the hull on the left, so it goes counter-clockwise
+    int step = s > 0.0f ? 1 : count - 1;
+    Next* cur = n;
+    for (int i = 0; i < count; i++) {
+        vec2 dir = h[k] - p;
+        vec2 ne = q.m_end - p;
+        if (dir.cross(ne) * s <= 0.0f && !(cur == n && inside)) {
+            ignoreCluster(q, cl);
+            pushNextCollision(q, cur);
+            return true;
+        }
+        
+        ignoreCluster(q, cl);
+        Next col = findCollision(q, p, h[k], true);
+        if (col.type) {
+            pushCollision(q, cur, col);
+            return true;
         }
+        
+        Next* next = q.m_nextPool.alloc();
+        next->type = 2;
+        next->dir = cur->dir;
+        next->last = false;
+        next->cost = cur->cost + col.cost;
+        next->pos = h[k];
+        next->from = cur;
+        next->obstacle = n->obstacle;
+        
+        float hh = heuristics(q.m_end, h[k]);
+        updateBest(q, next, hh);
+        
+        cur = next;
+        p = h[k];
+        k = (k + step) % count;
+    }
+    
+    q.queueInsert(cur, cur->cost + heuristics(q.m_end, cur->pos));
+    return true;
+}
+
+// Members of cluster are skipped by the next findCollision
+void WallTracing::ignoreCluster(Query& q, const Cluster& cl) const {
+    for (U32 i = 0; i < cl.count; i++)
+        q.m_obstacleRequest[q.m_obstacles->clusterMembers[cl.first + i]->id] = q.m_curRequest + 1;
+}
+
+// Pushes wall or obstacle hit on the way from n
+void WallTracing::pushCollision(Query& q, Next* n, const Next& col) const {
+    if (col.type == 1) {
+        U32 ch = q.m_cornerChecked[n->dir == 1 ? col.corner->id : col.corner->right->id];
+        if (ch == q.m_curCheck)
+            return;
+        
+        float h = heuristics(q.m_end, col.pos);
+        float cost = n->cost + col.cost;
+        
+        Next* next = q.m_nextPool.alloc();
+        next->type = 1;
+        next->dir = n->dir;
+        next->last = col.last;
+        next->cost = cost;
+        next->pos = col.pos;
+        next->from = n;
+        next->obstacle = col.obstacle;
+        q.queueInsert(next, h + cost);
+        
+        updateBest(q, next, h);
+    }
+    else {
+        if (q.m_obstacleChecked[col.obstacle->id] == q.m_curCheck)
+            return;
+        q.m_obstacleChecked[col.obstacle->id] = q.m_curCheck;
+        
+        float h = heuristics(q.m_end, col.pos);
+        float cost = n->cost + col.cost;
+        
+        Next* next = q.m_nextPool.alloc();
+        next->type = 2;
+        next->dir = n->dir;
+        next->last = col.last;
+        next->cost = cost;
+        next->pos = col.pos;
+        next->from = n;
+        next->obstacle = col.obstacle;
+        q.queueInsert(next, h + cost);
+        
+        updateBest(q, next, h);
     }
 }
 
-void WallTracing::pushNextCollision(Next* n) {
-    Next col = findCollision(n->pos, m_end, true);
+void WallTracing::pushNextCollision(Query& q, Next* n) const {
+    Next col = findCollision(q, n->pos, q.m_end, true);
     if (col.type == 1) {
-        float h = heuristics(m_end, col.pos);
+        float h = heuristics(q.m_end, col.pos);
         float cost = n->cost + col.cost;
         float p = cost + h;
         
-        if (col.corner->checked != m_curCheck) {
-            Next* left = m_nextPool.alloc();
+        if (q.m_cornerChecked[col.corner->id] != q.m_curCheck) {
+            Next* left = q.m_nextPool.alloc();
             left->type = 1;
             left->dir = 1;
             left->last = col.last;
@@ -621,15 +2002,12 @@ void WallTracing::pushNextCollision(Next* n) {
             left->pos = col.pos;
             left->from = n;
             left->corner = col.corner;
-            m_queue.insert(left, p);
+            q.queueInsert(left, p);
             
-            if (h < m_bestH) {
-                m_best = left;
-                m_bestH = h;
-            }
+            updateBest(q, left, h);
         }
-        if (col.corner->right->checked != m_curCheck) {
-            Next* right = m_nextPool.alloc();
+        if (q.m_cornerChecked[col.corner->right->id] != q.m_curCheck) {
+            Next* right = q.m_nextPool.alloc();
             right->type = 1;
             right->dir = 2;
             right->last = col.last;
@@ -637,21 +2015,18 @@ void WallTracing::pushNextCollision(Next* n) {
             right->pos = col.pos;
             right->from = n;
             right->corner = col.corner;
-            m_queue.insert(right, p);
+            q.queueInsert(right, p);
             
-            if (h < m_bestH) {
-                m_best = right;
-                m_bestH = h;
-            }
+            updateBest(q, right, h);
         }
     }
     else if (col.type == 2) {
-        if (col.obstacle->checked != m_curCheck) {
-            float h = heuristics(m_end, col.pos);
+        if (q.m_obstacleChecked[col.obstacle->id] != q.m_curCheck) {
+            float h = heuristics(q.m_end, col.pos);
             float cost = n->cost + col.cost;
             float p = cost + h;
             
-            Next* left = m_nextPool.alloc();
+            Next* left = q.m_nextPool.alloc();
             left->type = col.type;
             left->dir = 1;
             left->last = col.last;
@@ -659,9 +2034,9 @@ void WallTracing::pushNextCollision(Next* n) {
             left->pos = col.pos;
             left->from = n;
             left->obstacle = col.obstacle;
-            m_queue.insert(left, p);
+            q.queueInsert(left, p);
             
-            Next* right = m_nextPool.alloc();
+            Next* right = q.m_nextPool.alloc();
             right->type = col.type;
             right->dir = 2;
             right->last = col.last;
@@ -669,26 +2044,24 @@ void WallTracing::pushNextCollision(Next* n) {
             right->pos = col.pos;
             right->from = n;
             right->obstacle = col.obstacle;
-            m_queue.insert(right, p);
+            q.queueInsert(right, p);
             
-            if (h < m_bestH) {
-                m_best = left;
-                m_bestH = h;
-            }
+            updateBest(q, left, h);
         }
     }
     else {
-        Next* next = m_nextPool.alloc();
+        Next* next = q.m_nextPool.alloc();
         next->last = true;
-        next->pos = m_end;
+        next->pos = q.m_end;
         next->from = n;
-        m_queue.insert(next, n->cost + col.cost);
+        q.queueInsert(next, n->cost + col.cost);
     }
 }
 
-WallTracing::Next WallTracing::findCollision(vec2 from, vec2 to, bool checkCorners) {
-    m_curRequest++;
-    m_curObstacle->request = m_curRequest;
+WallTracing::Next WallTracing::findCollision(Query& q, vec2 from, vec2 to, bool checkCorners,
+                                             bool checkObstacles) const {
+    q.m_curRequest++;
+    q.m_obstacleRequest[q.m_curObstacle->id] = q.m_curRequest;
     
     Next col;
     col.type = 0;
@@ -700,140 +2073,167 @@ WallTracing::Next WallTracing::findCollision(vec2 from, vec2 to, bool checkCorne
     nook::Size hs = map()->size() / 2;
     Point2 bl, tr;
     if (from.x < to.x) {
-        bl.x = from.x - m_curRadius + hs.width;
-        tr.x = to.x + m_curRadius + hs.width;
+        bl.x = from.x - q.m_curRadius + hs.width;
+        tr.x = to.x + q.m_curRadius + hs.width;
     }
     else {
-        bl.x = to.x - m_curRadius + hs.width;
-        tr.x = from.x + m_curRadius + hs.width;
+        bl.x = to.x - q.m_curRadius + hs.width;
+        tr.x = from.x + q.m_curRadius + hs.width;
     }
     if (from.y < to.y) {
-        bl.y = from.y - m_curRadius + hs.height;
-        tr.y = to.y + m_curRadius + hs.height;
+        bl.y = from.y - q.m_curRadius + hs.height;
+        tr.y = to.y + q.m_curRadius + hs.height;
     }
     else {
-        bl.y = to.y - m_curRadius + hs.height;
-        tr.y = from.y + m_curRadius + hs.height;
+        bl.y = to.y - q.m_curRadius + hs.height;
+        tr.y = from.y + q.m_curRadius + hs.height;
     }
     bl /= RegionSize;
     tr /= RegionSize;
     
     if (checkCorners) {
+        // Chain bounds are tested once, corners are tested only in chains the segment touches
+        vec2 inf(q.m_curRadius, q.m_curRadius);
+        const RadiusClass* rc = q.m_radiusClass;
         for (int y = bl.y; y <= tr.y; y++)
-            for (int x = bl.x; x <= tr.x; x++) {
-                Region& r = m_regions[y * m_regionCount.x + x];
-                for (Corner* c : r.corners)
-                    if (c->request != m_curRequest) {
-                        c->request = m_curRequest;
-                        
-                        Corner* right = c->right;
-                        vec2 l1 = c->pos + c->normal * m_curRadius;
-                        vec2 l2 = right->pos + right->normal * m_curRadius;
-                        vec2 p;
-                        
-                        if (from == l1 || from == l2) {
-                            if (from == l2) {
-                                right->request = m_curRequest;
-                                c = right;
-                            }
-                            else
-                                c->left->request = m_curRequest;
-                            
-                            if (c->outer) {
-                                if (dir.x * c->normal.x < 0.0f && dir.y * c->normal.y < 0.0f) {
-                                    col.type = 1;
-                                    col.cost = 0.0f;
-                                    col.pos = from;
-                                    col.corner = c;
-                                    return col;
-                                }
-                                else
-                                    continue;
-                            }
-                            else {
-                                if (dir.x * c->normal.x < 0.0f || dir.y * c->normal.y < 0.0f) {
-                                    col.type = 1;
-                                    col.cost = 0.0f;
-                                    col.pos = from;
-                                    col.corner = c;
-                                    return col;
-                                }
-                                else
-                                    continue;
-                            }
-                        }
-                        
-                        if (lineIntersect(from, to, l1, l2, p)) {
-                            if (p == from) {
-                                if (c->coord.x == right->coord.x) {
-                                    if (c->normal.x * dir.x >= 0.0f)
-                                        continue;
-                                }
-                                else {
-                                    if (c->normal.y * dir.y >= 0.0f)
-                                        continue;
-                                }
-                                col.type = 1;
-                                col.cost = 0.0f;
-                                col.pos = from;
-                                col.corner = c;
+            for (int x = bl.x; x <= tr.x; x++)
+                for (U32 id : m_regions[y * m_regionCount.x + x].chains) {
+                    if (q.m_chainRequest[id] == q.m_curRequest)
+                        continue;
+                    q.m_chainRequest[id] = q.m_curRequest;
+                    const Chain& ch = m_chains[id];
+                    if (!segmentBox(from, to, ch.min - inf, ch.max + inf))
+                        continue;
+                    
+                    if (rc) {
+                        for (const Segment* sg = rc->chains[id]; sg; sg = sg->next)
+                            if (q.m_cornerRequest[sg->id] != q.m_curRequest &&
+                                collideCorner(q, col, sg->corner, sg->l1, sg->l2, from, to))
                                 return col;
-                            }
-                            
-                            float dist2 = (p - from).length2();
-                            if (dist2 < col.cost) {
-                                col.type = 1;
-                                col.cost = dist2;
-                                col.pos = p;
-                                col.corner = c;
-                            }
-                        }
                     }
-            }
+                    else {
+                        Corner* c = ch.first;
+                        for (U32 i = 0; i < ch.count; i++, c = c->right)
+                            if (q.m_cornerRequest[c->id] != q.m_curRequest &&
+                                collideCorner(q, col, c, inflate(q, c), inflate(q, c->right), from, to))
+                                return col;
+                    }
+                }
     }
     
-    for (int y = bl.y; y <= tr.y; y++)
-        for (int x = bl.x; x <= tr.x; x++) {
-            Region& r = m_regions[y * m_regionCount.x + x];
-            for (Obstacle* o : r.obstacles) {
-                if (o->request != m_curRequest) {
-                    o->request = m_curRequest;
-                    
-                    Circle c(o->pos, o->radius + m_curRadius);
-                    vec2 p;
-                    if (circleLineIntersectOutside(c, from, to, p)) {
-                        if (p == from) {
-                            vec2 vc = c.pos - from;
-                            if (dir.dot(vc) <= 0.0f)
-                                continue;
-                            col.type = 2;
-                            col.cost = 0.0f;
-                            col.last = o == m_endObstacle;
-                            col.pos = from;
-                            col.obstacle = o;
-                            return col;
-                        }
-                        
-                        float dist2 = (p - from).length2();
-                        if (dist2 < col.cost) {
-                            col.type = 2;
-                            col.cost = dist2;
-                            col.pos = p;
-                            col.obstacle = o;
-                        }
-                    }
+    if (checkObstacles) {
+        vec2 min(min2(from.x, to.x) - q.m_curRadius, min2(from.y, to.y) - q.m_curRadius);
+        vec2 max(max2(from.x, to.x) + q.m_curRadius, max2(from.y, to.y) + q.m_curRadius);
+        bool stop = forObstacles(*q.m_obstacles, min, max, [&](Obstacle* o) {
+            if (q.m_obstacleRequest[o->id] == q.m_curRequest)
+                return false;
+            q.m_obstacleRequest[o->id] = q.m_curRequest;
+            
+            Circle c(o->pos, o->radius + q.m_curRadius);
+            vec2 p;
+            if (circleLineIntersectOutside(c, from, to, p)) {
+                if (p == from) {
+                    vec2 vc = c.pos - from;
+                    if (dir.dot(vc) <= 0.0f)
+                        return false;
+                    col.type = 2;
+                    col.cost = 0.0f;
+                    col.last = o == q.m_endObstacle;
+                    col.pos = from;
+                    col.obstacle = o;
+                    return true;
+                }
+                
+                float dist2 = (p - from).length2();
+                if (dist2 < col.cost) {
+                    col.type = 2;
+                    col.cost = dist2;
+                    col.pos = p;
+                    col.obstacle = o;
                 }
             }
-        }
+            return false;
+        });
+        if (stop)
+            return col;
+    }
     
     col.cost = std::sqrt(col.cost);
     
     if (col.type == 2) {
-        float rd = (col.obstacle->radius + m_curRadius) * (kr2 - 1.0f);
+        float rd = (col.obstacle->radius + q.m_curRadius) * (kr2 - 1.0f);
         if (col.cost > rd)
             col.pos += (from - col.pos) * (rd / col.cost);
-        col.last = col.obstacle == m_endObstacle;
+        col.last = col.obstacle == q.m_endObstacle;
     }
     
     return col;
 }
+
+// Returns true when collision is at the start of segment and search can stop
+bool WallTracing::collideCorner(Query& q, Next& col, Corner* c, vec2 l1, vec2 l2, vec2 from, vec2 to) const {
+    q.m_cornerRequest[c->id] = q.m_curRequest;
+    
+    Corner* right = c->right;
+    vec2 dir = to - from;
+    vec2 p;
+                        
+    if (from == l1 || from == l2) {
+        if (from == l2) {
+            q.m_cornerRequest[right->id] = q.m_curRequest;
+            c = right;
+        }
+        else
+            q.m_cornerRequest[c->left->id] = q.m_curRequest;
+        
+        if (c->outer) {
+            if (dir.x * c->normal.x < 0.0f && dir.y * c->normal.y < 0.0f) {
+                col.type = 1;
+                col.cost = 0.0f;
+                col.pos = from;
+                col.corner = c;
+                return true;
+            }
+            else
+                return false;
+        }
+        else {
+            if (dir.x * c->normal.x < 0.0f || dir.y * c->normal.y < 0.0f) {
+                col.type = 1;
+                col.cost = 0.0f;
+                col.pos = from;
+                col.corner = c;
+                return true;
+            }
+            else
+                return false;
+        }
+    }
+                        
+    if (lineIntersect(from, to, l1, l2, p)) {
+        if (p == from) {
+            if (c->coord.x == right->coord.x) {
+                if (c->normal.x * dir.x >= 0.0f)
+                    return false;
+            }
+            else {
+                if (c->normal.y * dir.y >= 0.0f)
+                    return false;
+            }
+            col.type = 1;
+            col.cost = 0.0f;
+            col.pos = from;
+            col.corner = c;
+            return true;
+        }
+                            
+        float dist2 = (p - from).length2();
+        if (dist2 < col.cost) {
+            col.type = 1;
+            col.cost = dist2;
+            col.pos = p;
+            col.corner = c;
+        }
+    }
+    return false;
+}
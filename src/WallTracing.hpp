@@ -2,28 +2,103 @@
 #pragma once
 
 #include "Coord.hpp"
+#include "Occupancy.hpp"
+
+#include <atomic>
+#include <cstring>
 
 class WallTracing {
 public:
-    WallTracing();
+    class Query;
+    
+    // Search stops when any of limits is reached, 0 means no limit
+    struct Budget {
+        int iterations = 20;
+        float microseconds = 0.0f;
+    };
+    
+    enum class Status {
+        Complete,   // path reaches end
+        Partial,    // end is unreachable, path leads to the closest found point
+        Exhausted,  // budget is over or path has more than MaxPathPoints, it leads towards the best point
+        Overflow,   // open list is over MaxQueuePages pages, path leads to the best point found so far
+        Count
+    };
+    
+    // threadCount <= 0 uses all hardware threads, result is the same for any count.
+    // At most maxObstacles obstacles exist at the same time.
+    WallTracing(int threadCount = 0, int maxObstacles = 4096);
     ~WallTracing();
     
+    // Obstacles are double buffered: changes are written into the set no query reads
+    // and become visible to queries started after that. Game thread only.
     void addObstacle(nook::Circle o);
     void removeObstacle(nook::Circle o);
+    // Obstacles added or removed after this are also marked in occupancy for rough search
+    void setOccupancy(Occupancy* occupancy) { m_occupancy = occupancy; }
+    // Merges obstacles whose circles inflated by radius overlap, so search goes around
+    // a group of units in one step. Call once per tick after obstacles are moved,
+    // any add or remove drops clusters until the next call.
+    void clusterObstacles(float radius);
+    // Applies changes delayed by queries still running on other threads, call once per tick.
+    // Returns false while some changes are not visible to new queries yet.
+    bool commitObstacles();
+    // Rebuilds corners after walkability of cells inside dirty was changed in the map
+    void update(nook::Rect dirty);
+    
+    Status find(nook::vec2 start, nook::vec2 end, float radius, nook::Array<nook::vec2>& path,
+                Budget budget = Budget());
+    // Many queries can run in parallel while walls are not updated, each reads obstacles as they were
+    // when it started
+    Status find(Query& q, nook::vec2 start, nook::vec2 end, float radius, nook::Array<nook::vec2>& path,
+                Budget budget = Budget()) const;
+    // Writes into caller memory, count is capacity on input and number of points on output.
+    // Longer path is cut from the end and reported as Exhausted, so it can be continued from its
+    // last point. Nothing is allocated once the query has grown.
+    Status find(Query& q, nook::vec2 start, nook::vec2 end, float radius, nook::vec2* path, int& count,
+                Budget budget = Budget()) const;
+    // Corners and obstacles farther than width from corridor polyline (rough path) are not explored
+    Status findInCorridor(Query& q, nook::vec2 start, nook::vec2 end, float radius,
+                          const nook::Array<nook::vec2>& corridor, float width,
+                          nook::Array<nook::vec2>& path, Budget budget = Budget()) const;
     
-    void find(nook::vec2 start, nook::vec2 end, float radius, nook::Array<nook::vec2>& path);
+    // Revalidates path from find() against obstacles added, moved (old and new circle) or removed since.
+    // Only segments near changes are tested and only the broken span is searched again.
+    // At most 2 * maxObstacles changes per call.
+    Status repair(Query& q, nook::Array<nook::vec2>& path, float radius, const nook::Array<nook::Circle>& changed,
+                  Budget budget = Budget()) const;
+    
+    // Precomputes inflated wall segments for units of given radius, call at load time.
+    // Queries with exactly this radius read them instead of computing per corner.
+    void addRadiusClass(float radius);
+    
+    // Precomputes visibility between convex corners for units of given radius.
+    // Corners farther than range are not connected. Kept up to date by update().
+    void addVisibilityGraph(float radius, float range);
+    // Long range precise path over visibility graph of the same radius, only obstacles are checked at runtime.
+    // Falls back to find() when there is no graph for radius or path is blocked by obstacles.
+    // Budget iterations count expanded graph corners.
+    Status findVisible(Query& q, nook::vec2 start, nook::vec2 end, float radius, nook::Array<nook::vec2>& path,
+                       Budget budget = Budget()) const;
     
 private:
     static constexpr int RegionSize = 4;
+    static constexpr int ChainSize = 16;
+    static constexpr int QueuePageSize = 1024;
+    static constexpr int MaxQueuePages = 1024;
+    static constexpr int MaxPathPoints = 1024;
+    static constexpr int MaxRadiusClasses = 8;
+    static constexpr int MaxVisibilityGraphs = 8;
+    static constexpr nook::U32 NoChain = 0xffffffff;
     
     struct Corner {
-        nook::U32 checked;
-        nook::U32 request;
+        nook::U32 id;
         
         nook::vec2 pos;
         nook::vec2 normal;
         Coord coord;
         bool outer;
+        nook::U32 chain; // index in m_chains
         
         Corner* left;
         Corner* right;
@@ -32,16 +107,103 @@ private:
     };
     
     struct Obstacle {
-        nook::U32 checked;
-        nook::U32 request;
+        nook::U32 id;
         
         nook::vec2 pos;
         float radius;
+        nook::U32 cluster; // index in ObstacleSet::clusters, 0 if alone
+    };
+    
+    // ranges in ObstacleSet::clusterMembers and clusterHulls
+    struct Cluster {
+        nook::U32 first;
+        nook::U32 count;
+        nook::U32 hullFirst;
+        nook::U32 hullCount; // counter-clockwise, inflated by ObstacleSet::clusterRadius
     };
     
     struct Region {
         nook::List1<Corner*> corners;
-        nook::List1<Obstacle*> obstacles;
+        nook::List1<nook::U32> chains; // ids of chains whose bounds overlap region
+    };
+    
+    // Loose grid level, holds obstacles with radius up to half of cellSize
+    struct ObstacleLevel {
+        int cellSize;
+        nook::Point2 count;
+        int firstCell; // of this level among cells of all levels
+    };
+    
+    // Obstacles with their loose grid and clusters. Queries read the front set,
+    // changes are replayed into the other one while it has no readers.
+    struct ObstacleSet {
+        nook::List1<Obstacle*>* cells; // of all levels
+        nook::PagePool<Obstacle> pool;
+        nook::U32 count;
+        nook::Array<nook::U32> freeIds;
+        nook::Array<Obstacle*> byId;
+        
+        float clusterRadius;
+        nook::Array<Cluster> clusters;
+        nook::Array<Obstacle*> clusterMembers;
+        nook::Array<nook::vec2> clusterHulls;
+        
+        nook::U32 applied; // changes replayed into this set
+        mutable std::atomic<int> readers;
+    };
+    
+    struct ObstacleChange {
+        enum class Type { Add, Remove, Cluster } type;
+        nook::Circle circle; // radius of clustering for Cluster
+    };
+    
+    // Pins the front set for a query, nested calls restore the outer one
+    struct ObstacleLock {
+        ObstacleLock(const WallTracing& owner, Query& q);
+        ~ObstacleLock();
+        
+        Query& q;
+        const ObstacleSet* prev;
+    };
+    
+    // Bounds of up to ChainSize consecutive wall segments of one contour, not inflated.
+    // Chain goes right from first, free chains have no corners.
+    struct Chain {
+        nook::vec2 min;
+        nook::vec2 max;
+        nook::U32 count;
+        Corner* first;
+    };
+    
+    struct Segment {
+        nook::U32 id;
+        Corner* corner;
+        nook::vec2 l1; // inflated corner
+        nook::vec2 l2; // inflated right corner
+        Segment* next;
+    };
+    
+    struct RadiusClass {
+        float radius;
+        nook::Array<nook::vec2> points; // inflated corners by Corner::id
+        Segment** chains;               // by chain id, in chain order
+        nook::PagePool<Segment> segmentPool;
+    };
+    
+    struct VisibilityGraph {
+        struct Edge {
+            nook::U32 id;
+            float cost;
+            Edge* next;
+        };
+        
+        float radius;
+        float range;
+        Edge** edges; // indexed by Corner::id
+        // edges of the first build are in one block, later ones come from the pool
+        Edge* block;
+        nook::U32 blockSize;
+        nook::PagePool<Edge> edgePool;
     };
     
     struct Next {
@@ -57,7 +219,88 @@ private:
         };
     };
     
-    Coord getRegion(Corner* c) {
+public:
+    // Per-query state. One instance per thread.
+    class Query {
+    public:
+        // Stamps for every corner and obstacle id of owner are allocated here, so queries
+        // are created up front on the thread that owns memoryManager().
+        explicit Query(const WallTracing& owner);
+        
+        // number of finished queries by status
+        nook::U32 stats(Status s) const { return m_stats[(int)s]; }
+        void resetStats() { std::memset(m_stats, 0, sizeof(m_stats)); }
+        
+    private:
+        friend class WallTracing;
+        
+        void copyPath(nook::Array<nook::vec2>& path) const;
+        void copyPath(nook::vec2* path, int& count) const;
+        void clear();
+        // Binary heap over pages of the query's pool, pages are kept for later queries.
+        // Only above MaxQueuePages pages the node is dropped and the search ends as exhausted.
+        void queueInsert(Next* n, float priority);
+        Next* queuePop();
+        nook::U32 queueCount() const { return m_queueCount; }
+        
+        struct QueueItem {
+            Next* next;
+            float priority;
+        };
+        struct QueuePage {
+            QueueItem items[QueuePageSize];
+        };
+        QueueItem& queueItem(nook::U32 i) { return m_queuePages[i / QueuePageSize]->items[i % QueuePageSize]; }
+        
+        nook::PagePool<Next> m_nextPool;
+        nook::PagePool<QueuePage> m_queuePool;
+        nook::Array<QueuePage*> m_queuePages;
+        nook::U32 m_queueCount;
+        bool m_queueFull;
+        nook::Array<nook::vec2> m_points; // result from end to start, MaxPathPoints
+        nook::U32 m_stats[(int)Status::Count];
+        
+        // visited stamps indexed by Corner::id, Obstacle::id and chain id
+        nook::Array<nook::U32> m_cornerChecked;
+        nook::Array<nook::U32> m_cornerRequest;
+        nook::Array<nook::U32> m_obstacleChecked;
+        nook::Array<nook::U32> m_obstacleRequest;
+        nook::Array<nook::U32> m_cornerGoal;
+        nook::Array<nook::U32> m_chainRequest;
+        
+        // changed circles of repair() bucketed by cells of obstacle levels, lists are valid for m_curChanged
+        nook::Array<nook::U32> m_changedHead;
+        nook::Array<nook::U32> m_changedStamp;
+        nook::Array<nook::U32> m_changedNext;
+        
+        const ObstacleSet* m_obstacles;
+        
+        nook::U32 m_curCheck;
+        nook::U32 m_curRequest;
+        nook::U32 m_curChanged;
+        
+        const Obstacle* m_curObstacle;
+        const Obstacle* m_endObstacle;
+        const Obstacle* m_lastObstacle;
+        nook::vec2 m_lastOLine;
+        
+        Next* m_best;
+        float m_bestH;
+        float m_curRadius;
+        const RadiusClass* m_radiusClass;
+        bool m_useClusters;
+        int m_iter;
+        nook::vec2 m_end;
+        
+        const nook::vec2* m_corridor;
+        int m_corridorCount;
+        float m_corridorWidth2;
+        nook::vec2 m_corridorMin;
+        nook::vec2 m_corridorMax;
+    };
+    
+private:
+    Coord getRegion(Corner* c) const {
         int rx = c->coord.x / RegionSize;
         int ry = c->coord.y / RegionSize;
         rx -= (c->coord.x % RegionSize == 0) & (c->outer ^ (c->normal.x < 0));
@@ -67,39 +310,111 @@ private:
     
     // dir: 1-left. 2-right, 4-up, 8-down
     Corner getCorner(Coord coord, nook::U32 cell, int dir);
+    Corner* createCorner(Coord c, nook::vec2 n, bool o);
+    // writes up to 2 corners, returns their count
+    int extractCorners(Coord c, nook::U32 cell, Corner** corners);
+    // direction and 2x2 cell of the wall going to the right corner
+    void getWall(const Corner* corner, int& dx, int& dy, nook::U32& wall, int& dir) const;
+    Corner traceWall(const Corner* corner);
+    void linkCorner(Corner* corner);
+    void pushSegment(Corner* corner, Coord prc);
+    void unlinkCorner(Corner* corner);
     
-    Obstacle* getObstacle(nook::vec2 pos);
-    Obstacle* findObstacle(nook::vec2 pos);
-    Obstacle* findObstacle(nook::vec2 pos, float radius);
+    void initObstacleSet(ObstacleSet& s);
+    void applyChanges(ObstacleSet& s);
+    void addObstacle(ObstacleSet& s, nook::Circle o);
+    void removeObstacle(ObstacleSet& s, nook::Circle o);
+    void clusterObstacles(ObstacleSet& s, float radius);
+    int looseCell(nook::Circle o, int& level) const;
+    nook::List1<Obstacle*>* obstacleCell(const ObstacleSet& s, nook::Circle o) const;
+    template<typename F>
+    bool forLooseCells(nook::vec2 min, nook::vec2 max, F f) const;
+    template<typename F>
+    bool forObstacles(const ObstacleSet& s, nook::vec2 min, nook::vec2 max, F f) const;
+    const Obstacle* getObstacle(const Query& q, nook::vec2 pos) const;
+    const Obstacle* findObstacle(const Query& q, nook::vec2 pos) const;
+    const Obstacle* findObstacle(Query& q, nook::vec2 pos, float radius) const;
     nook::vec2 getLeftObstacle(nook::vec2 from, nook::Circle o);
     nook::vec2 getRightObstacle(nook::vec2 from, nook::Circle o);
-    void pushNextCorner(Next* n, Corner* nc);
-    void pushNextObstacle(Next* n);
-    void pushNextCollision(Next* n);
+    nook::vec2 inflate(const Query& q, const Corner* c) const {
+        return q.m_radiusClass ? q.m_radiusClass->points[c->id] : c->pos + c->normal * q.m_curRadius;
+    }
+    void releaseChain(Corner* c, nook::U32 removedMark, nook::List<Corner*>& members);
+    void growChain(nook::U32 id, Corner* c);
+    void chainRun(Corner* c);
+    void buildChains(const nook::List<Corner*>& corners);
+    // Chains are put into regions and segment lists of radius classes when they are done,
+    // bounds of a registered chain must not change
+    void pendChain(nook::U32 id);
+    void registerChains();
+    void unregisterChain(nook::U32 id);
+    template<typename F>
+    void forChainRegions(const Chain& ch, F f) const;
+    void buildChainSegments(RadiusClass& rc, nook::U32 id);
+    const RadiusClass* getRadiusClass(float radius) const;
+    
+    // f(b, cost) for every corner b visible from a
+    template<typename F>
+    void forEdges(const VisibilityGraph& g, Query& q, Corner* a, F f) const;
+    float edgeCost(const VisibilityGraph& g, Query& q, Corner* a, Corner* b) const;
+    void buildEdges(VisibilityGraph& g, Corner* a);
+    void refreshEdges(VisibilityGraph& g, Corner* a, nook::vec2 min, nook::vec2 max);
+    void clearEdges(VisibilityGraph& g, nook::U32 id);
+    template<typename F>
+    void forOuterCorners(nook::vec2 min, nook::vec2 max, F f) const;
+    bool isTaut(const Corner* c, nook::vec2 from) const;
+    void updateBest(Query& q, Next* n, float h) const;
+    bool inCorridor(const Query& q, nook::vec2 p) const;
+    void pushNextCorner(Query& q, Next* n, Corner* nc) const;
+    void pushNextObstacle(Query& q, Next* n) const;
+    bool pushNextCluster(Query& q, Next* n) const;
+    void ignoreCluster(Query& q, const Cluster& cl) const;
+    void pushCollision(Query& q, Next* n, const Next& col) const;
+    void pushNextCollision(Query& q, Next* n) const;
     
-    Next findCollision(nook::vec2 from, nook::vec2 to, bool checkCorners);
+    // query state shared by search() and findVisible()
+    void beginQuery(Query& q, nook::vec2 start, nook::vec2 end, float radius, Budget budget) const;
+    Status search(Query& q, nook::vec2 start, nook::vec2 end, float radius, Budget budget) const;
+    // false if the path was longer than MaxPathPoints, it is cut from the end then
+    bool buildPath(Query& q, nook::vec2 start) const;
+    Next findCollision(Query& q, nook::vec2 from, nook::vec2 to, bool checkCorners, bool checkObstacles = true) const;
+    bool collideCorner(Query& q, Next& col, Corner* c, nook::vec2 l1, nook::vec2 l2, nook::vec2 from, nook::vec2 to) const;
     
     nook::Size m_size;
     nook::Point2 m_regionCount;
     Region* m_regions;
+    ObstacleLevel* m_obstacleLevels;
+    int m_levelCount;
+    int m_levelCells;
     nook::PagePool<Corner> m_cornerPool;
-    nook::PagePool<Obstacle> m_obstaclePool;
-    nook::PagePool<Next> m_nextPool;
-    nook::PriorityQueue<Next*, float> m_queue;
-    nook::List<nook::vec2> m_path;
+    int m_threadCount;
+    
+    // Every grid point has at most 2 corners, so ids and chains never go over m_cornerCapacity
+    nook::U32 m_cornerCapacity;
+    nook::U32 m_obstacleCapacity;
+    nook::U32 m_cornerCount;
+    nook::Array<nook::U32> m_freeCornerIds;
+    nook::Array<Corner*> m_cornersById;
+    nook::Array<Chain> m_chains;
+    nook::Array<nook::U32> m_freeChainIds;
+    // stamps of update() and chain rebuilds, chain ids are marked when released
+    nook::Array<nook::U32> m_cornerMark;
+    nook::Array<nook::U32> m_chainMark;
+    nook::Array<nook::U8> m_chainState; // 0-unregistered, 1-registered, 2-pending
+    nook::Array<nook::U32> m_pendingChains;
+    nook::U32 m_curMark;
+    nook::Array<RadiusClass*> m_radiusClasses;
+    nook::Array<VisibilityGraph*> m_visibility;
     
-    nook::U32 m_curCheck;
-    nook::U32 m_curRequest;
+    ObstacleSet m_obstacleSets[2];
+    std::atomic<int> m_front;
+    nook::List<ObstacleChange> m_changes; // not yet replayed into both sets
+    nook::Array<nook::U32> m_clusterParent; // scratch of clusterObstacles()
+    nook::Array<nook::U32> m_clusterOf;
+    nook::Array<nook::vec2> m_hullScratch;
     
+    Occupancy* m_occupancy;
     Obstacle m_dummyObstacle;
-    Obstacle* m_curObstacle;
-    Obstacle* m_endObstacle;
-    Obstacle* m_lastObstacle;
-    nook::vec2 m_lastOLine;
-    
-    Next* m_best;
-    float m_bestH;
-    float m_curRadius;
-    int m_iter;
-    nook::vec2 m_end;
+    Query* m_query;
+    nook::Array<Query*> m_buildQueries; // one per thread of addVisibilityGraph()
 };